@@ -0,0 +1,156 @@
+/*
+ * arc.c
+ *
+ * Derek Tzeng
+ * dtzeng
+ *
+ * ARC eviction policy, in its clock-based form (CAR).
+ *
+ * ARC splits the cache between objects seen once recently (T1) and
+ * objects seen at least twice (T2), and remembers the objects recently
+ * evicted from each in ghost lists (B1 and B2). A miss on an object in B1
+ * means T1 was too small, and a miss on one in B2 means T2 was, so ARC
+ * keeps moving the target size p of T1 towards whichever would have hit,
+ * adapting between recency and frequency as the workload changes.
+ *
+ * ARC moves an object to the head of T2 on every hit, which needs the
+ * shard's lock. CAR keeps T1 and T2 as clocks instead: a hit only sets the
+ * object's referenced bit, and the clock hand, at the tail of each queue,
+ * moves referenced objects to the head of T2 when it passes them. Since
+ * objects vary in size, p and the lists are measured in bytes.
+ *
+ */
+
+#include "policy.h"
+
+/* Queues holding an object */
+#define ARC_T1 0
+#define ARC_T2 1
+
+typedef struct {
+  qlist T1;
+  qlist T2;
+  ghost *B1;
+  ghost *B2;
+  long p;           /* Target bytes for T1 */
+} arc;
+
+/*
+ * arc_init: Sets up empty queues and ghost lists for the shard.
+ */
+static void arc_init(shard *S) {
+  arc *A = Malloc(sizeof(arc));
+
+  qlist_init(&A->T1);
+  qlist_init(&A->T2);
+  A->B1 = ghost_new(S->capacity);
+  A->B2 = ghost_new(S->capacity);
+  A->p = 0;
+  S->state = A;
+}
+
+/*
+ * arc_destroy: Frees the shard's queues and ghost lists.
+ */
+static void arc_destroy(shard *S) {
+  arc *A = S->state;
+
+  ghost_free(A->B1);
+  ghost_free(A->B2);
+  free(A);
+}
+
+/*
+ * arc_insert: Queues a new object in T1, or in T2 if it was evicted
+ *             recently, adapting the target size of T1 in that case.
+ */
+static void arc_insert(shard *S, object *obj) {
+  arc *A = S->state;
+  long c = S->capacity;
+  long delta;
+
+  obj->referenced = 0;
+  if(ghost_take(A->B1, obj->hash)) {
+    delta = (A->B1->bytes > 0 && A->B2->bytes > A->B1->bytes) ?
+            obj->charge * (A->B2->bytes / A->B1->bytes) : obj->charge;
+    A->p = (A->p + delta < c) ? A->p + delta : c;
+    obj->mark = ARC_T2;
+    qlist_push(&A->T2, obj);
+    return;
+  }
+  if(ghost_take(A->B2, obj->hash)) {
+    delta = (A->B2->bytes > 0 && A->B1->bytes > A->B2->bytes) ?
+            obj->charge * (A->B1->bytes / A->B2->bytes) : obj->charge;
+    A->p = (A->p - delta > 0) ? A->p - delta : 0;
+    obj->mark = ARC_T2;
+    qlist_push(&A->T2, obj);
+    return;
+  }
+
+  /* Keep the history to about twice the cache, as in ARC */
+  while(A->B1->oldest != NULL && A->T1.bytes + A->B1->bytes > c)
+    ghost_drop_oldest(A->B1);
+  while(A->B2->oldest != NULL &&
+        A->T1.bytes + A->T2.bytes + A->B1->bytes + A->B2->bytes > 2 * c)
+    ghost_drop_oldest(A->B2);
+  obj->mark = ARC_T1;
+  qlist_push(&A->T1, obj);
+}
+
+/*
+ * arc_remove: Unlinks the object from its queue.
+ */
+static void arc_remove(shard *S, object *obj) {
+  arc *A = S->state;
+
+  qlist_remove((obj->mark == ARC_T2) ? &A->T2 : &A->T1, obj);
+}
+
+/*
+ * arc_victim: Returns the next object to evict, sweeping the clock of T1
+ *             while it is over its target, or the clock of T2.
+ */
+static object *arc_victim(shard *S) {
+  arc *A = S->state;
+  object *obj;
+
+  while(1) {
+    if(A->T1.count > 0 && (A->T1.bytes > A->p || A->T2.count == 0)) {
+      obj = A->T1.tail;
+      if(!__atomic_load_n(&obj->referenced, __ATOMIC_RELAXED))
+        return obj;
+      qlist_remove(&A->T1, obj);
+      obj->mark = ARC_T2;
+    }
+    else {
+      obj = A->T2.tail;
+      if(!__atomic_load_n(&obj->referenced, __ATOMIC_RELAXED))
+        return obj;
+      qlist_remove(&A->T2, obj);
+    }
+    __atomic_store_n(&obj->referenced, 0, __ATOMIC_RELAXED);
+    qlist_push(&A->T2, obj);
+  }
+}
+
+/*
+ * arc_evicted: Remembers the victim in the ghost list of its queue.
+ */
+static void arc_evicted(shard *S, object *obj) {
+  arc *A = S->state;
+
+  ghost_add((obj->mark == ARC_T2) ? A->B2 : A->B1, obj->hash, obj->charge);
+}
+
+/*
+ * arc_hit: Marks the object as referenced.
+ */
+static void arc_hit(object *obj) {
+  if(!__atomic_load_n(&obj->referenced, __ATOMIC_RELAXED))
+    __atomic_store_n(&obj->referenced, 1, __ATOMIC_RELAXED);
+}
+
+policy arc_policy = {
+  "arc", arc_init, arc_destroy, arc_insert, arc_remove, arc_victim,
+  arc_evicted, arc_hit
+};
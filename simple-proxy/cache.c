@@ -5,33 +5,142 @@
  * dtzeng
  *
  *
- * This cache is meant to store web objects and approximates the LRU
- * eviction policy by evicting least recently added objects.
+ * This cache is meant to store web objects and evicts them with an
+ * eviction policy chosen when the cache is created: LRU by default, or
+ * S3-FIFO, ARC, or GDSF. For the policies, see "policy.c".
  *
  * The cache stores the objects in a doubly linked list, where the first
- * object is the most recently added (MRA) and the last object is the
- * least recently added (LRA). The cache also keeps track of how many bytes
- * are left for usage.
+ * object is the most recently accessed (MRA) and the last object is the
+ * least recently accessed (LRA). Only the LRU policy reorders the list;
+ * the other policies keep queues of their own, and the list is then in
+ * insertion order. The cache also keeps track of how many bytes are left
+ * for usage.
  *
- * An object keeps track of the request, the response of the request,
- * and the size of the object in bytes. The object also includes a previous
- * and next pointer for the doubly linked list implementation.
+ * Hits take no lock at all, so they cannot reorder any list. Instead,
+ * find_request tells the policy about the hit, which may only update the
+ * object with atomic operations, and the policy acts on it lazily at
+ * eviction time. The LRU policy, for instance, sets a referenced bit, and
+ * gives an LRA object whose bit is set a second chance by clearing the bit
+ * and moving it to the MRA end.
  *
- * To provide space for a new insertion, least recently added objects are
- * continually evicted until the required space is sufficient.
+ * An object keeps track of the request, the response of the request
+ * (a chain of segments, see "segbuf.c"), and the size of the response in
+ * bytes. It also keeps when the response goes stale and its validators,
+ * which the proxy fills in from the response headers; a stale object is
+ * still found by lookups, so the proxy can revalidate it, and storing a
+ * new response for the same request replaces it. Lookups count the hits
+ * on each object, which background refreshes use to find the hottest
+ * objects (see "refresh.c"). The object also includes a previous and next
+ * pointer for the doubly linked list implementation.
+ *
+ * Objects, and copies of their requests and validators, are allocated
+ * from slab pools (see "slab.c") rather than malloc, as are the segments
+ * of their responses: objects from a pool of their own, and strings from
+ * pools of blocks doubling in size from STRING_MIN bytes to MAXLINE.
+ *
+ * The byte budget covers all the memory an object takes up, not just its
+ * response: the blocks of the object itself, its request and validators,
+ * and the segments holding the response. An object's charge is computed
+ * when it is stored. Each shard's hash index and sketch are charged to
+ * its budget too, so the memory the cache uses stays close to its
+ * configured size, apart from the eviction policies' own bookkeeping.
+ *
+ * To avoid scanning the whole list on every lookup, the cache also indexes
+ * its objects in an open addressing hash table, probed linearly and keyed
+ * by a 64-bit FNV-1a hash of the request, which is computed once when the
+ * object is created. A removed object's slot is marked with a tombstone,
+ * so probes for the objects after it still find them. Once live objects
+ * and tombstones fill half the slots, the table is rebuilt without the
+ * tombstones, at twice the size if objects alone fill a quarter, so
+ * lookups stay O(1) regardless of how many objects are cached.
+ *
+ * To provide space for a new insertion, the objects picked by the policy
+ * are continually evicted until the required space is sufficient. With
+ * TinyLFU admission enabled, each shard also keeps a sketch of recent
+ * request frequencies (see "sketch.c"), and a new object is only let in
+ * if it has been requested more often than the first victim the policy
+ * picks for it, so one-off requests cannot wash out the hot objects. A
+ * new response for a request already cached replaces the old one without
+ * this check. Evicted objects can be handed to a demote hook, such as the
+ * disk tier (see "disk.c"), once the shard lock has been dropped.
+ *
+ * To keep lock contention down, the cache is split into shards selected by
+ * the high bits of the request hash. Each shard has its own lock, object
+ * list, policy state, hash index, and an equal share of the byte budget,
+ * so requests for different objects rarely touch the same lock. The shard
+ * functions expect the caller to hold the shard's lock, while cache_store
+ * takes it itself.
+ *
+ * Lookups, which far outnumber insertions, take no lock, so hits on a hot
+ * shard never serialize on it. The shard's lock only serializes writers,
+ * which change the index with atomic stores, while a lookup probes it with
+ * atomic loads inside an epoch read (see "epoch.c"). Growing the index
+ * builds a new table and publishes it with a single pointer store, and
+ * the old table is retired rather than freed, so a lookup still probing it
+ * stays safe.
+ *
+ * Objects are reference counted, with the cache holding one reference for
+ * as long as the object is linked in. cache_lookup pins the object it finds
+ * before leaving the epoch read, but only if the count has not already
+ * dropped to zero, so a hit can be written to a slow client without
+ * blocking writers. Removing an object only drops the cache's reference.
+ * Whoever releases the last one frees the response at once, and retires
+ * the object itself, which lookups may still be comparing against.
  *
  */
 
 #include "cache.h"
+#include "epoch.h"
+
+/* Marks the index slot of a removed object */
+#define TOMBSTONE ((object *)1)
+
+/* FNV-1a 64-bit parameters */
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+/* Pools for objects and for strings, from the smallest */
+static slab_pool object_pool;
+static slab_pool string_pools[STRING_POOLS];
+static pthread_once_t pools_once = PTHREAD_ONCE_INIT;
+
+static void init_pools(void);
+static char *copy_string(char *str);
+static void free_object(void *block);
+static index_table *index_new(int num_slots);
+static long index_bytes(int num_slots);
+static object *index_find(index_table *T, char *req, uint64_t hash);
+static void index_insert(shard *S, object *obj);
+static void index_remove(shard *S, object *obj);
+static void index_rebuild(shard *S);
+static int store(cache *C, object *obj, int (*insert)(shard *, object *));
 
 /*
- * cache_init: Allocates a new cache and returns it.
+ * cache_init: Allocates a new cache of num_shards shards, splitting
+ *             max_size bytes evenly between them, which evicts with the
+ *             given policy, and returns it.
  */
-cache *cache_init(int max_size) {
+cache *cache_init(int64_t max_size, int num_shards, policy *P) {
   cache *C = Malloc(sizeof(cache));
-  C->bytes_left = max_size;
-  C->MRA = NULL;
-  C->LRA = NULL;
+  C->num_shards = num_shards;
+  C->shards = Malloc(num_shards * sizeof(shard));
+  int i;
+  for(i = 0; i < num_shards; i++) {
+    shard *S = &C->shards[i];
+    pthread_mutex_init(&S->lock, NULL);
+    S->capacity = max_size / num_shards;
+    S->bytes_left = S->capacity - index_bytes(INIT_SLOTS);
+    S->num_objects = 0;
+    S->num_tombstones = 0;
+    S->index = index_new(INIT_SLOTS);
+    S->MRA = NULL;
+    S->LRA = NULL;
+    S->evicted = NULL;
+    S->policy = P;
+    S->sketch = NULL;
+    P->init(S);
+  }
+  C->demote = NULL;
   return C;
 }
 
@@ -39,50 +148,143 @@ cache *cache_init(int max_size) {
  * cache_free: Frees the given cache.
  */
 void cache_free(cache *C) {
-  while(C->MRA != NULL) {
-    cache_remove(C, C->MRA);
+  int i;
+  for(i = 0; i < C->num_shards; i++) {
+    shard *S = &C->shards[i];
+    while(S->MRA != NULL) {
+      cache_remove(S, S->MRA);
+    }
+    S->policy->destroy(S);
+    if(S->sketch != NULL)
+      sketch_free(S->sketch);
+    free(S->index);
+    pthread_mutex_destroy(&S->lock);
   }
+  free(C->shards);
   free(C);
 }
 
 /*
- * cache_insert: Evicts for sufficient space, then inserts the given object
- *               into the cache as the MRA object.
+ * cache_admission: Enables TinyLFU admission, counting the requests for
+ *                  each shard in a sketch sized to the shard, and charged
+ *                  to it.
+ */
+void cache_admission(cache *C) {
+  int i;
+  for(i = 0; i < C->num_shards; i++) {
+    shard *S = &C->shards[i];
+    S->sketch = sketch_new(S->capacity);
+    S->bytes_left -= sketch_bytes(S->sketch);
+  }
+}
+
+/*
+ * cache_fit_shards: Returns the most shards, up to num_shards, that a cache
+ *                   of max_size bytes can be split into while every shard
+ *                   can still hold an object of max_object bytes. Each
+ *                   shard needs the worst case charge of such an object, on
+ *                   top of its index and, with admission, its sketch.
+ *                   Returns at least 1.
+ */
+int cache_fit_shards(int64_t max_size, int num_shards, long max_object,
+                     int admission) {
+  long seg_block = (sizeof(segment) + SEG_SIZE + SLAB_ALIGN - 1) &
+                   ~(long)(SLAB_ALIGN - 1);
+  long object_block = (sizeof(object) + SLAB_ALIGN - 1) &
+                      ~(long)(SLAB_ALIGN - 1);
+  int64_t capacity, need;
+
+  /* The request and both validators may each take a MAXLINE block */
+  need = object_block + 3 * MAXLINE +
+         (max_object + SEG_SIZE - 1) / SEG_SIZE * seg_block +
+         index_bytes(INIT_SLOTS);
+  for(; num_shards > 1; num_shards--) {
+    capacity = max_size / num_shards;
+    if(capacity >= need +
+       (admission ? sketch_capacity_bytes(capacity) : 0))
+      break;
+  }
+  return num_shards;
+}
+
+/*
+ * cache_shard: Returns the shard responsible for the given request hash.
+ *              The high bits are used, since the low bits pick the slot.
  */
-void cache_insert(cache *C, object *obj) {
-  evict(C, obj->size);
-  C->bytes_left -= obj->size;
+shard *cache_shard(cache *C, uint64_t hash) {
+  return &C->shards[(hash >> 32) % C->num_shards];
+}
 
-  if(C->MRA == NULL) {
-    C->MRA = obj;
-    C->LRA = obj;
+/*
+ * cache_insert: Removes any object cached for the same request, evicts
+ *               for sufficient space, then inserts the given object into
+ *               the shard as the MRA object, charging it to the shard.
+ *               A replacement skips admission, since its request already
+ *               earned a place. Returns 0 on success, or -1 if the object
+ *               was not admitted or cannot fit.
+ */
+int cache_insert(shard *S, object *obj) {
+  object *old;
+  int replacing = 0;
+
+  /* Replace any response already cached for the request */
+  if((old = index_find(S->index, obj->request, obj->hash)) != NULL) {
+    cache_remove(S, old);
+    replacing = 1;
+  }
+
+  if(obj->charge == 0)
+    obj->charge = object_charge(obj);
+  if(evict(S, obj, replacing) < 0)
+    return -1;
+  S->bytes_left -= obj->charge;
+
+  if(S->MRA == NULL) {
+    S->MRA = obj;
+    S->LRA = obj;
   }
   else {
-    object *temp = C->MRA;
-    C->MRA = obj;
+    object *temp = S->MRA;
+    S->MRA = obj;
     obj->prev = NULL;
     obj->next = temp;
     temp->prev = obj;
   }
-  return;
+  /* Set up the policy's state before lookups can see the object */
+  S->policy->insert(S, obj);
+  index_insert(S, obj);
+  return 0;
 }
 
 /*
- * cache_remove: Removes the given object from the cache.
+ * cache_insert_absent: Inserts the object like cache_insert, unless an
+ *                      object is already cached for the same request.
+ *                      Returns 0 on success, or -1 if the request was
+ *                      cached or the object was not inserted.
  */
-void cache_remove(cache *C, object *obj) {
-  C->bytes_left += obj->size;
+int cache_insert_absent(shard *S, object *obj) {
+  if(index_find(S->index, obj->request, obj->hash) != NULL)
+    return -1;
+  return cache_insert(S, obj);
+}
+
+/*
+ * cache_remove: Removes the given object from the shard.
+ */
+void cache_remove(shard *S, object *obj) {
+  S->policy->remove(S, obj);
+  S->bytes_left += obj->charge;
   if(obj->prev == NULL && obj->next == NULL) {
-    C->MRA = NULL;
-    C->LRA = NULL;
+    S->MRA = NULL;
+    S->LRA = NULL;
   }
   else if(obj->prev == NULL) {
-    C->MRA = obj->next;
-    C->MRA->prev = NULL;
+    S->MRA = obj->next;
+    S->MRA->prev = NULL;
   }
   else if(obj->next == NULL) {
-    C->LRA = obj->prev;
-    C->LRA->next = NULL;
+    S->LRA = obj->prev;
+    S->LRA->next = NULL;
   }
   else {
     object *prev_obj = obj->prev;
@@ -90,46 +292,439 @@ void cache_remove(cache *C, object *obj) {
     prev_obj->next = next_obj;
     next_obj->prev = prev_obj;
   }
-
-  free(obj->request);
-  free(obj->response);
-  free(obj);
+  index_remove(S, obj);
+  release_object(obj);
   return;
 }
 
 /*
- * new_object: Allocates a new object and returns it.
+ * new_object: Allocates a new object for a copy of the request, which
+ *             takes over the chain of segments holding its response, and
+ *             returns it.
  */
-object *new_object(char *req, char *resp, int obj_size) {
-  object *obj = Malloc(sizeof(object));
-  obj->request = req;
+object *new_object(char *req, segment *resp, int obj_size) {
+  object *obj;
+
+  pthread_once(&pools_once, init_pools);
+  obj = slab_alloc(&object_pool);
+  obj->request = copy_string(req);
   obj->response = resp;
   obj->size = obj_size;
+  obj->charge = 0;
+  obj->hash = cache_hash(obj->request);
+  obj->expires = 0;
+  obj->etag = NULL;
+  obj->last_modified = NULL;
+  obj->hits = 0;
+  obj->refreshing = 0;
+  obj->referenced = 0;
+  obj->refcount = 1;
   obj->prev = NULL;
   obj->next = NULL;
+  obj->chain = NULL;
+  obj->freq = 0;
+  obj->mark = 0;
+  obj->pos = -1;
+  obj->priority = 0;
+  obj->qprev = NULL;
+  obj->qnext = NULL;
   return obj;
 }
 
 /*
- * evict: Evicts LRA objects from the cache until the cache has enough space
- *        for the requested size.
+ * object_validators: Gives the object copies of its validators, either of
+ *                    which may be NULL or empty if the response has none.
  */
-void evict(cache *C, int req_size) {
-  while(C->bytes_left < req_size) {
-    cache_remove(C, C->LRA);
-  }
+void object_validators(object *obj, char *etag, char *last_modified) {
+  if(etag != NULL && etag[0] != '\0')
+    obj->etag = copy_string(etag);
+  if(last_modified != NULL && last_modified[0] != '\0')
+    obj->last_modified = copy_string(last_modified);
 }
 
 /*
- * find_request: Finds the request in the cache and returns the object.
- *               If the request was not found, returns NULL.
+ * evict: Evicts the objects picked by the shard's policy until the shard
+ *        has enough space for the given object. Evicted objects stay
+ *        pinned on the shard's evicted list, linked through their chain
+ *        pointers, until cache_store hands them off. With admission
+ *        enabled, and the object not already admitted, returns -1 without
+ *        evicting anything if the first victim was requested at least as
+ *        often as the object. Returns 0 once there is space, or -1 if the
+ *        object does not fit in the empty shard.
  */
-object *find_request(cache *C, char *req) {
-  object *scan;
-  for(scan = C->MRA; scan != NULL; scan = scan->next) {
-    if((strcmp(req, scan->request)) == 0) {
-      return scan;
+int evict(shard *S, object *obj, int admitted) {
+  admitted |= (S->sketch == NULL);
+  object *victim;
+
+  while(S->bytes_left < obj->charge) {
+    if(S->num_objects == 0)
+      return -1;
+    victim = S->policy->victim(S);
+
+    /* Picking a victim leaves no trace, so a rejected object costs none */
+    if(!admitted) {
+      if(sketch_estimate(S->sketch, obj->hash) <=
+         sketch_estimate(S->sketch, victim->hash))
+        return -1;
+      admitted = 1;
     }
+    S->policy->evicted(S, victim);
+    __atomic_add_fetch(&victim->refcount, 1, __ATOMIC_RELAXED);
+    cache_remove(S, victim);
+    victim->chain = S->evicted;
+    S->evicted = victim;
+  }
+  return 0;
+}
+
+/*
+ * find_request: Finds the request, whose hash is given, in the shard and
+ *               returns the object, counting the hit and telling the
+ *               policy about it. If the request was not found, returns
+ *               NULL. The caller is in an epoch read or holds the shard's
+ *               lock.
+ */
+object *find_request(shard *S, char *req, uint64_t hash) {
+  index_table *T = __atomic_load_n(&S->index, __ATOMIC_ACQUIRE);
+  object *obj = index_find(T, req, hash);
+
+  if(obj != NULL) {
+    __atomic_add_fetch(&obj->hits, 1, __ATOMIC_RELAXED);
+    S->policy->hit(obj);
+  }
+  return obj;
+}
+
+/*
+ * cache_lookup: Finds the request in the cache without taking the shard's
+ *               lock and returns the object pinned, or NULL if it was not
+ *               found. The caller must release_object the result when
+ *               done. With admission enabled, the request is counted
+ *               either way.
+ */
+object *cache_lookup(cache *C, char *req) {
+  uint64_t hash = cache_hash(req);
+  shard *S = cache_shard(C, hash);
+  object *obj;
+  int refs;
+
+  if(S->sketch != NULL)
+    sketch_add(S->sketch, hash);
+  epoch_enter();
+  obj = find_request(S, req, hash);
+
+  /* An object whose last reference is gone was just removed: a miss */
+  if(obj != NULL) {
+    refs = __atomic_load_n(&obj->refcount, __ATOMIC_RELAXED);
+    do {
+      if(refs == 0) {
+        obj = NULL;
+        break;
+      }
+    } while(!__atomic_compare_exchange_n(&obj->refcount, &refs, refs + 1, 1,
+                                         __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+  }
+  epoch_exit();
+  return obj;
+}
+
+/*
+ * cache_contains: Returns 1 if the request is cached, or 0 if not, without
+ *                 counting it as a request or a hit. The answer may be out
+ *                 of date as soon as it is returned.
+ */
+int cache_contains(cache *C, char *req) {
+  uint64_t hash = cache_hash(req);
+  shard *S = cache_shard(C, hash);
+  index_table *T;
+  int found;
+
+  epoch_enter();
+  T = __atomic_load_n(&S->index, __ATOMIC_ACQUIRE);
+  found = (index_find(T, req, hash) != NULL);
+  epoch_exit();
+  return found;
+}
+
+/*
+ * cache_store: Inserts the object into its shard under the shard's lock.
+ *              The cache takes over the caller's reference, and drops it
+ *              if the object is not admitted. The objects evicted to make
+ *              room are then passed to the cache's demote hook, if any,
+ *              and released without holding the lock.
+ */
+void cache_store(cache *C, object *obj) {
+  store(C, obj, cache_insert);
+}
+
+/*
+ * cache_store_absent: Stores the object like cache_store, unless an object
+ *                     is already cached for the same request, so it never
+ *                     replaces a response fetched in the meantime. Returns
+ *                     1 if the object was stored, or 0 if it was dropped.
+ */
+int cache_store_absent(cache *C, object *obj) {
+  return store(C, obj, cache_insert_absent);
+}
+
+/*
+ * store: Inserts the object into its shard with the given insert function,
+ *        for cache_store and cache_store_absent. Returns 1 if the object
+ *        was stored, or 0 if it was dropped.
+ */
+static int store(cache *C, object *obj, int (*insert)(shard *, object *)) {
+  shard *S = cache_shard(C, obj->hash);
+  object *evicted;
+  int admitted;
+
+  /* Walk the response's segments before taking the lock */
+  obj->charge = object_charge(obj);
+  pthread_mutex_lock(&S->lock);
+  admitted = (insert(S, obj) == 0);
+  evicted = S->evicted;
+  S->evicted = NULL;
+  pthread_mutex_unlock(&S->lock);
+
+  if(!admitted)
+    release_object(obj);
+
+  while(evicted != NULL) {
+    object *next = evicted->chain;
+    if(C->demote != NULL)
+      C->demote(evicted);
+    release_object(evicted);
+    evicted = next;
+  }
+  return admitted;
+}
+
+/*
+ * release_object: Drops a reference to the object, and frees it once the
+ *                 last reference is gone. Lookups never pin an object
+ *                 without references, so its response and validators are
+ *                 freed at once, but they may still compare its request,
+ *                 so the rest is retired until they are done.
+ */
+void release_object(object *obj) {
+  if(__atomic_sub_fetch(&obj->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+    slab_free(obj->etag);
+    slab_free(obj->last_modified);
+    seg_put(obj->response);
+    epoch_retire(obj, free_object);
+  }
+}
+
+/*
+ * object_fresh: Returns 1 if the object has not gone stale, or 0 if it
+ *               must be revalidated before it is used.
+ */
+int object_fresh(object *obj) {
+  time_t expires = __atomic_load_n(&obj->expires, __ATOMIC_RELAXED);
+  return (expires == 0 || time(NULL) < expires);
+}
+
+/*
+ * move_to_MRA: Moves an object already in the shard to the MRA end.
+ */
+void move_to_MRA(shard *S, object *obj) {
+  if(S->MRA == obj)
+    return;
+
+  /* Unlink (obj is not the MRA, so it has a previous object) */
+  obj->prev->next = obj->next;
+  if(obj->next == NULL)
+    S->LRA = obj->prev;
+  else
+    obj->next->prev = obj->prev;
+
+  /* Relink at the MRA end */
+  obj->prev = NULL;
+  obj->next = S->MRA;
+  S->MRA->prev = obj;
+  S->MRA = obj;
+}
+
+/*
+ * cache_hash: Returns the 64-bit FNV-1a hash of the request.
+ */
+uint64_t cache_hash(char *req) {
+  uint64_t hash = FNV_OFFSET;
+  unsigned char *p;
+  for(p = (unsigned char *)req; *p != '\0'; p++) {
+    hash ^= *p;
+    hash *= FNV_PRIME;
+  }
+  return hash;
+}
+
+/*
+ * object_charge: Returns the bytes of memory the object takes up, which
+ *                includes its request, validators, and every segment of
+ *                its response. Without segments, as in the simulator, the
+ *                response is charged the full segments it would fill.
+ */
+int object_charge(object *obj) {
+  long charge = slab_block_size(obj) + slab_block_size(obj->request);
+  segment *seg;
+
+  if(obj->etag != NULL)
+    charge += slab_block_size(obj->etag);
+  if(obj->last_modified != NULL)
+    charge += slab_block_size(obj->last_modified);
+  if(obj->response == NULL)
+    return charge + (long)(obj->size + SEG_SIZE - 1) / SEG_SIZE *
+                    (sizeof(segment) + SEG_SIZE);
+  for(seg = obj->response; seg != NULL; seg = seg->next)
+    charge += slab_block_size(seg);
+  return charge;
+}
+
+/*
+ * alloc_size: Returns the bytes malloc takes up for a block of n bytes.
+ */
+long alloc_size(long n) {
+  n = (n + ALLOC_HEADER + ALLOC_ALIGN - 1) & ~(long)(ALLOC_ALIGN - 1);
+  return (n < ALLOC_MIN) ? ALLOC_MIN : n;
+}
+
+/*
+ * init_pools: Creates the object and string pools, once.
+ */
+static void init_pools(void) {
+  int i;
+
+  slab_pool_init(&object_pool, sizeof(object));
+  for(i = 0; i < STRING_POOLS; i++)
+    slab_pool_init(&string_pools[i], STRING_MIN << i);
+}
+
+/*
+ * copy_string: Returns a copy of the string in a block of the smallest
+ *              string pool it fits in.
+ */
+static char *copy_string(char *str) {
+  int len = strlen(str) + 1;
+  int i;
+  char *copy;
+
+  for(i = 0; i < STRING_POOLS - 1 && len > string_pools[i].size; i++)
+    ;
+  if(len > string_pools[i].size)
+    app_error("copy_string error: string too long");
+  copy = slab_alloc(&string_pools[i]);
+  memcpy(copy, str, len);
+  return copy;
+}
+
+/*
+ * free_object: Frees a retired object and its request.
+ */
+static void free_object(void *block) {
+  object *obj = block;
+  slab_free(obj->request);
+  slab_free(obj);
+}
+
+/*
+ * index_new: Returns a new index table of num_slots empty slots.
+ */
+static index_table *index_new(int num_slots) {
+  index_table *T = Calloc(1, sizeof(index_table) +
+                             num_slots * sizeof(object *));
+  T->num_slots = num_slots;
+  return T;
+}
+
+/*
+ * index_bytes: Returns the bytes an index table of num_slots slots takes
+ *              up.
+ */
+static long index_bytes(int num_slots) {
+  return alloc_size(sizeof(index_table) + num_slots * sizeof(object *));
+}
+
+/*
+ * index_find: Probes the table for the request, whose hash is given, and
+ *             returns its object, or NULL if it is not in the table. Safe
+ *             to call while a writer changes the table, since the table
+ *             always has empty slots to end the probe.
+ */
+static object *index_find(index_table *T, char *req, uint64_t hash) {
+  int mask = T->num_slots - 1;
+  int i = hash & mask;
+  object *obj;
+
+  while((obj = __atomic_load_n(&T->slots[i], __ATOMIC_ACQUIRE)) != NULL) {
+    if(obj != TOMBSTONE && obj->hash == hash && !strcmp(req, obj->request))
+      return obj;
+    i = (i + 1) & mask;
   }
   return NULL;
 }
+
+/*
+ * index_insert: Puts the object in the first free slot of its probe
+ *               sequence, rebuilding the table if it is over half full.
+ *               The object is published by the store, so it must be
+ *               filled in first.
+ */
+static void index_insert(shard *S, object *obj) {
+  index_table *T = S->index;
+  int mask = T->num_slots - 1;
+  int i = obj->hash & mask;
+
+  while(T->slots[i] != NULL && T->slots[i] != TOMBSTONE)
+    i = (i + 1) & mask;
+  if(T->slots[i] == TOMBSTONE)
+    S->num_tombstones--;
+  __atomic_store_n(&T->slots[i], obj, __ATOMIC_RELEASE);
+  S->num_objects++;
+  if((S->num_objects + S->num_tombstones) * 2 > T->num_slots)
+    index_rebuild(S);
+}
+
+/*
+ * index_remove: Replaces the object's slot with a tombstone.
+ */
+static void index_remove(shard *S, object *obj) {
+  index_table *T = S->index;
+  int mask = T->num_slots - 1;
+  int i = obj->hash & mask;
+
+  while(T->slots[i] != obj)
+    i = (i + 1) & mask;
+  __atomic_store_n(&T->slots[i], TOMBSTONE, __ATOMIC_RELEASE);
+  S->num_tombstones++;
+  S->num_objects--;
+}
+
+/*
+ * index_rebuild: Rehashes every object into a new table without
+ *                tombstones, twice the size if the objects fill a quarter
+ *                of the old one, and publishes it, charging the shard for
+ *                any growth. The old table is retired, since lookups may
+ *                still be probing it.
+ */
+static void index_rebuild(shard *S) {
+  index_table *old = S->index;
+  int num_slots = old->num_slots;
+  index_table *T;
+  int i, j;
+
+  if(S->num_objects * 4 > num_slots)
+    num_slots *= 2;
+  T = index_new(num_slots);
+  for(i = 0; i < old->num_slots; i++) {
+    object *obj = old->slots[i];
+    if(obj == NULL || obj == TOMBSTONE)
+      continue;
+    for(j = obj->hash & (num_slots - 1); T->slots[j] != NULL;
+        j = (j + 1) & (num_slots - 1))
+      ;
+    T->slots[j] = obj;
+  }
+  S->bytes_left -= index_bytes(num_slots) - index_bytes(old->num_slots);
+  S->num_tombstones = 0;
+  __atomic_store_n(&S->index, T, __ATOMIC_RELEASE);
+  epoch_retire(old, free);
+}
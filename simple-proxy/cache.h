@@ -1,27 +1,120 @@
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
 #include "csapp.h"
+#include "segbuf.h"
+#include "sketch.h"
+#include <stdint.h>
+
+/* Initial number of hash index slots per shard (must be a power of two) */
+#define INIT_SLOTS 512
+
+/* Block size of the smallest pool for requests and validators, which
+   double in size up to MAXLINE */
+#define STRING_MIN 32
+#define STRING_POOLS 9
+
+/* Bytes malloc adds to every block, and the alignment and minimum size of
+   the blocks it hands out */
+#define ALLOC_HEADER 8
+#define ALLOC_ALIGN 16
+#define ALLOC_MIN 32
 
 typedef struct object object;
+typedef struct shard shard;
 typedef struct cache cache;
+typedef struct policy policy;
+typedef struct index_table index_table;
 
 struct object {
   char *request;
-  char *response;
+  segment *response;
   int size;
+  int charge;         /* Bytes of memory charged to the shard for it */
+  uint64_t hash;
+  time_t expires;     /* When the object goes stale, or 0 for never */
+  char *etag;         /* Validators for revalidation, or NULL */
+  char *last_modified;
+  int hits;           /* Lookups that found the object */
+  int refreshing;     /* Whether a background refresh is queued */
+  int referenced;
+  int refcount;
   object *prev;
   object *next;
+  object *chain;      /* Link in the shard's evicted list */
+  int freq;           /* Hits counted by the eviction policy */
+  int mark;           /* Policy-defined: queue, or frequency last seen */
+  int pos;            /* Position in the policy's heap */
+  double priority;    /* Priority for size-aware policies */
+  object *qprev;      /* Links in the policy's queues */
+  object *qnext;
 };
 
-struct cache {
-  int bytes_left;
+/* A shard's hash index, an open addressing table of its objects */
+struct index_table {
+  int num_slots;
+  object *slots[];
+};
+
+struct shard {
+  pthread_mutex_t lock;     /* Serializes writers; lookups take no lock */
+  int64_t capacity;
+  int64_t bytes_left;
+  int num_objects;
+  int num_tombstones;       /* Index slots of removed objects */
+  index_table *index;
   object *MRA;
   object *LRA;
+  object *evicted;
+  policy *policy;
+  void *state;        /* Eviction policy state */
+  sketch *sketch;     /* Request frequencies, if admission is enabled */
+};
+
+struct cache {
+  int num_shards;
+  shard *shards;
+  void (*demote)(object *obj);
 };
 
+/*
+ * An eviction policy. Every function but hit is called with the shard's
+ * lock held; hit is called from lookups, which hold no lock, so it may
+ * only update the object with atomic operations.
+ */
+struct policy {
+  char *name;
+  void (*init)(shard *S);                   /* Sets up S->state */
+  void (*destroy)(shard *S);                /* Frees S->state */
+  void (*insert)(shard *S, object *obj);    /* Object was added */
+  void (*remove)(shard *S, object *obj);    /* Object is being removed */
+  object *(*victim)(shard *S);              /* Picks the next to evict */
+  void (*evicted)(shard *S, object *obj);   /* Victim is being evicted */
+  void (*hit)(object *obj);                 /* Object was looked up */
+};
 
-cache *cache_init(int max_size);
+cache *cache_init(int64_t max_size, int num_shards, policy *P);
 void cache_free(cache *C);
-void cache_insert(cache *C, object *obj);
-void cache_remove(cache *C, object *obj);
-object *new_object(char *req, char *resp, int obj_size);
-void evict(cache *C, int req_size);
-object *find_request(cache *C, char *req);
+void cache_admission(cache *C);
+int cache_fit_shards(int64_t max_size, int num_shards, long max_object,
+                     int admission);
+shard *cache_shard(cache *C, uint64_t hash);
+int cache_insert(shard *S, object *obj);
+int cache_insert_absent(shard *S, object *obj);
+void cache_remove(shard *S, object *obj);
+object *new_object(char *req, segment *resp, int obj_size);
+void object_validators(object *obj, char *etag, char *last_modified);
+int evict(shard *S, object *obj, int admitted);
+void move_to_MRA(shard *S, object *obj);
+object *find_request(shard *S, char *req, uint64_t hash);
+object *cache_lookup(cache *C, char *req);
+int cache_contains(cache *C, char *req);
+void cache_store(cache *C, object *obj);
+int cache_store_absent(cache *C, object *obj);
+void release_object(object *obj);
+int object_fresh(object *obj);
+uint64_t cache_hash(char *req);
+int object_charge(object *obj);
+long alloc_size(long n);
+
+#endif /* __CACHE_H__ */
@@ -0,0 +1,163 @@
+/*
+ * cachesim.c
+ *
+ * Derek Tzeng
+ * dtzeng
+ *
+ * Trace-driven simulator for the cache's eviction policies.
+ *
+ * Replays a recorded request log against the real cache, once per policy
+ * (or only the one given with -p), and reports the object hit ratio, the
+ * fraction of requests served from the cache, and the byte hit ratio, the
+ * fraction of response bytes served from it. With -a, the cache uses
+ * TinyLFU admission, as in the proxy. Responses are not stored,
+ * only their sizes, so large traces replay quickly.
+ *
+ * Each line of the trace holds a request key, such as its URL, and the
+ * size of its response in bytes, separated by whitespace. Lines that do
+ * not parse are skipped. As in the proxy, responses larger than the
+ * maximum object size (-m) are never cached, and objects are charged
+ * the memory they would take up in the proxy, response segments and all.
+ *
+ * The simulator is not part of the proxy; build it on its own with
+ *
+ *   gcc -O2 -o cachesim cachesim.c cache.c policy.c s3fifo.c arc.c \
+ *       gdsf.c sketch.c segbuf.c slab.c epoch.c csapp.c -lpthread
+ *
+ */
+
+#include "proxy.h"
+#include "policy.h"
+
+/* A request in the trace */
+typedef struct {
+  char *key;
+  int size;
+} trace_req;
+
+void usage(char *prog);
+int read_trace(char *path, trace_req **trace);
+void simulate(policy *P, trace_req *trace, int n, int64_t cache_size,
+              int shards, int max_object, int admission);
+
+int main(int argc, char **argv) {
+  int64_t cache_size = DEFAULT_CACHE_SIZE;
+  int max_object = DEFAULT_OBJECT_SIZE;
+  int shards = 1;
+  int admission = 0;
+  policy *only = NULL;
+  char *names[] = {"lru", "s3fifo", "arc", "gdsf", NULL};
+  trace_req *trace;
+  int opt, n, i;
+
+  while((opt = getopt(argc, argv, "c:m:s:p:a")) != -1) {
+    switch(opt) {
+    case 'c':
+      cache_size = atoll(optarg);
+      break;
+    case 'm':
+      max_object = atoi(optarg);
+      break;
+    case 's':
+      shards = atoi(optarg);
+      break;
+    case 'p':
+      if((only = policy_find(optarg)) == NULL)
+        usage(argv[0]);
+      break;
+    case 'a':
+      admission = 1;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if(optind >= argc || cache_size < 1 || max_object < 1 || shards < 1)
+    usage(argv[0]);
+
+  if((n = read_trace(argv[optind], &trace)) < 0)
+    unix_error("read_trace error");
+
+  printf("%-8s %12s %12s %12s\n", "policy", "requests", "object hit",
+         "byte hit");
+  if(only != NULL) {
+    simulate(only, trace, n, cache_size, shards, max_object, admission);
+  }
+  else {
+    for(i = 0; names[i] != NULL; i++)
+      simulate(policy_find(names[i]), trace, n, cache_size, shards,
+               max_object, admission);
+  }
+  return 0;
+}
+
+/*
+ * usage: Prints the command line usage and exits.
+ */
+void usage(char *prog) {
+  fprintf(stderr, "usage: %s [-c cache_bytes] [-m max_object] [-s shards] "
+          "[-p lru|s3fifo|arc|gdsf] [-a] <trace>\n", prog);
+  exit(1);
+}
+
+/*
+ * read_trace: Reads the trace at path into an array of requests, which it
+ *             points trace at. Returns the number of requests, or -1 on
+ *             error.
+ */
+int read_trace(char *path, trace_req **trace) {
+  char line[MAXLINE], key[MAXLINE];
+  int n = 0, slots = 1024, size;
+  FILE *fp;
+
+  if((fp = fopen(path, "r")) == NULL)
+    return -1;
+  *trace = Malloc(slots * sizeof(trace_req));
+  while(fgets(line, sizeof(line), fp) != NULL) {
+    if(sscanf(line, "%s %d", key, &size) != 2 || size < 0)
+      continue;
+    if(n == slots) {
+      slots *= 2;
+      *trace = Realloc(*trace, slots * sizeof(trace_req));
+    }
+    (*trace)[n].key = Malloc(strlen(key) + 1);
+    strcpy((*trace)[n].key, key);
+    (*trace)[n].size = size;
+    n++;
+  }
+  fclose(fp);
+  return n;
+}
+
+/*
+ * simulate: Replays the trace against a cache using the policy, with
+ *           admission if asked to, and prints its hit ratios.
+ */
+void simulate(policy *P, trace_req *trace, int n, int64_t cache_size,
+              int shards, int max_object, int admission) {
+  cache *C = cache_init(cache_size, shards, P);
+  long hits = 0, bytes = 0, hit_bytes = 0;
+  int i;
+
+  if(admission)
+    cache_admission(C);
+  for(i = 0; i < n; i++) {
+    object *obj;
+
+    bytes += trace[i].size;
+    if((obj = cache_lookup(C, trace[i].key)) != NULL) {
+      hits++;
+      hit_bytes += trace[i].size;
+      release_object(obj);
+    }
+    else if(trace[i].size <= max_object &&
+            trace[i].size <= cache_size / shards) {
+      cache_store(C, new_object(trace[i].key, NULL, trace[i].size));
+    }
+  }
+
+  printf("%-8s %12d %11.2f%% %11.2f%%\n", P->name, n,
+         (n > 0) ? 100.0 * hits / n : 0.0,
+         (bytes > 0) ? 100.0 * hit_bytes / bytes : 0.0);
+  cache_free(C);
+}
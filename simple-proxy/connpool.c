@@ -0,0 +1,205 @@
+/*
+ * connpool.c
+ *
+ * Derek Tzeng
+ * dtzeng
+ *
+ * Pool of idle persistent connections to origin servers.
+ *
+ * Opening a server connection costs a name lookup and a TCP handshake,
+ * which dominate the latency of a cache miss. Instead of closing a server
+ * connection once its response has been received, the proxy returns it to
+ * this pool, and the next miss for the same host and port takes it back
+ * without connecting at all.
+ *
+ * The pool is a chained hash table of origins keyed by "host:port", each
+ * with a stack of idle connections so the most recently used one, which is
+ * the least likely to have been closed by the server, is reused first.
+ * At most POOL_MAX_PER_HOST connections are kept per origin, and
+ * connections idle for more than POOL_IDLE_TIMEOUT seconds are closed.
+ * Every call sweeps one bucket of the table for expired connections, so
+ * origins that are never contacted again are eventually emptied and freed.
+ *
+ * A server may still close an idle connection at any time, so a
+ * connection is checked for end of file before it is reused, and callers
+ * retry on a fresh connection if a reused one fails before any of the
+ * response arrives.
+ *
+ */
+
+#include "connpool.h"
+#include "cache.h"
+
+typedef struct idle idle;
+typedef struct origin origin;
+
+/* An idle connection */
+struct idle {
+  int fd;
+  time_t since;
+  idle *next;
+};
+
+/* The idle connections to one host and port */
+struct origin {
+  char *key;
+  uint64_t hash;
+  int num_idle;
+  idle *idle;
+  origin *chain;
+};
+
+static origin *table[POOL_BUCKETS];
+static int sweep_next = 0;
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int prune(origin **link, time_t now);
+static void sweep(time_t now);
+static int alive(int fd);
+
+/*
+ * pool_connect: Returns an idle connection to host and port from the pool,
+ *               or a new one if there is none, and sets reused to say
+ *               which. Returns -1 if connecting fails.
+ */
+int pool_connect(char *host, char *port, int *reused) {
+  char key[MAXLINE];
+  uint64_t hash;
+  origin **link;
+  int fd;
+
+  snprintf(key, sizeof(key), "%s:%s", host, port);
+  hash = cache_hash(key);
+  while(1) {
+    time_t now = time(NULL);
+    idle *conn = NULL;
+
+    pthread_mutex_lock(&table_lock);
+    sweep(now);
+    for(link = &table[hash % POOL_BUCKETS]; *link != NULL;
+        link = &(*link)->chain) {
+      if((*link)->hash == hash && !strcmp((*link)->key, key))
+        break;
+    }
+    if(*link != NULL && !prune(link, now)) {
+      conn = (*link)->idle;
+      (*link)->idle = conn->next;
+      (*link)->num_idle--;
+      prune(link, now);
+    }
+    pthread_mutex_unlock(&table_lock);
+
+    if(conn == NULL)
+      break;
+    fd = conn->fd;
+    free(conn);
+    if(alive(fd)) {
+      *reused = 1;
+      return fd;
+    }
+    close(fd);
+  }
+
+  *reused = 0;
+  return open_clientfd_r(host, port);
+}
+
+/*
+ * pool_put: Returns a connection to host and port, whose last response has
+ *           been read in full, to the pool. Closes it instead if the pool
+ *           already holds the maximum number for that origin.
+ */
+void pool_put(char *host, char *port, int fd) {
+  char key[MAXLINE];
+  uint64_t hash;
+  time_t now = time(NULL);
+  origin *o;
+
+  snprintf(key, sizeof(key), "%s:%s", host, port);
+  hash = cache_hash(key);
+
+  pthread_mutex_lock(&table_lock);
+  sweep(now);
+  for(o = table[hash % POOL_BUCKETS]; o != NULL; o = o->chain) {
+    if(o->hash == hash && !strcmp(o->key, key))
+      break;
+  }
+  if(o == NULL) {
+    o = Malloc(sizeof(origin));
+    o->key = Malloc(strlen(key) + 1);
+    strcpy(o->key, key);
+    o->hash = hash;
+    o->num_idle = 0;
+    o->idle = NULL;
+    o->chain = table[hash % POOL_BUCKETS];
+    table[hash % POOL_BUCKETS] = o;
+  }
+  if(o->num_idle < POOL_MAX_PER_HOST) {
+    idle *conn = Malloc(sizeof(idle));
+    conn->fd = fd;
+    conn->since = now;
+    conn->next = o->idle;
+    o->idle = conn;
+    o->num_idle++;
+    fd = -1;
+  }
+  pthread_mutex_unlock(&table_lock);
+
+  if(fd >= 0)
+    close(fd);
+}
+
+/*
+ * prune: Closes the expired idle connections of the origin at link, and
+ *        unlinks and frees the origin if none are left. Returns 1 if the
+ *        origin was freed, or 0 otherwise. The table lock must be held.
+ */
+static int prune(origin **link, time_t now) {
+  origin *o = *link;
+  idle **p = &o->idle;
+
+  while(*p != NULL) {
+    idle *conn = *p;
+    if(now - conn->since >= POOL_IDLE_TIMEOUT) {
+      *p = conn->next;
+      close(conn->fd);
+      free(conn);
+      o->num_idle--;
+    }
+    else {
+      p = &conn->next;
+    }
+  }
+  if(o->num_idle == 0) {
+    *link = o->chain;
+    free(o->key);
+    free(o);
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ * sweep: Prunes every origin in the next bucket of the table. The table
+ *        lock must be held.
+ */
+static void sweep(time_t now) {
+  origin **link = &table[sweep_next];
+
+  while(*link != NULL) {
+    if(!prune(link, now))
+      link = &(*link)->chain;
+  }
+  sweep_next = (sweep_next + 1) % POOL_BUCKETS;
+}
+
+/*
+ * alive: Returns 1 if the idle connection fd has neither been closed by
+ *        the server nor received unexpected data, or 0 otherwise.
+ */
+static int alive(int fd) {
+  char c;
+  ssize_t rc = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+
+  return (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+}
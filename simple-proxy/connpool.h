@@ -0,0 +1,19 @@
+#ifndef __CONNPOOL_H__
+#define __CONNPOOL_H__
+
+#include "csapp.h"
+#include "open_clientfd_r.h"
+
+/* Number of buckets in the table of origins */
+#define POOL_BUCKETS 64
+
+/* Maximum number of idle connections kept per origin */
+#define POOL_MAX_PER_HOST 8
+
+/* Seconds an idle connection is kept before it is closed */
+#define POOL_IDLE_TIMEOUT 15
+
+int pool_connect(char *host, char *port, int *reused);
+void pool_put(char *host, char *port, int fd);
+
+#endif /* __CONNPOOL_H__ */
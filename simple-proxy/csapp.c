@@ -574,18 +574,12 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
 
 
 /*
- * rio_read - This is a wrapper for the Unix read() function that
- *    transfers min(n, rio_cnt) bytes from an internal buffer to a user
- *    buffer, where n is the number of bytes requested by the user and
- *    rio_cnt is the number of unread bytes in the internal buffer. On
- *    entry, rio_read() refills the internal buffer via a call to
- *    read() if the internal buffer is empty.
+ * rio_fill - Refills the internal buffer via a call to read() if it is
+ *    empty. Returns the number of unread bytes in the buffer, 0 on EOF,
+ *    or -1 on error.
  */
-/* $begin rio_read */
-static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
+static ssize_t rio_fill(rio_t *rp)
 {
-    int cnt;
-
     while (rp->rio_cnt <= 0) {  /* refill if buf is empty */
 	rp->rio_cnt = read(rp->rio_fd, rp->rio_buf,
 			   sizeof(rp->rio_buf));
@@ -598,6 +592,24 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
 	else
 	    rp->rio_bufptr = rp->rio_buf; /* reset buffer ptr */
     }
+    return rp->rio_cnt;
+}
+
+/*
+ * rio_read - This is a wrapper for the Unix read() function that
+ *    transfers min(n, rio_cnt) bytes from an internal buffer to a user
+ *    buffer, where n is the number of bytes requested by the user and
+ *    rio_cnt is the number of unread bytes in the internal buffer. On
+ *    entry, rio_read() refills the internal buffer via a call to
+ *    read() if the internal buffer is empty.
+ */
+/* $begin rio_read */
+static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
+{
+    int cnt;
+
+    if ((cnt = rio_fill(rp)) <= 0)
+	return cnt;
 
     /* Copy min(n, rp->rio_cnt) bytes from internal buf to user buf */
     cnt = n;
@@ -650,26 +662,37 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n)
 
 /*
  * rio_readlineb - robustly read a text line (buffered)
+ *
+ * Finds the end of the line in the internal buffer with memchr, which is
+ * vectorized, and copies the line a buffered chunk at a time rather than
+ * a byte at a time. At most maxlen-1 bytes are stored, and the rest of a
+ * longer line is left for the next call. Returns the number of bytes
+ * stored, 0 at EOF with no data read, or -1 on error.
  */
 /* $begin rio_readlineb */
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
 {
-    size_t n;
-    int rc;
-    char c, *bufp = usrbuf;
-
-    for (n = 1; n < maxlen; n++) {
-	if ((rc = rio_read(rp, &c, 1)) == 1) {
-	    *bufp++ = c;
-	    if (c == '\n')
-		break;
-	} else if (rc == 0) {
-	    if (n == 1)
-		return 0; /* EOF, no data read */
-	    else
-		break;    /* EOF, some data was read */
-	} else
-	    return -1;	  /* error */
+    size_t n = 0, cnt;
+    ssize_t rc;
+    char *bufp = usrbuf, *nl = NULL;
+
+    while (nl == NULL && n + 1 < maxlen) {
+	if ((rc = rio_fill(rp)) < 0)
+	    return -1;    /* error */
+	else if (rc == 0)
+	    break;        /* EOF */
+
+	/* Copy up to and including the newline, if it is buffered */
+	cnt = maxlen - 1 - n;
+	if ((size_t)(rp->rio_cnt) < cnt)
+	    cnt = rp->rio_cnt;
+	if ((nl = memchr(rp->rio_bufptr, '\n', cnt)) != NULL)
+	    cnt = nl - rp->rio_bufptr + 1;
+	memcpy(bufp, rp->rio_bufptr, cnt);
+	rp->rio_bufptr += cnt;
+	rp->rio_cnt -= cnt;
+	bufp += cnt;
+	n += cnt;
     }
     *bufp = 0;
     return n;
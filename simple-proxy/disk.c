@@ -0,0 +1,301 @@
+/*
+ * disk.c
+ *
+ * Derek Tzeng
+ * dtzeng
+ *
+ * Disk tier behind the in-memory cache.
+ *
+ * Objects evicted from the in-memory cache are demoted into a file,
+ * usually much larger than the cache, instead of being thrown away. The
+ * file is preallocated at startup and mapped into memory, and demoted
+ * objects are appended to it as a log of records, each holding the
+ * request and the response. When the log reaches the end of the file it
+ * wraps around to the start, reclaiming the space of the oldest records,
+ * so the file behaves as a FIFO queue of objects.
+ *
+ * An in-memory index, a chained hash table keyed by the same FNV-1a hash
+ * of the request as the cache, maps requests to their records. Hits are
+ * sent to the client with sendfile straight from the file, so they are
+ * never copied through user space; the file's pages are shared with the
+ * mapping in the page cache.
+ *
+ * A record is written without holding the lock, after its space has
+ * been reserved, and is only found by lookups once it is complete.
+ * Records are pinned while they are being written or sent, and if the
+ * space for a new record would reclaim a pinned one, the demotion is
+ * skipped instead of waiting.
+ *
+ * An object demoted again replaces its record if the old one goes stale
+ * sooner. The old record leaves the index at once, and its space is
+ * reclaimed in log order like any other.
+ *
+ */
+
+#include "disk.h"
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+
+static int disk_fd = -1;
+static char *map = NULL;
+static long map_size = 0;
+static long head = 0;           /* Where the next record is written */
+static disk_entry *oldest = NULL;
+static disk_entry *newest = NULL;
+static disk_entry **buckets = NULL;
+static int num_buckets = 0;
+static int num_entries = 0;
+static pthread_mutex_t disk_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static disk_entry *find(char *req, uint64_t hash);
+static void unindex(disk_entry *e);
+static void drop_oldest(void);
+static void index_grow(void);
+
+/*
+ * disk_init: Preallocates the file at path to size bytes and maps it.
+ *            Returns 0 on success, or -1 on error.
+ */
+int disk_init(char *path, long size) {
+  if((disk_fd = open(path, O_RDWR | O_CREAT, 0600)) < 0)
+    return -1;
+
+  /* Fall back to a sparse file where preallocation is not supported */
+  if(posix_fallocate(disk_fd, 0, size) != 0 && ftruncate(disk_fd, size) < 0) {
+    close(disk_fd);
+    return -1;
+  }
+  map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, disk_fd, 0);
+  if(map == MAP_FAILED) {
+    map = NULL;
+    close(disk_fd);
+    return -1;
+  }
+  map_size = size;
+  num_buckets = DISK_INIT_BUCKETS;
+  buckets = Calloc(num_buckets, sizeof(disk_entry *));
+  return 0;
+}
+
+/*
+ * disk_demote: Appends an object evicted from the cache to the log, unless
+ *              a record of it that stays fresh at least as long is already
+ *              there, or its space cannot be reclaimed yet.
+ */
+void disk_demote(object *obj) {
+  int req_len = strlen(obj->request);
+  long len = sizeof(disk_record) + req_len + obj->size;
+  long off;
+  disk_entry *e;
+
+  if(map == NULL || len > map_size)
+    return;
+
+  pthread_mutex_lock(&disk_lock);
+  if((e = find(obj->request, obj->hash)) != NULL &&
+     (!e->ready || e->expires == 0 ||
+      (obj->expires != 0 && e->expires >= obj->expires))) {
+    pthread_mutex_unlock(&disk_lock);
+    return;
+  }
+
+  /* Reclaim the space from the oldest records, wrapping at the end */
+  off = head;
+  if(off + len > map_size)
+    off = 0;
+  while(oldest != NULL &&
+        ((off < head && oldest->off >= head) ||
+         (oldest->off < off + len && oldest->off + oldest->len > off))) {
+    if(oldest->refcount > 0) {
+      pthread_mutex_unlock(&disk_lock);
+      return;
+    }
+    drop_oldest();
+  }
+  head = off + len;
+
+  /* Replace the older record, if reclaiming the space left it */
+  if((e = find(obj->request, obj->hash)) != NULL)
+    unindex(e);
+
+  /* Reserve the space with an entry that lookups skip until it is ready */
+  e = Malloc(sizeof(disk_entry));
+  e->request = Malloc(req_len + 1);
+  strcpy(e->request, obj->request);
+  e->hash = obj->hash;
+  e->off = off;
+  e->len = len;
+  e->size = obj->size;
+  e->expires = obj->expires;
+  e->ready = 0;
+  e->refcount = 1;
+  e->indexed = 1;
+  e->newer = NULL;
+  if(newest != NULL)
+    newest->newer = e;
+  else
+    oldest = e;
+  newest = e;
+  e->chain = buckets[e->hash & (num_buckets - 1)];
+  buckets[e->hash & (num_buckets - 1)] = e;
+  if(++num_entries > num_buckets)
+    index_grow();
+  pthread_mutex_unlock(&disk_lock);
+
+  /* Write the record */
+  disk_record rec;
+  char *dst = map + off;
+  segment *seg;
+  int left = obj->size;
+  rec.magic = DISK_MAGIC;
+  rec.req_len = req_len;
+  rec.size = obj->size;
+  memcpy(dst, &rec, sizeof(rec));
+  dst += sizeof(rec);
+  memcpy(dst, obj->request, req_len);
+  dst += req_len;
+  for(seg = obj->response; seg != NULL && left > 0; seg = seg->next) {
+    int n = (seg->len < left) ? seg->len : left;
+    memcpy(dst, seg->data, n);
+    dst += n;
+    left -= n;
+  }
+
+  pthread_mutex_lock(&disk_lock);
+  e->ready = 1;
+  e->refcount--;
+  pthread_mutex_unlock(&disk_lock);
+}
+
+/*
+ * disk_lookup: Finds the request in the disk tier and returns its entry
+ *              pinned, or NULL if it was not found. The caller must
+ *              disk_release the result when done.
+ */
+disk_entry *disk_lookup(char *req) {
+  uint64_t hash = cache_hash(req);
+  disk_entry *e;
+
+  if(map == NULL)
+    return NULL;
+
+  pthread_mutex_lock(&disk_lock);
+  if((e = find(req, hash)) != NULL && e->ready)
+    e->refcount++;
+  else
+    e = NULL;
+  pthread_mutex_unlock(&disk_lock);
+  return e;
+}
+
+/*
+ * disk_data: Returns the mapped response of a pinned entry.
+ */
+char *disk_data(disk_entry *e) {
+  return map + e->off + e->len - e->size;
+}
+
+/*
+ * disk_send: Sends the response of a pinned entry to fd straight from the
+ *            file. Returns 0 on success, or -1 on error.
+ */
+int disk_send(int fd, disk_entry *e) {
+  off_t off = e->off + e->len - e->size;
+  size_t left = e->size;
+
+  while(left > 0) {
+    ssize_t n = sendfile(fd, disk_fd, &off, left);
+    if(n < 0 && errno == EINTR)
+      continue;
+    if(n <= 0)
+      return -1;
+    left -= n;
+  }
+  return 0;
+}
+
+/*
+ * disk_release: Unpins an entry returned by disk_lookup.
+ */
+void disk_release(disk_entry *e) {
+  pthread_mutex_lock(&disk_lock);
+  e->refcount--;
+  pthread_mutex_unlock(&disk_lock);
+}
+
+/*
+ * disk_fresh: Returns 1 if the response of a pinned entry has not gone
+ *             stale, or 0 otherwise. Stale responses are fetched anew,
+ *             since the disk tier keeps no validators.
+ */
+int disk_fresh(disk_entry *e) {
+  return (e->expires == 0 || time(NULL) < e->expires);
+}
+
+/*
+ * find: Returns the entry for the request, whose hash is given, or NULL
+ *       if there is none. The lock must be held.
+ */
+static disk_entry *find(char *req, uint64_t hash) {
+  disk_entry *e = buckets[hash & (num_buckets - 1)];
+
+  for(; e != NULL; e = e->chain) {
+    if(e->hash == hash && !strcmp(e->request, req))
+      return e;
+  }
+  return NULL;
+}
+
+/*
+ * unindex: Removes the entry from the index, so lookups no longer find
+ *          it. The lock must be held.
+ */
+static void unindex(disk_entry *e) {
+  disk_entry **p = &buckets[e->hash & (num_buckets - 1)];
+
+  while(*p != e)
+    p = &(*p)->chain;
+  *p = e->chain;
+  e->indexed = 0;
+  num_entries--;
+}
+
+/*
+ * drop_oldest: Removes the oldest record from the log and the index. The
+ *              lock must be held.
+ */
+static void drop_oldest(void) {
+  disk_entry *e = oldest;
+
+  if(e->indexed)
+    unindex(e);
+  oldest = e->newer;
+  if(oldest == NULL)
+    newest = NULL;
+  free(e->request);
+  free(e);
+}
+
+/*
+ * index_grow: Doubles the number of index buckets and rehashes the
+ *             entries. The lock must be held.
+ */
+static void index_grow(void) {
+  int new_num = num_buckets * 2;
+  disk_entry **new_buckets = Calloc(new_num, sizeof(disk_entry *));
+  int i;
+
+  for(i = 0; i < num_buckets; i++) {
+    disk_entry *e = buckets[i];
+    while(e != NULL) {
+      disk_entry *next = e->chain;
+      int b = e->hash & (new_num - 1);
+      e->chain = new_buckets[b];
+      new_buckets[b] = e;
+      e = next;
+    }
+  }
+  free(buckets);
+  buckets = new_buckets;
+  num_buckets = new_num;
+}
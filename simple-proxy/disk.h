@@ -0,0 +1,48 @@
+#ifndef __DISK_H__
+#define __DISK_H__
+
+#include "csapp.h"
+#include "cache.h"
+
+/* Default size of the disk tier's file in megabytes */
+#define DISK_DEFAULT_MB 1024
+
+/* Initial number of index buckets (must be a power of two) */
+#define DISK_INIT_BUCKETS 4096
+
+/* Marks the start of every record in the log */
+#define DISK_MAGIC 0x4b534944
+
+typedef struct disk_entry disk_entry;
+
+/* Header of a record in the log, followed by the request and response */
+typedef struct {
+  uint32_t magic;
+  uint32_t req_len;
+  uint32_t size;
+} disk_record;
+
+/* Index entry of an object in the log */
+struct disk_entry {
+  char *request;
+  uint64_t hash;
+  long off;           /* Offset of the record */
+  long len;           /* Length of the record */
+  int size;           /* Length of the response, which ends the record */
+  time_t expires;     /* When the response goes stale, or 0 for never */
+  int ready;          /* Whether the record has been written */
+  int refcount;       /* Senders and writers using the record */
+  int indexed;        /* Whether lookups can find it, until replaced */
+  disk_entry *newer;  /* Next record in log order */
+  disk_entry *chain;
+};
+
+int disk_init(char *path, long size);
+void disk_demote(object *obj);
+disk_entry *disk_lookup(char *req);
+char *disk_data(disk_entry *e);
+int disk_send(int fd, disk_entry *e);
+void disk_release(disk_entry *e);
+int disk_fresh(disk_entry *e);
+
+#endif /* __DISK_H__ */
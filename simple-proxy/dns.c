@@ -0,0 +1,435 @@
+/*
+ * dns.c
+ *
+ * Derek Tzeng
+ * dtzeng
+ *
+ * Cache of server name lookups.
+ *
+ * getaddrinfo blocks for a round trip to the resolver on every call, and
+ * concurrent calls contend on the resolver's locks, so every cache miss
+ * used to pay for a lookup before it could even connect. Instead, the
+ * addresses of each host and port are kept for DNS_TTL seconds, since
+ * getaddrinfo does not report the record's own TTL. Failed lookups are
+ * cached too, for DNS_NEG_TTL seconds, so requests for a bad name do not
+ * keep hitting the resolver; temporary failures are not cached.
+ *
+ * Names are kept in a chained hash table keyed by "host:port" and in a
+ * list ordered by last use, and once the configured maximum number of
+ * names is reached, the least recently used one is dropped. A single
+ * mutex guards both, and lookups on a miss run without holding it.
+ *
+ * The event-driven engines cannot wait for getaddrinfo without stalling
+ * every connection on their loop, so dns_lookup_async hands misses to a
+ * pool of DNS_THREADS resolver threads instead. A resolver writes a
+ * pointer to the finished query to a descriptor of the caller's choice,
+ * which its loop watches, and the connection carries on from there.
+ *
+ * A background thread refreshes hot names, those looked up at least
+ * DNS_HOT_HITS times since they were last resolved, during the last
+ * DNS_REFRESH_AHEAD seconds before they expire, so popular servers never
+ * see a miss. It also prints the hit, miss, and refresh counters when
+ * asked to by dns_report.
+ *
+ */
+
+#include "dns.h"
+#include "cache.h"
+
+typedef struct dns_entry dns_entry;
+
+/* A cached lookup */
+struct dns_entry {
+  char *host;
+  char *port;
+  uint64_t hash;
+  int status;       /* 0, or the getaddrinfo error of a failed lookup */
+  dns_addrs addrs;
+  time_t expires;
+  int hits;         /* Lookups since the name was last resolved */
+  dns_entry *prev;
+  dns_entry *next;
+  dns_entry *chain;
+};
+
+static dns_entry *table[DNS_BUCKETS];
+static dns_entry *MRU = NULL;
+static dns_entry *LRU = NULL;
+static int num_entries = 0;
+static int max_names = DNS_DEFAULT_ENTRIES;
+static long num_hits = 0, num_misses = 0, num_refreshes = 0;
+static volatile sig_atomic_t report_pending = 0;
+static pthread_mutex_t dns_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Lookups waiting for a resolver thread */
+static dns_query *queue_head = NULL;
+static dns_query *queue_tail = NULL;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static sem_t queued;
+static pthread_once_t resolvers_once = PTHREAD_ONCE_INIT;
+
+static uint64_t dns_hash(char *host, char *port);
+static int cached(uint64_t hash, char *host, char *port, dns_addrs *addrs);
+static int resolve_store(uint64_t hash, char *host, char *port,
+                         dns_addrs *addrs);
+static int resolve(char *host, char *port, dns_addrs *addrs);
+static dns_entry *find(uint64_t hash, char *host, char *port);
+static void store(char *host, char *port, uint64_t hash, int status,
+                  dns_addrs *addrs);
+static void unlink_entry(dns_entry *e);
+static void push_MRU(dns_entry *e);
+static void *refresher(void *vargp);
+static void start_resolvers(void);
+static void *resolver(void *vargp);
+
+/*
+ * dns_init: Limits the cache to max_entries names and starts the refresh
+ *           thread.
+ */
+void dns_init(int max_entries) {
+  pthread_t tid;
+
+  max_names = max_entries;
+  Pthread_create(&tid, NULL, refresher, NULL);
+}
+
+/*
+ * dns_lookup: Fills in the stream socket addresses of host and port, from
+ *             the cache if possible. Returns 0 on success, or -1 if the
+ *             name cannot be resolved.
+ */
+int dns_lookup(char *host, char *port, dns_addrs *addrs) {
+  uint64_t hash = dns_hash(host, port);
+  int status;
+
+  if((status = cached(hash, host, port, addrs)) <= 0)
+    return status;
+  return resolve_store(hash, host, port, addrs);
+}
+
+/*
+ * dns_lookup_async: Fills in the addresses of host and port from the cache
+ *                   if it can, without blocking. Returns 0 on success, -1
+ *                   if the name is known not to resolve, or 1 if the
+ *                   lookup was queued for a resolver thread. A queued
+ *                   lookup is written to done_fd as a dns_query pointer
+ *                   carrying arg once it is resolved, and the reader frees
+ *                   it with dns_query_free.
+ */
+int dns_lookup_async(char *host, char *port, dns_addrs *addrs, int done_fd,
+                     void *arg) {
+  uint64_t hash = dns_hash(host, port);
+  dns_query *q;
+  int status;
+
+  if((status = cached(hash, host, port, addrs)) <= 0)
+    return status;
+  pthread_once(&resolvers_once, start_resolvers);
+
+  q = Malloc(sizeof(dns_query));
+  q->host = Malloc(strlen(host) + 1);
+  strcpy(q->host, host);
+  q->port = Malloc(strlen(port) + 1);
+  strcpy(q->port, port);
+  q->arg = arg;
+  q->done_fd = done_fd;
+  q->next = NULL;
+
+  pthread_mutex_lock(&queue_lock);
+  if(queue_tail != NULL)
+    queue_tail->next = q;
+  else
+    queue_head = q;
+  queue_tail = q;
+  pthread_mutex_unlock(&queue_lock);
+  V(&queued);
+  return 1;
+}
+
+/*
+ * dns_query_free: Frees a query written back by a resolver thread.
+ */
+void dns_query_free(dns_query *q) {
+  free(q->host);
+  free(q->port);
+  free(q);
+}
+
+/*
+ * dns_stats: Reports the number of lookups served from the cache, the
+ *            number that went to the resolver, and the number of names
+ *            refreshed in the background.
+ */
+void dns_stats(long *hits, long *misses, long *refreshes) {
+  pthread_mutex_lock(&dns_lock);
+  *hits = num_hits;
+  *misses = num_misses;
+  *refreshes = num_refreshes;
+  pthread_mutex_unlock(&dns_lock);
+}
+
+/*
+ * dns_report: Asks the refresh thread to print the counters. Safe to call
+ *             from a signal handler.
+ */
+void dns_report(void) {
+  report_pending = 1;
+}
+
+/*
+ * dns_hash: Returns the hash of the "host:port" key.
+ */
+static uint64_t dns_hash(char *host, char *port) {
+  char key[MAXLINE];
+
+  snprintf(key, sizeof(key), "%s:%s", host, port);
+  return cache_hash(key);
+}
+
+/*
+ * cached: Fills in the addresses of host and port if the cache has an
+ *         unexpired entry for them. Returns 0 on success, -1 if the entry
+ *         records a failed lookup, or 1 if there is no entry.
+ */
+static int cached(uint64_t hash, char *host, char *port, dns_addrs *addrs) {
+  dns_entry *e;
+  int status;
+
+  pthread_mutex_lock(&dns_lock);
+  if((e = find(hash, host, port)) != NULL && time(NULL) < e->expires) {
+    num_hits++;
+    e->hits++;
+    unlink_entry(e);
+    push_MRU(e);
+    if((status = e->status) == 0)
+      *addrs = e->addrs;
+    pthread_mutex_unlock(&dns_lock);
+    return (status == 0) ? 0 : -1;
+  }
+  num_misses++;
+  pthread_mutex_unlock(&dns_lock);
+  return 1;
+}
+
+/*
+ * resolve_store: Resolves host and port, and caches the outcome unless
+ *                the failure was temporary. Returns 0 on success, or -1
+ *                if the name cannot be resolved.
+ */
+static int resolve_store(uint64_t hash, char *host, char *port,
+                         dns_addrs *addrs) {
+  int status = resolve(host, port, addrs);
+
+  if(status != EAI_AGAIN && status != EAI_SYSTEM && status != EAI_MEMORY) {
+    pthread_mutex_lock(&dns_lock);
+    store(host, port, hash, status, addrs);
+    pthread_mutex_unlock(&dns_lock);
+  }
+  return (status == 0) ? 0 : -1;
+}
+
+/*
+ * resolve: Looks up the stream socket addresses of host and port with
+ *          getaddrinfo. Returns 0 on success, or the getaddrinfo error.
+ */
+static int resolve(char *host, char *port, dns_addrs *addrs) {
+  struct addrinfo hints, *list, *p;
+  int rc;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if((rc = getaddrinfo(host, port, &hints, &list)) != 0)
+    return rc;
+
+  addrs->num = 0;
+  for(p = list; p != NULL && addrs->num < DNS_MAX_ADDRS; p = p->ai_next) {
+    dns_addr *a = &addrs->addr[addrs->num++];
+    a->family = p->ai_family;
+    a->len = p->ai_addrlen;
+    memcpy(&a->addr, p->ai_addr, p->ai_addrlen);
+  }
+  freeaddrinfo(list);
+  return (addrs->num > 0) ? 0 : EAI_NONAME;
+}
+
+/*
+ * find: Returns the entry for host and port, or NULL if there is none.
+ *       The lock must be held.
+ */
+static dns_entry *find(uint64_t hash, char *host, char *port) {
+  dns_entry *e;
+
+  for(e = table[hash % DNS_BUCKETS]; e != NULL; e = e->chain) {
+    if(e->hash == hash && !strcmp(e->host, host) && !strcmp(e->port, port))
+      return e;
+  }
+  return NULL;
+}
+
+/*
+ * store: Records the outcome of resolving host and port, dropping the
+ *        least recently used name if the cache is full. The lock must be
+ *        held.
+ */
+static void store(char *host, char *port, uint64_t hash, int status,
+                  dns_addrs *addrs) {
+  dns_entry *e, **p;
+
+  if((e = find(hash, host, port)) != NULL) {
+    unlink_entry(e);
+  }
+  else {
+    /* Make room by dropping the least recently used name */
+    if(num_entries >= max_names && LRU != NULL) {
+      dns_entry *old = LRU;
+      for(p = &table[old->hash % DNS_BUCKETS]; *p != old; p = &(*p)->chain)
+        ;
+      *p = old->chain;
+      unlink_entry(old);
+      free(old->host);
+      free(old->port);
+      free(old);
+      num_entries--;
+    }
+
+    e = Malloc(sizeof(dns_entry));
+    e->host = Malloc(strlen(host) + 1);
+    strcpy(e->host, host);
+    e->port = Malloc(strlen(port) + 1);
+    strcpy(e->port, port);
+    e->hash = hash;
+    e->chain = table[hash % DNS_BUCKETS];
+    table[hash % DNS_BUCKETS] = e;
+    num_entries++;
+  }
+
+  e->status = status;
+  if(status == 0)
+    e->addrs = *addrs;
+  e->expires = time(NULL) + ((status == 0) ? DNS_TTL : DNS_NEG_TTL);
+  e->hits = 0;
+  push_MRU(e);
+}
+
+/*
+ * unlink_entry: Removes the entry from the list ordered by last use.
+ */
+static void unlink_entry(dns_entry *e) {
+  if(e->prev != NULL)
+    e->prev->next = e->next;
+  else
+    MRU = e->next;
+  if(e->next != NULL)
+    e->next->prev = e->prev;
+  else
+    LRU = e->prev;
+}
+
+/*
+ * push_MRU: Adds the entry to the most recently used end of the list.
+ */
+static void push_MRU(dns_entry *e) {
+  e->prev = NULL;
+  e->next = MRU;
+  if(MRU != NULL)
+    MRU->prev = e;
+  else
+    LRU = e;
+  MRU = e;
+}
+
+/*
+ * refresher: Refresh thread routine. Once a second, re-resolves hot names
+ *            that are about to expire, and prints the counters if asked.
+ */
+static void *refresher(void *vargp) {
+  char *hosts[DNS_REFRESH_BATCH], *ports[DNS_REFRESH_BATCH];
+  dns_addrs addrs;
+  dns_entry *e;
+  int n, i;
+
+  Pthread_detach(pthread_self());
+  while(1) {
+    sleep(1);
+
+    if(report_pending) {
+      long h, m, r;
+      report_pending = 0;
+      dns_stats(&h, &m, &r);
+      fprintf(stderr, "dns: %ld hits, %ld misses, %ld refreshes\n", h, m, r);
+    }
+
+    /* Pick the names to refresh, copying them so the lock can be dropped */
+    n = 0;
+    pthread_mutex_lock(&dns_lock);
+    time_t now = time(NULL);
+    for(e = MRU; e != NULL && n < DNS_REFRESH_BATCH; e = e->next) {
+      if(e->status == 0 && e->hits >= DNS_HOT_HITS &&
+         e->expires - now <= DNS_REFRESH_AHEAD) {
+        hosts[n] = Malloc(strlen(e->host) + 1);
+        strcpy(hosts[n], e->host);
+        ports[n] = Malloc(strlen(e->port) + 1);
+        strcpy(ports[n], e->port);
+        e->hits = 0;
+        n++;
+      }
+    }
+    pthread_mutex_unlock(&dns_lock);
+
+    /* Keep serving the old addresses if the refresh fails */
+    for(i = 0; i < n; i++) {
+      if(resolve(hosts[i], ports[i], &addrs) == 0) {
+        uint64_t hash = dns_hash(hosts[i], ports[i]);
+        pthread_mutex_lock(&dns_lock);
+        if((e = find(hash, hosts[i], ports[i])) != NULL) {
+          e->status = 0;
+          e->addrs = addrs;
+          e->expires = time(NULL) + DNS_TTL;
+          num_refreshes++;
+        }
+        pthread_mutex_unlock(&dns_lock);
+      }
+      free(hosts[i]);
+      free(ports[i]);
+    }
+  }
+  return NULL;
+}
+
+/*
+ * start_resolvers: Starts the resolver threads, the first time a lookup
+ *                  is queued.
+ */
+static void start_resolvers(void) {
+  pthread_t tid;
+  int i;
+
+  Sem_init(&queued, 0, 0);
+  for(i = 0; i < DNS_THREADS; i++)
+    Pthread_create(&tid, NULL, resolver, NULL);
+}
+
+/*
+ * resolver: Resolver thread routine that resolves queued lookups, writing
+ *           each finished one to its done_fd.
+ */
+static void *resolver(void *vargp) {
+  dns_query *q;
+
+  Pthread_detach(pthread_self());
+  while(1) {
+    P(&queued);
+    pthread_mutex_lock(&queue_lock);
+    q = queue_head;
+    if((queue_head = q->next) == NULL)
+      queue_tail = NULL;
+    pthread_mutex_unlock(&queue_lock);
+
+    q->status = resolve_store(dns_hash(q->host, q->port), q->host, q->port,
+                              &q->addrs);
+    if(rio_writen(q->done_fd, &q, sizeof(q)) < 0)
+      unix_error("dns resolver write error");
+  }
+  return NULL;
+}
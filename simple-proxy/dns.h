@@ -0,0 +1,64 @@
+#ifndef __DNS_H__
+#define __DNS_H__
+
+#include "csapp.h"
+
+/* Default maximum number of cached names */
+#define DNS_DEFAULT_ENTRIES 1024
+
+/* Number of buckets in the name table */
+#define DNS_BUCKETS 1024
+
+/* Maximum number of addresses kept per name */
+#define DNS_MAX_ADDRS 8
+
+/* Seconds a successful and a failed lookup are cached */
+#define DNS_TTL 60
+#define DNS_NEG_TTL 5
+
+/* Hot names are refreshed this many seconds before they expire */
+#define DNS_REFRESH_AHEAD 10
+
+/* Lookups since the last refresh that make a name hot */
+#define DNS_HOT_HITS 2
+
+/* Maximum number of names refreshed per pass of the refresh thread */
+#define DNS_REFRESH_BATCH 16
+
+/* Threads resolving lookups for the event-driven engines */
+#define DNS_THREADS 4
+
+/* A resolved server address */
+typedef struct {
+  int family;
+  socklen_t len;
+  struct sockaddr_storage addr;
+} dns_addr;
+
+/* The addresses of a name */
+typedef struct {
+  int num;
+  dns_addr addr[DNS_MAX_ADDRS];
+} dns_addrs;
+
+/* A lookup handed to the resolver threads by dns_lookup_async */
+typedef struct dns_query dns_query;
+struct dns_query {
+  char *host;
+  char *port;
+  int status;       /* 0, or -1 if the name cannot be resolved */
+  dns_addrs addrs;
+  void *arg;        /* Passed through from dns_lookup_async */
+  int done_fd;      /* Where the finished query is written */
+  dns_query *next;
+};
+
+void dns_init(int max_entries);
+int dns_lookup(char *host, char *port, dns_addrs *addrs);
+int dns_lookup_async(char *host, char *port, dns_addrs *addrs, int done_fd,
+                     void *arg);
+void dns_query_free(dns_query *q);
+void dns_stats(long *hits, long *misses, long *refreshes);
+void dns_report(void);
+
+#endif /* __DNS_H__ */
@@ -0,0 +1,218 @@
+/*
+ * epoch.c
+ *
+ * Derek Tzeng
+ * dtzeng
+ *
+ * Epoch-based reclamation, which lets cache lookups run without locks.
+ *
+ * A lookup reads the shard's index while writers may be removing objects
+ * from it, so a removed object cannot be freed while a lookup might still
+ * be looking at it. Instead of freeing it, the writer retires it, and it
+ * is only freed after a grace period, once every lookup that could have
+ * seen it has finished.
+ *
+ * Grace periods are tracked with a global epoch counter. A reader
+ * announces the epoch it starts in with epoch_enter and withdraws with
+ * epoch_exit. A retired block is stamped with the epoch it was retired
+ * in. The epoch only advances once every thread in a read has announced
+ * the current one, so a block retired in epoch e can no longer be reached
+ * once the epoch reaches e + 2, and is then reclaimed.
+ *
+ * Each thread keeps its retired blocks in a list of its own, newest
+ * first, and tries to advance the epoch and reclaim the old ones every
+ * EPOCH_BATCH retirements. Threads register on first use, and when one
+ * exits, the blocks it still holds are left to the others to reclaim.
+ *
+ */
+
+#include "epoch.h"
+#include "slab.h"
+
+static uint64_t global_epoch = 1;
+static epoch_thread *threads = NULL;
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Blocks retired by threads that have exited */
+static retired *orphans = NULL;
+static pthread_mutex_t orphans_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static slab_pool retired_pool;
+static pthread_key_t exit_key;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static __thread epoch_thread *self = NULL;
+
+static epoch_thread *join(void);
+static void init(void);
+static void leave(void *vargp);
+static uint64_t advance(void);
+static void reclaim_expired(epoch_thread *t);
+static retired *expired(retired **list, uint64_t epoch);
+
+/*
+ * epoch_enter: Starts a read, during which no block reachable from shared
+ *              structures is reclaimed.
+ */
+void epoch_enter(void) {
+  epoch_thread *t = join();
+  uint64_t e;
+
+  /* The epoch may advance before the reader announces it, so recheck */
+  do {
+    e = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&t->state, (e << 1) | 1, __ATOMIC_SEQ_CST);
+  } while(__atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST) != e);
+}
+
+/*
+ * epoch_exit: Ends a read.
+ */
+void epoch_exit(void) {
+  __atomic_store_n(&self->state, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * epoch_retire: Arranges for reclaim to be called on the block once no
+ *               read that could have reached it is left. The block must
+ *               already be unreachable for new reads.
+ */
+void epoch_retire(void *block, void (*reclaim)(void *block)) {
+  epoch_thread *t = join();
+  retired *r = slab_alloc(&retired_pool);
+
+  r->block = block;
+  r->reclaim = reclaim;
+  r->epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+  r->next = t->limbo;
+  t->limbo = r;
+  if(++t->pending >= EPOCH_BATCH)
+    reclaim_expired(t);
+}
+
+/*
+ * join: Returns the calling thread's record, registering the thread on
+ *       its first call.
+ */
+static epoch_thread *join(void) {
+  epoch_thread *t;
+
+  if(self != NULL)
+    return self;
+  pthread_once(&init_once, init);
+
+  /* Reuse the record of a thread that has exited, if any */
+  pthread_mutex_lock(&threads_lock);
+  for(t = threads; t != NULL && t->in_use; t = t->next)
+    ;
+  if(t == NULL) {
+    t = Calloc(1, sizeof(epoch_thread));
+    t->next = threads;
+    __atomic_store_n(&threads, t, __ATOMIC_RELEASE);
+  }
+  t->in_use = 1;
+  pthread_mutex_unlock(&threads_lock);
+
+  self = t;
+  pthread_setspecific(exit_key, t);
+  return t;
+}
+
+/*
+ * init: Creates the pool of retired entries and the key whose destructor
+ *       deregisters exiting threads, once.
+ */
+static void init(void) {
+  slab_pool_init(&retired_pool, sizeof(retired));
+  pthread_key_create(&exit_key, leave);
+}
+
+/*
+ * leave: Deregisters an exiting thread, leaving the blocks it retired to
+ *        be reclaimed by the others.
+ */
+static void leave(void *vargp) {
+  epoch_thread *t = vargp;
+  retired *last;
+
+  __atomic_store_n(&t->state, 0, __ATOMIC_RELEASE);
+  if(t->limbo != NULL) {
+    for(last = t->limbo; last->next != NULL; last = last->next)
+      ;
+    pthread_mutex_lock(&orphans_lock);
+    last->next = orphans;
+    orphans = t->limbo;
+    pthread_mutex_unlock(&orphans_lock);
+    t->limbo = NULL;
+    t->pending = 0;
+  }
+
+  pthread_mutex_lock(&threads_lock);
+  t->in_use = 0;
+  pthread_mutex_unlock(&threads_lock);
+  self = NULL;
+}
+
+/*
+ * advance: Advances the global epoch if every thread in a read has
+ *          announced the current one. Returns the global epoch.
+ */
+static uint64_t advance(void) {
+  uint64_t e = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+  epoch_thread *t;
+
+  for(t = __atomic_load_n(&threads, __ATOMIC_ACQUIRE); t != NULL;
+      t = t->next) {
+    uint64_t state = __atomic_load_n(&t->state, __ATOMIC_SEQ_CST);
+    if((state & 1) && (state >> 1) != e)
+      return e;
+  }
+  __atomic_compare_exchange_n(&global_epoch, &e, e + 1, 0,
+                              __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+  return __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * reclaim_expired: Reclaims the thread's retired blocks, and those of
+ *                  exited threads, whose grace period is over.
+ */
+static void reclaim_expired(epoch_thread *t) {
+  uint64_t e = advance();
+  retired *r, *next;
+
+  r = expired(&t->limbo, e);
+  if(pthread_mutex_trylock(&orphans_lock) == 0) {
+    retired *old = expired(&orphans, e);
+    pthread_mutex_unlock(&orphans_lock);
+    for(; old != NULL; old = next) {
+      next = old->next;
+      old->reclaim(old->block);
+      slab_free(old);
+    }
+  }
+  for(; r != NULL; r = next) {
+    next = r->next;
+    r->reclaim(r->block);
+    slab_free(r);
+    t->pending--;
+  }
+}
+
+/*
+ * expired: Unlinks the blocks in the list that were retired at least two
+ *          epochs before epoch, and returns them as a list.
+ */
+static retired *expired(retired **list, uint64_t epoch) {
+  retired *done = NULL, *r;
+
+  while((r = *list) != NULL) {
+    if(r->epoch + 2 <= epoch) {
+      *list = r->next;
+      r->next = done;
+      done = r;
+    }
+    else {
+      list = &r->next;
+    }
+  }
+  return done;
+}
@@ -0,0 +1,35 @@
+#ifndef __EPOCH_H__
+#define __EPOCH_H__
+
+#include "csapp.h"
+#include <stdint.h>
+
+/* Retired blocks a thread gathers before trying to reclaim them */
+#define EPOCH_BATCH 64
+
+typedef struct epoch_thread epoch_thread;
+typedef struct retired retired;
+
+/* A block waiting for a grace period before it is freed */
+struct retired {
+  void *block;
+  void (*reclaim)(void *block);
+  uint64_t epoch;     /* Global epoch when it was retired */
+  retired *next;
+};
+
+/* A thread taking part in epoch-based reclamation */
+struct epoch_thread {
+  uint64_t state;     /* Epoch it is reading in, shifted left, plus 1,
+                         or 0 outside a read */
+  int in_use;         /* Whether a running thread owns the record */
+  retired *limbo;     /* Blocks it retired that are not yet reclaimed */
+  int pending;
+  epoch_thread *next;
+};
+
+void epoch_enter(void);
+void epoch_exit(void);
+void epoch_retire(void *block, void (*reclaim)(void *block));
+
+#endif /* __EPOCH_H__ */
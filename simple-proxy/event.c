@@ -0,0 +1,678 @@
+/*
+ * event.c
+ *
+ * Derek Tzeng
+ * dtzeng
+ *
+ * An event-driven engine for the proxy, selected with "-e epoll". Instead
+ * of dedicating a blocked thread to every connection, a small number of
+ * event loop threads multiplex non-blocking client and server sockets
+ * through epoll, so idle or slow clients only cost a conn struct.
+ *
+ * Every event loop owns an epoll instance that watches the shared listening
+ * socket (with EPOLLEXCLUSIVE, so a new connection wakes only one loop) and
+ * every connection that loop has accepted. A connection never moves between
+ * loops, so its state needs no locking. Only the cache is shared.
+ *
+ * Each connection is a state machine:
+ *
+ * ST_REQUEST: Reading the request line and headers from the client. Once
+ *             the blank line arrives, the request is parsed and looked up
+ *             in the cache.
+ * ST_RESOLVE: Waiting for a resolver thread to look up the server, if its
+ *             name was not in the DNS cache. The resolver writes the
+ *             finished lookup to the loop's DNS pipe, so a slow name
+ *             server never stalls the loop.
+ * ST_HIT:     Writing a pinned cached object to the client.
+ * ST_CONNECT: Waiting for a non-blocking connect to the server to finish,
+ *             trying the next address on failure.
+ * ST_FORWARD: Writing the rewritten request to the server.
+ * ST_RELAY:   Reading the response from the server and writing it to the
+ *             client one buffer at a time. While the response may still be
+ *             cached, it is read straight into the segments that become
+ *             the cache object.
+ *             Only one side is watched at a time: the server while the
+ *             buffer is empty, and the client while it is draining.
+ * ST_SPLICE:  Once the response is known to be too large to cache, the
+ *             rest of it is spliced from the server through a pipe to the
+ *             client, so it is never copied into user space.
+ *
+ * Connections closed while handling an event are kept on a dead list until
+ * the whole batch of events has been handled, since a later event in the
+ * same batch may still refer to them. A connection closed while its server
+ * is being resolved is only freed once the lookup comes back, since the
+ * resolver still holds a pointer to it.
+ *
+ */
+
+#define _GNU_SOURCE /* for accept4 and splice */
+#include "proxy.h"
+#include "refresh.h"
+#include "event.h"
+#include <sys/epoll.h>
+
+/* Maximum number of events handled per epoll_wait */
+#define MAX_EVENTS 256
+
+/* Bytes kept in a connection's pipe when splicing a response */
+#define SPLICE_SIZE 65536
+
+typedef enum {
+  ST_REQUEST,
+  ST_RESOLVE,
+  ST_HIT,
+  ST_CONNECT,
+  ST_FORWARD,
+  ST_RELAY,
+  ST_SPLICE,
+  ST_CLOSED
+} conn_state;
+
+typedef struct loop loop;
+typedef struct conn conn;
+typedef struct endpoint endpoint;
+
+struct loop {
+  int epfd;
+  int listenfd;
+  int dnsfd[2];     /* Resolver threads write finished lookups to dnsfd[1] */
+  conn *dead;
+};
+
+struct endpoint {
+  conn *c;
+  int fd;
+  int registered;
+  uint32_t events;
+};
+
+struct conn {
+  conn_state state;
+  loop *L;
+  endpoint client;
+  endpoint server;
+  conn *next_dead;
+
+  /* Request from the client */
+  char in[MAXLINE];
+  int in_len;
+  char request[MAXLINE];
+
+  /* Rewritten request to the server */
+  char *out;
+  int out_len;
+  int out_pos;
+  dns_addrs addrs;
+  int next_addr;
+  int resolving;
+
+  /* Cached object being sent on a hit */
+  object *hit;
+  int hit_pos;
+
+  /* Response being relayed on a miss, where relay points either into the
+     cache object or, once it will not be cached, into relay_buf */
+  char relay_buf[MAXBUF];
+  char *relay;
+  int relay_len;
+  int relay_pos;
+  segbuf response;
+  int cacheable;
+  framing frame;
+
+  /* Pipe for splicing an uncacheable response */
+  int pipefd[2];
+  int piped;
+  int server_eof;
+};
+
+static void *event_loop(void *vargp);
+static void accept_clients(loop *L);
+static void handle_event(endpoint *ep, uint32_t events);
+static void watch(conn *c, endpoint *ep, uint32_t events);
+static void close_conn(conn *c);
+static void read_client(conn *c);
+static void start_request(conn *c);
+static void finish_resolve(loop *L);
+static void write_hit(conn *c);
+static void try_connect(conn *c);
+static void finish_connect(conn *c);
+static void write_server(conn *c);
+static void read_server(conn *c);
+static void write_client(conn *c);
+static void fill_cache(conn *c);
+static void splice_relay(conn *c);
+
+/*
+ * event_run: Starts the event loops on the listening socket. One loop runs
+ *            in the calling thread, so this never returns.
+ */
+void event_run(int listenfd, int loops) {
+  pthread_t tid;
+  int i;
+
+  fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL, 0) | O_NONBLOCK);
+  for(i = 1; i < loops; i++) {
+    Pthread_create(&tid, NULL, event_loop, &listenfd);
+  }
+  event_loop(&listenfd);
+}
+
+/*
+ * event_loop: Event loop thread routine. Waits for events on the loop's
+ *             epoll instance and dispatches them forever.
+ */
+static void *event_loop(void *vargp) {
+  struct epoll_event ev, events[MAX_EVENTS];
+  loop L;
+  int n, i;
+
+  L.listenfd = *((int *)vargp);
+  L.dead = NULL;
+  if((L.epfd = epoll_create1(0)) < 0)
+    unix_error("epoll_create1 error");
+
+  ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+  ev.data.ptr = NULL;
+  if(epoll_ctl(L.epfd, EPOLL_CTL_ADD, L.listenfd, &ev) < 0)
+    unix_error("epoll_ctl error");
+
+  /* Finished lookups are told apart by the loop itself as their pointer */
+  if(pipe(L.dnsfd) < 0)
+    unix_error("pipe error");
+  fcntl(L.dnsfd[0], F_SETFL, fcntl(L.dnsfd[0], F_GETFL, 0) | O_NONBLOCK);
+  ev.events = EPOLLIN;
+  ev.data.ptr = &L;
+  if(epoll_ctl(L.epfd, EPOLL_CTL_ADD, L.dnsfd[0], &ev) < 0)
+    unix_error("epoll_ctl error");
+
+  while(1) {
+    if((n = epoll_wait(L.epfd, events, MAX_EVENTS, -1)) < 0) {
+      if(errno == EINTR)
+        continue;
+      unix_error("epoll_wait error");
+    }
+    for(i = 0; i < n; i++) {
+      if(events[i].data.ptr == NULL)
+        accept_clients(&L);
+      else if(events[i].data.ptr == &L)
+        finish_resolve(&L);
+      else
+        handle_event(events[i].data.ptr, events[i].events);
+    }
+
+    /* Now that no event refers to them, free closed connections */
+    while(L.dead != NULL) {
+      conn *c = L.dead;
+      L.dead = c->next_dead;
+      free(c);
+    }
+  }
+  return NULL;
+}
+
+/*
+ * accept_clients: Accepts every pending connection and starts
+ *                 reading its request.
+ */
+static void accept_clients(loop *L) {
+  int connfd;
+
+  while((connfd = accept4(L->listenfd, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+    conn *c = Calloc(1, sizeof(conn));
+    c->state = ST_REQUEST;
+    c->L = L;
+    c->client.c = c;
+    c->client.fd = connfd;
+    c->server.c = c;
+    c->server.fd = -1;
+    c->pipefd[0] = c->pipefd[1] = -1;
+    watch(c, &c->client, EPOLLIN);
+  }
+}
+
+/*
+ * handle_event: Advances the connection of the endpoint that is ready.
+ */
+static void handle_event(endpoint *ep, uint32_t events) {
+  conn *c = ep->c;
+
+  if(c->state == ST_CLOSED)
+    return;
+
+  /* The client went away, so there is nobody left to serve */
+  if(ep == &c->client && (events & (EPOLLERR | EPOLLHUP))) {
+    close_conn(c);
+    return;
+  }
+
+  switch(c->state) {
+  case ST_REQUEST:
+    read_client(c);
+    break;
+  case ST_HIT:
+    write_hit(c);
+    break;
+  case ST_CONNECT:
+    finish_connect(c);
+    break;
+  case ST_FORWARD:
+    write_server(c);
+    break;
+  case ST_RELAY:
+    if(ep == &c->server)
+      read_server(c);
+    else
+      write_client(c);
+    break;
+  case ST_SPLICE:
+    splice_relay(c);
+    break;
+  default:
+    break;
+  }
+}
+
+/*
+ * watch: Sets the events the loop waits for on an endpoint,
+ *        registering it with epoll the first time.
+ */
+static void watch(conn *c, endpoint *ep, uint32_t events) {
+  struct epoll_event ev;
+
+  if(ep->registered && ep->events == events)
+    return;
+  ev.events = events;
+  ev.data.ptr = ep;
+  if(epoll_ctl(c->L->epfd, ep->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+               ep->fd, &ev) < 0) {
+    close_conn(c);
+    return;
+  }
+  ep->registered = 1;
+  ep->events = events;
+}
+
+/*
+ * close_conn: Closes both sockets of the connection, drops its resources,
+ *             and queues it to be freed at the end of the batch.
+ */
+static void close_conn(conn *c) {
+  if(c->state == ST_CLOSED)
+    return;
+  c->state = ST_CLOSED;
+
+  close(c->client.fd);
+  if(c->server.fd >= 0)
+    close(c->server.fd);
+  if(c->hit != NULL)
+    release_object(c->hit);
+  if(c->pipefd[0] >= 0) {
+    close(c->pipefd[0]);
+    close(c->pipefd[1]);
+  }
+  free(c->out);
+  segbuf_free(&c->response);
+
+  /* The resolver still refers to it, so finish_resolve frees it */
+  if(c->resolving)
+    return;
+  c->next_dead = c->L->dead;
+  c->L->dead = c;
+}
+
+/*
+ * read_client: Reads more of the request, and starts handling it once
+ *              the blank line ending the headers has arrived.
+ */
+static void read_client(conn *c) {
+  int n = read(c->client.fd, c->in + c->in_len, sizeof(c->in) - 1 - c->in_len);
+
+  if(n < 0) {
+    if(errno != EAGAIN && errno != EINTR)
+      close_conn(c);
+    return;
+  }
+  if(n == 0) {
+    close_conn(c);
+    return;
+  }
+  c->in_len += n;
+  c->in[c->in_len] = '\0';
+
+  if(strstr(c->in, "\r\n\r\n") != NULL) {
+    start_request(c);
+  }
+  else if(c->in_len == sizeof(c->in) - 1) {
+    clienterror(c->client.fd, "GET", "400", "Bad Request",
+                "Request headers are too long");
+    close_conn(c);
+  }
+}
+
+/*
+ * start_request: Parses the buffered request, then either serves it from
+ *                the cache or starts connecting to the server.
+ */
+static void start_request(conn *c) {
+  char host[MAXLINE], req_port[MAXLINE];
+  int status;
+
+  /* Stop reading from the client while the request is served */
+  watch(c, &c->client, 0);
+  if(c->state == ST_CLOSED)
+    return;
+
+  if((status = parse_request(c->in, c->request, host, req_port,
+                             &c->out)) != 0) {
+    send_status(c->client.fd, status);
+    close_conn(c);
+    return;
+  }
+  c->out_len = strlen(c->out);
+
+  /* Check if request is in the cache, which pins the object until sent */
+  if((c->hit = cache_lookup(proxy_cache, c->request)) != NULL &&
+     (object_fresh(c->hit) || refresh_stale(c->hit))) {
+    c->state = ST_HIT;
+    watch(c, &c->client, EPOLLOUT);
+    write_hit(c);
+    return;
+  }
+
+  /*
+   * Stale objects past the stale window are fetched anew, replacing them
+   * in the cache, while those within it are refreshed in the background
+   */
+  if(c->hit != NULL) {
+    release_object(c->hit);
+    c->hit = NULL;
+  }
+
+  /* Resolve the server, on a resolver thread if the name is not cached */
+  if((status = dns_lookup_async(host, req_port, &c->addrs, c->L->dnsfd[1],
+                                c)) < 0) {
+    send_status(c->client.fd, 404);
+    close_conn(c);
+    return;
+  }
+  if(status > 0) {
+    c->state = ST_RESOLVE;
+    c->resolving = 1;
+    return;
+  }
+  c->next_addr = 0;
+  try_connect(c);
+}
+
+/*
+ * finish_resolve: Carries on with every connection whose lookup a resolver
+ *                 thread has finished, connecting to the server.
+ */
+static void finish_resolve(loop *L) {
+  dns_query *q;
+  conn *c;
+
+  while(read(L->dnsfd[0], &q, sizeof(q)) == sizeof(q)) {
+    c = q->arg;
+    c->resolving = 0;
+    if(c->state == ST_CLOSED) {
+      /* The client left while waiting, so only freeing it is left */
+      c->next_dead = L->dead;
+      L->dead = c;
+    }
+    else if(q->status < 0) {
+      send_status(c->client.fd, 404);
+      close_conn(c);
+    }
+    else {
+      c->addrs = q->addrs;
+      c->next_addr = 0;
+      try_connect(c);
+    }
+    dns_query_free(q);
+  }
+}
+
+/*
+ * write_hit: Writes as much of the cached object as the client accepts,
+ *            and closes the connection once all of it has been sent.
+ */
+static void write_hit(conn *c) {
+  while(c->hit_pos < c->hit->size) {
+    int n = seg_write(c->client.fd, c->hit->response, c->hit_pos,
+                      c->hit->size);
+    if(n < 0) {
+      if(errno == EAGAIN)
+        return;
+      if(errno == EINTR)
+        continue;
+      break;
+    }
+    c->hit_pos += n;
+  }
+  close_conn(c);
+}
+
+/*
+ * try_connect: Starts a non-blocking connect to the next server address,
+ *              and reports an error to the client if none are left.
+ */
+static void try_connect(conn *c) {
+  for(; c->next_addr < c->addrs.num; c->next_addr++) {
+    dns_addr *p = &c->addrs.addr[c->next_addr];
+    int fd = socket(p->family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if(fd < 0)
+      continue;
+    if(connect(fd, (SA *)&p->addr, p->len) == 0 || errno == EINPROGRESS) {
+      c->server.fd = fd;
+      c->server.registered = 0;
+      c->state = ST_CONNECT;
+      watch(c, &c->server, EPOLLOUT);
+      return;
+    }
+    close(fd);
+  }
+
+  send_status(c->client.fd, 404);
+  close_conn(c);
+}
+
+/*
+ * finish_connect: Checks the outcome of the connect, and either starts
+ *                 forwarding the request or moves on to the next address.
+ */
+static void finish_connect(conn *c) {
+  int err = 0;
+  socklen_t len = sizeof(err);
+
+  if(getsockopt(c->server.fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 ||
+     err != 0) {
+    close(c->server.fd);
+    c->server.fd = -1;
+    c->next_addr++;
+    try_connect(c);
+    return;
+  }
+
+  c->state = ST_FORWARD;
+  write_server(c);
+}
+
+/*
+ * write_server: Writes as much of the request as the server accepts, then
+ *               starts relaying the response once all of it has been sent.
+ */
+static void write_server(conn *c) {
+  while(c->out_pos < c->out_len) {
+    int n = write(c->server.fd, c->out + c->out_pos, c->out_len - c->out_pos);
+    if(n < 0) {
+      if(errno == EAGAIN) {
+        watch(c, &c->server, EPOLLOUT);
+        return;
+      }
+      if(errno == EINTR)
+        continue;
+      close_conn(c);
+      return;
+    }
+    c->out_pos += n;
+  }
+
+  c->state = ST_RELAY;
+  c->cacheable = 1;
+  frame_init(&c->frame);
+  watch(c, &c->server, EPOLLIN);
+}
+
+/*
+ * read_server: Reads the next chunk of the response, into the cache object
+ *              if it may still be cached, and starts writing it to the
+ *              client.
+ */
+static void read_server(conn *c) {
+  int room = MAXBUF;
+  int n;
+
+  c->relay = c->relay_buf;
+  if(c->cacheable)
+    c->relay = segbuf_space(&c->response, &room);
+  if((n = read(c->server.fd, c->relay, room)) < 0) {
+    if(errno != EAGAIN && errno != EINTR)
+      close_conn(c);
+    return;
+  }
+  if(n == 0) {
+    fill_cache(c);
+    close_conn(c);
+    return;
+  }
+
+  if(c->cacheable) {
+    if((c->response.size == 0 &&
+        response_length(c->relay, n) > max_object_size) ||
+       (c->response.size + n) > max_object_size) {
+      /* Keep the chunk until it is written, but cache nothing */
+      memcpy(c->relay_buf, c->relay, n);
+      c->relay = c->relay_buf;
+      c->cacheable = 0;
+      segbuf_free(&c->response);
+    }
+    else {
+      segbuf_commit(&c->response, n);
+      frame_scan(&c->frame, c->relay, n);
+    }
+  }
+  c->relay_len = n;
+  c->relay_pos = 0;
+  write_client(c);
+}
+
+/*
+ * write_client: Writes the buffered chunk to the client. If the client
+ *               cannot take all of it, waits on the client instead of the
+ *               server until it drains. Once drained, switches to splicing
+ *               if the response will not be cached.
+ */
+static void write_client(conn *c) {
+  while(c->relay_pos < c->relay_len) {
+    int n = write(c->client.fd, c->relay + c->relay_pos,
+                  c->relay_len - c->relay_pos);
+    if(n < 0) {
+      if(errno == EAGAIN) {
+        watch(c, &c->server, 0);
+        watch(c, &c->client, EPOLLOUT);
+        return;
+      }
+      if(errno == EINTR)
+        continue;
+      close_conn(c);
+      return;
+    }
+    c->relay_pos += n;
+  }
+
+  if(!c->cacheable && pipe2(c->pipefd, O_NONBLOCK) == 0) {
+    c->state = ST_SPLICE;
+    splice_relay(c);
+    return;
+  }
+  watch(c, &c->client, 0);
+  watch(c, &c->server, EPOLLIN);
+}
+
+/*
+ * fill_cache: Adds the relayed response to the cache if it was small
+ *             enough to be kept, arrived whole, and may be stored. A
+ *             response cut off by the server closing early is dropped.
+ */
+static void fill_cache(conn *c) {
+  if(!c->cacheable)
+    return;
+  if(c->frame.state != FRAME_DONE && c->frame.state != FRAME_UNTIL_CLOSE)
+    return;
+
+  segbuf_trim(&c->response);
+  object *new_obj = response_object(c->request, &c->response);
+  if(new_obj == NULL)
+    return;
+  segbuf_init(&c->response);
+  cache_store(proxy_cache, new_obj);
+}
+
+/*
+ * splice_relay: Splices as much of the response from the server into the
+ *               pipe, and from the pipe to the client, as the sockets
+ *               allow. Waits on the client while the pipe has data it
+ *               cannot take, and on the server otherwise.
+ */
+static void splice_relay(conn *c) {
+  ssize_t n;
+
+  while(!c->server_eof && c->piped < SPLICE_SIZE) {
+    n = splice(c->server.fd, NULL, c->pipefd[1], NULL, SPLICE_SIZE - c->piped,
+               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if(n == 0) {
+      c->server_eof = 1;
+    }
+    else if(n < 0) {
+      if(errno == EAGAIN)
+        break;
+      if(errno != EINTR) {
+        close_conn(c);
+        return;
+      }
+    }
+    else {
+      c->piped += n;
+    }
+  }
+
+  while(c->piped > 0) {
+    n = splice(c->pipefd[0], NULL, c->client.fd, NULL, c->piped,
+               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if(n < 0) {
+      if(errno == EAGAIN)
+        break;
+      if(errno != EINTR) {
+        close_conn(c);
+        return;
+      }
+    }
+    else {
+      c->piped -= n;
+    }
+  }
+
+  if(c->server_eof && c->piped == 0) {
+    close_conn(c);
+  }
+  else if(c->piped > 0) {
+    watch(c, &c->server, 0);
+    watch(c, &c->client, EPOLLOUT);
+  }
+  else {
+    watch(c, &c->client, 0);
+    watch(c, &c->server, EPOLLIN);
+  }
+}
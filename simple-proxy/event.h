@@ -0,0 +1,7 @@
+#ifndef __EVENT_H__
+#define __EVENT_H__
+
+/* Runs the epoll engine with the given number of event loops */
+void event_run(int listenfd, int loops);
+
+#endif /* __EVENT_H__ */
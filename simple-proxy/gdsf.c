@@ -0,0 +1,188 @@
+/*
+ * gdsf.c
+ *
+ * Derek Tzeng
+ * dtzeng
+ *
+ * GreedyDual-Size-Frequency eviction policy.
+ *
+ * LRU and the FIFO policies ignore object size, so a single large object
+ * can push out hundreds of small hot ones. GDSF gives every object the
+ * priority
+ *
+ *   L + (hits + 1) / size
+ *
+ * where size is the memory the object is charged for, and evicts the
+ * object with the lowest priority, so small and popular objects stay
+ * longest. L, the inflation value, is set to the priority of each evicted
+ * object, so objects that stop being hit eventually fall below newly
+ * inserted ones instead of staying cached forever.
+ *
+ * Objects are kept in a binary min-heap ordered by priority. Hits only
+ * count the object's frequency, so a hit never takes the shard's lock, and
+ * priorities are brought up to date lazily: when the object at the top of
+ * the heap has been hit since its priority was computed, its priority is
+ * recomputed and it sinks back into the heap before another is tried.
+ *
+ */
+
+#include "policy.h"
+
+typedef struct {
+  object **heap;
+  int count;
+  int slots;
+  double L;         /* Inflation value */
+} gdsf;
+
+static double gdsf_priority(gdsf *G, object *obj, int freq);
+static void heap_set(gdsf *G, int pos, object *obj);
+static void sift_up(gdsf *G, int pos);
+static void sift_down(gdsf *G, int pos);
+
+/*
+ * gdsf_init: Sets up an empty heap for the shard.
+ */
+static void gdsf_init(shard *S) {
+  gdsf *G = Malloc(sizeof(gdsf));
+
+  G->slots = GDSF_INIT_HEAP;
+  G->heap = Malloc(G->slots * sizeof(object *));
+  G->count = 0;
+  G->L = 0;
+  S->state = G;
+}
+
+/*
+ * gdsf_destroy: Frees the shard's heap.
+ */
+static void gdsf_destroy(shard *S) {
+  gdsf *G = S->state;
+
+  free(G->heap);
+  free(G);
+}
+
+/*
+ * gdsf_insert: Adds a new object to the heap.
+ */
+static void gdsf_insert(shard *S, object *obj) {
+  gdsf *G = S->state;
+
+  if(G->count == G->slots) {
+    G->slots *= 2;
+    G->heap = Realloc(G->heap, G->slots * sizeof(object *));
+  }
+  obj->freq = 0;
+  obj->mark = 0;
+  obj->priority = gdsf_priority(G, obj, 0);
+  heap_set(G, G->count++, obj);
+  sift_up(G, obj->pos);
+}
+
+/*
+ * gdsf_remove: Removes the object from the heap.
+ */
+static void gdsf_remove(shard *S, object *obj) {
+  gdsf *G = S->state;
+  int pos = obj->pos;
+
+  G->count--;
+  if(pos != G->count) {
+    object *last = G->heap[G->count];
+    heap_set(G, pos, last);
+    sift_up(G, pos);
+    sift_down(G, last->pos);
+  }
+  obj->pos = -1;
+}
+
+/*
+ * gdsf_victim: Returns the object with the lowest up to date priority.
+ */
+static object *gdsf_victim(shard *S) {
+  gdsf *G = S->state;
+  object *obj;
+  int freq;
+
+  while(1) {
+    obj = G->heap[0];
+    freq = __atomic_load_n(&obj->freq, __ATOMIC_RELAXED);
+    if(freq == obj->mark)
+      break;
+    obj->mark = freq;
+    obj->priority = gdsf_priority(G, obj, freq);
+    sift_down(G, 0);
+  }
+  return obj;
+}
+
+/*
+ * gdsf_evicted: Inflates L to the priority of the victim.
+ */
+static void gdsf_evicted(shard *S, object *obj) {
+  gdsf *G = S->state;
+
+  G->L = obj->priority;
+}
+
+/*
+ * gdsf_hit: Counts a hit.
+ */
+static void gdsf_hit(object *obj) {
+  __atomic_add_fetch(&obj->freq, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * gdsf_priority: Returns the priority of an object hit freq times.
+ */
+static double gdsf_priority(gdsf *G, object *obj, int freq) {
+  return G->L + (double)(freq + 1) / obj->charge;
+}
+
+/*
+ * heap_set: Stores the object at the given heap position.
+ */
+static void heap_set(gdsf *G, int pos, object *obj) {
+  G->heap[pos] = obj;
+  obj->pos = pos;
+}
+
+/*
+ * sift_up: Moves the object at pos up until its parent has a lower
+ *          priority.
+ */
+static void sift_up(gdsf *G, int pos) {
+  object *obj = G->heap[pos];
+
+  while(pos > 0 && G->heap[(pos - 1) / 2]->priority > obj->priority) {
+    heap_set(G, pos, G->heap[(pos - 1) / 2]);
+    pos = (pos - 1) / 2;
+  }
+  heap_set(G, pos, obj);
+}
+
+/*
+ * sift_down: Moves the object at pos down until its children have higher
+ *            priorities.
+ */
+static void sift_down(gdsf *G, int pos) {
+  object *obj = G->heap[pos];
+  int child;
+
+  while((child = 2 * pos + 1) < G->count) {
+    if(child + 1 < G->count &&
+       G->heap[child + 1]->priority < G->heap[child]->priority)
+      child++;
+    if(G->heap[child]->priority >= obj->priority)
+      break;
+    heap_set(G, pos, G->heap[child]);
+    pos = child;
+  }
+  heap_set(G, pos, obj);
+}
+
+policy gdsf_policy = {
+  "gdsf", gdsf_init, gdsf_destroy, gdsf_insert, gdsf_remove, gdsf_victim,
+  gdsf_evicted, gdsf_hit
+};
@@ -0,0 +1,796 @@
+/*
+ * http.c
+ *
+ * Derek Tzeng
+ * dtzeng
+ *
+ * HTTP helpers shared by the proxy's connection engines: parsing the
+ * request line and URI, filtering and rewriting the request headers that
+ * are forwarded to the server, and sending error pages to the client.
+ *
+ * Requests are parsed in a single pass over the bytes as received, without
+ * copying them. scan_line finds the end of a line and the colon after a
+ * header's name together, sixteen bytes at a time with SSE2 where it is
+ * available, and split_header splits the line into slices of its name and
+ * value. Whether the proxy forwards, drops, or acts on a header is looked
+ * up in a perfect hash table of the few names it handles, so each header
+ * costs one hash and at most one comparison. Kept header lines are copied
+ * whole to the end of the request for the server, which is tracked as it
+ * grows rather than found again for every line.
+ *
+ * Responses on persistent server connections have no end of file to mark
+ * where they stop, so frame_scan follows a response as it streams by and
+ * finds its end from the status code, Content-Length, or chunked
+ * Transfer-Encoding, in the manner of RFC 7230 section 3.3.3. It also
+ * tracks whether the server is willing to keep the connection open.
+ *
+ * fresh_parse reads the caching information in a response's headers, in
+ * the manner of RFC 9111: the Cache-Control directives, Expires, Date,
+ * Age, and the ETag and Last-Modified validators. fresh_storable decides
+ * from it whether a shared cache may store the response at all, and
+ * fresh_until how long it stays fresh. Responses without an explicit
+ * lifetime get a tenth of the time since they were last modified, or
+ * FRESH_DEFAULT seconds if they do not say.
+ *
+ */
+
+#define _GNU_SOURCE /* for strcasestr, strptime and timegm */
+#include "http.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* You won't lose style points for including these long lines in your code */
+static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
+static const char *accept_hdr = "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n";
+static const char *accept_encoding_hdr = "Accept-Encoding: gzip, deflate\r\n";
+static const char *connection_hdr = "Connection: close\r\n";
+static const char *proxy_connection_hdr = "Proxy-Connection: close\r\n";
+static const char *keep_alive_hdr = "Connection: keep-alive\r\n";
+
+/* The header names the proxy handles, each in the slot header_kind hashes
+   it to */
+static const struct {
+  char *name;
+  int len;
+  int kind;
+} header_table[HEADER_SLOTS] = {
+  [3] = {"Accept", 6, HDR_REPLACED},
+  [4] = {"Keep-Alive", 10, HDR_CONNECTION},
+  [5] = {"Accept-Encoding", 15, HDR_REPLACED},
+  [7] = {"Connection", 10, HDR_CONNECTION},
+  [8] = {"Host", 4, HDR_HOST},
+  [9] = {"If-Modified-Since", 17, HDR_REPLACED},
+  [10] = {"Proxy-Connection", 16, HDR_CONNECTION},
+  [11] = {"User-Agent", 10, HDR_REPLACED},
+  [14] = {"If-None-Match", 13, HDR_REPLACED},
+};
+
+static char *scan_line(char *p, char *end, char **colon);
+static char *next_token(char *p, char *end, int *len);
+static int has_token(char *value, int len, char *token);
+
+/*
+ * read_request: Reads and parses the request line, skipping blank lines
+ *               left between pipelined requests. Sets keep_alive if the
+ *               client's HTTP version keeps connections open by default.
+ *               Returns 0 on success, -1 if the client closed the
+ *               connection, or the HTTP status code to send back.
+ */
+int read_request(rio_t *rio, char *request, char *uri, int *keep_alive) {
+  char buf[MAXLINE];
+  int n;
+
+  do {
+    if((n = rio_readlineb(rio, buf, MAXLINE)) <= 0)
+      return -1;
+  } while(!strcmp(buf, "\r\n") || !strcmp(buf, "\n"));
+
+  /* A null byte sent by the client ends the line early */
+  n = strlen(buf);
+  memcpy(request, buf, n + 1);
+  return parse_request_line(buf, n, uri, keep_alive);
+}
+
+/*
+ * parse_request_line: Splits the request line of len bytes into its
+ *                     method, URI, and version, copying the URI into uri.
+ *                     Sets keep_alive if the version keeps connections
+ *                     open by default. Returns 0 on success, or the HTTP
+ *                     status code to send back.
+ */
+int parse_request_line(char *line, int len, char *uri, int *keep_alive) {
+  char *end = line + len;
+  char *method, *target, *version;
+  int method_len, target_len, version_len;
+
+  method = next_token(line, end, &method_len);
+  target = next_token(method + method_len, end, &target_len);
+  version = next_token(target + target_len, end, &version_len);
+  if(version_len == 0)
+    return 400;
+  if(method_len != 3 || strncasecmp(method, "GET", 3))
+    return 501;
+  memcpy(uri, target, target_len);
+  uri[target_len] = '\0';
+  *keep_alive = (version_len == 8 && !strncasecmp(version, "HTTP/1.1", 8));
+  return 0;
+}
+
+/*
+ * parse_request: Parses a buffered request, which must hold everything up
+ *                to the blank line ending the headers. Copies the request
+ *                line into request, fills in the host and port, and returns
+ *                the rewritten request for the server as a new string in
+ *                server_req. Returns 0 on success, or the HTTP status code
+ *                to send back to the client.
+ */
+int parse_request(char *buf, char *request, char *host, char *req_port,
+                  char **server_req) {
+  char uri[MAXLINE], remain[MAXLINE];
+  char *end = buf + strlen(buf);
+  char *line_end, *p, *out;
+  http_header h;
+  int status, keep_alive;
+
+  /* Parse the request line */
+  if((line_end = memchr(buf, '\n', end - buf)) == NULL ||
+     line_end + 1 - buf >= MAXLINE)
+    return 400;
+  memcpy(request, buf, line_end + 1 - buf);
+  request[line_end + 1 - buf] = '\0';
+  if((status = parse_request_line(request, line_end + 1 - buf, uri,
+                                  &keep_alive)) != 0)
+    return status;
+  read_uri(uri, host, req_port, remain);
+
+  /* Copy the kept header lines straight into the request for the server,
+     which the rewritten request line and the proxy's headers fit beside */
+  *server_req = Malloc(strlen(remain) + (end - buf) + PROXYHDRS_LEN);
+  out = stpcpy(stpcpy(stpcpy(*server_req, "GET "), remain), " HTTP/1.0\r\n");
+  for(p = line_end + 1; (status = split_header(p, end, &h)) > 0;
+      p += h.line_len) {
+    if(header_kind(h.name, h.name_len) <= HDR_HOST) {
+      memcpy(out, p, h.line_len);
+      out += h.line_len;
+    }
+  }
+  if(status < 0) {
+    free(*server_req);
+    *server_req = NULL;
+    return 400;
+  }
+  *out = '\0';
+  cat_proxyhdrs(out, 0);
+  strcat(out, "\r\n");
+  return 0;
+}
+
+/*
+ * read_uri : Parses the URI into host, port (default 80), and remain,
+ *            in one pass.
+ */
+void read_uri(char *uri, char *host, char *port, char *remain) {
+  char *uri_p = uri;
+  char *host_end, *port_end;
+
+  /* Ignore "http://" */
+  if(strncasecmp(uri, "http://", 7) == 0) {
+    uri_p += 7;
+  }
+
+  /* Copy host, then the port if one was requested */
+  host_end = uri_p + strcspn(uri_p, ":/");
+  memcpy(host, uri_p, host_end - uri_p);
+  host[host_end - uri_p] = '\0';
+  port_end = host_end;
+  if(*host_end == ':')
+    port_end += 1 + strcspn(host_end + 1, "/");
+  if(port_end - host_end > 1) {
+    memcpy(port, host_end + 1, port_end - host_end - 1);
+    port[port_end - host_end - 1] = '\0';
+  }
+  else {
+    strcpy(port, "80");
+  }
+
+  /* Copy remaining path */
+  strcpy(remain, port_end);
+}
+
+/*
+ * cat_requesthdrs: Reads the request headers and appends them to
+ *                  req_headers, adding a Host header for host and port
+ *                  if the client did not send one. The proxy's headers
+ *                  ask the server to keep the connection open if the
+ *                  request goes out as HTTP/1.1 (http11), or to close
+ *                  it otherwise. Clears keep_alive if the client asks to
+ *                  close its connection. req_headers holds MAXLINE
+ *                  bytes. Returns 0 on success, or -1 if the headers are
+ *                  cut off or do not fit.
+ */
+int cat_requesthdrs(rio_t *rio, char *req_headers, char *host, char *port,
+                    int http11, int *keep_alive) {
+  char buf[MAXLINE];
+  char *out = req_headers + strlen(req_headers);
+  char *limit = req_headers + MAXLINE - PROXYHDRS_LEN;
+  http_header h;
+  int n, status, kind;
+  int has_host = 0;
+
+  while(1) {
+    if((n = rio_readlineb(rio, buf, MAXLINE)) <= 0)
+      return -1;
+    if((status = split_header(buf, buf + n, &h)) == 0)
+      break;
+    if(status < 0)
+      return -1;
+
+    kind = header_kind(h.name, h.name_len);
+    if(kind == HDR_HOST)
+      has_host = 1;
+    if(kind == HDR_CONNECTION && has_token(h.value, h.value_len, "close"))
+      *keep_alive = 0;
+
+    /* Keep additional request headers */
+    if(kind <= HDR_HOST) {
+      if(out + n > limit)
+        return -1;
+      memcpy(out, buf, n);
+      out += n;
+    }
+  }
+
+  /* HTTP/1.1 servers require the Host header */
+  if(!has_host) {
+    if(strcmp(port, "80"))
+      n = snprintf(out, limit - out, "Host: %s:%s\r\n", host, port);
+    else
+      n = snprintf(out, limit - out, "Host: %s\r\n", host);
+    if(n >= limit - out)
+      return -1;
+    out += n;
+  }
+  *out = '\0';
+
+  /* Concatenate remaining request headers */
+  cat_proxyhdrs(out, http11);
+  return 0;
+}
+
+/*
+ * split_header: Splits the line starting at line, which must end before
+ *               end, into h without copying it. Returns 1 for a header,
+ *               0 for the blank line ending the headers, or -1 if the line
+ *               is cut off.
+ */
+int split_header(char *line, char *end, http_header *h) {
+  char *colon, *eol, *value, *value_end;
+
+  if((eol = scan_line(line, end, &colon)) == NULL)
+    return -1;
+  h->line_len = eol + 1 - line;
+  value_end = (eol > line && eol[-1] == '\r') ? eol - 1 : eol;
+  if(value_end == line)
+    return 0;
+
+  h->name = line;
+  if(colon == NULL) {
+    h->name_len = 0;
+    value = line;
+  }
+  else {
+    h->name_len = colon - line;
+    for(value = colon + 1; value < value_end &&
+                           (*value == ' ' || *value == '\t'); value++)
+      ;
+  }
+  while(value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t'))
+    value_end--;
+  h->value = value;
+  h->value_len = value_end - value;
+  return 1;
+}
+
+/*
+ * header_kind: Returns what the proxy does with a header of the given
+ *              name, one of the HDR_ kinds. The names it handles hash to
+ *              distinct slots by their length and their first and last
+ *              letters, regardless of case.
+ */
+int header_kind(char *name, int len) {
+  int slot;
+
+  if(len == 0)
+    return HDR_OTHER;
+  slot = (len + (name[0] | 0x20) + 3 * (name[len - 1] | 0x20)) &
+         (HEADER_SLOTS - 1);
+  if(header_table[slot].len == len &&
+     !strncasecmp(header_table[slot].name, name, len))
+    return header_table[slot].kind;
+  return HDR_OTHER;
+}
+
+/*
+ * scan_line: Returns the newline ending the line that starts at p, or NULL
+ *            if there is none before end. Sets colon to the first colon in
+ *            the line, or NULL if it has none.
+ */
+static char *scan_line(char *p, char *end, char **colon) {
+  *colon = NULL;
+#ifdef __SSE2__
+  const __m128i newlines = _mm_set1_epi8('\n');
+  const __m128i colons = _mm_set1_epi8(':');
+
+  for(; end - p >= 16; p += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)p);
+    int nl = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newlines));
+    int cl = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, colons));
+
+    if(*colon == NULL && cl != 0 &&
+       (nl == 0 || __builtin_ctz(cl) < __builtin_ctz(nl)))
+      *colon = p + __builtin_ctz(cl);
+    if(nl != 0)
+      return p + __builtin_ctz(nl);
+  }
+#endif
+  for(; p < end; p++) {
+    if(*p == '\n')
+      return p;
+    if(*p == ':' && *colon == NULL)
+      *colon = p;
+  }
+  return NULL;
+}
+
+/*
+ * next_token: Returns the first word at or after p and before end, and
+ *             sets len to its length, which is 0 if there is none.
+ */
+static char *next_token(char *p, char *end, int *len) {
+  char *start;
+
+  while(p < end && isspace((unsigned char)*p))
+    p++;
+  for(start = p; p < end && !isspace((unsigned char)*p); p++)
+    ;
+  *len = p - start;
+  return start;
+}
+
+/*
+ * has_token: Returns 1 if the comma separated list in the value of len
+ *            bytes includes the token, ignoring case, or 0 otherwise.
+ */
+static int has_token(char *value, int len, char *token) {
+  int token_len = strlen(token);
+  char *end = value + len;
+  char *item, *item_end;
+
+  for(item = value; item < end; item = item_end + 1) {
+    if((item_end = memchr(item, ',', end - item)) == NULL)
+      item_end = end;
+    while(item < item_end && (*item == ' ' || *item == '\t'))
+      item++;
+    if(item_end - item >= token_len &&
+       !strncasecmp(item, token, token_len)) {
+      char *rest = item + token_len;
+      while(rest < item_end && (*rest == ' ' || *rest == '\t'))
+        rest++;
+      if(rest == item_end)
+        return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * cat_proxyhdrs: Appends the headers the proxy always sends to req_headers,
+ *                asking the server to keep the connection open if
+ *                keep_alive is set, or to close it otherwise.
+ */
+void cat_proxyhdrs(char *req_headers, int keep_alive) {
+  char *p = req_headers + strlen(req_headers);
+
+  p = stpcpy(p, user_agent_hdr);
+  p = stpcpy(p, accept_hdr);
+  p = stpcpy(p, accept_encoding_hdr);
+  if(keep_alive) {
+    stpcpy(p, keep_alive_hdr);
+  }
+  else {
+    p = stpcpy(p, connection_hdr);
+    stpcpy(p, proxy_connection_hdr);
+  }
+}
+
+/*
+ * remove_newline: Removes the termination characters in a header value
+ */
+void remove_newline(char *header) {
+  header[strcspn(header, "\r")] = '\0';
+}
+
+/*
+ * clienterror - returns an error message to the client
+ */
+void clienterror(int fd, char *cause, char *errnum,
+		 char *shortmsg, char *longmsg) {
+  char buf[MAXLINE], body[MAXBUF];
+
+  /* Build the HTTP response body */
+  sprintf(body, "<html><title>Tiny Error</title>");
+  sprintf(body, "%s<body bgcolor=""ffffff"">\r\n", body);
+  sprintf(body, "%s%s: %s\r\n", body, errnum, shortmsg);
+  sprintf(body, "%s<p>%s: %s\r\n", body, longmsg, cause);
+  sprintf(body, "%s<hr><em>The Tiny Web server</em>\r\n", body);
+
+  /* Print the HTTP response */
+  sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
+  if(rio_writen(fd, buf, strlen(buf)) < 0) {
+    if(errno != EPIPE)
+      close(fd);
+  }
+  sprintf(buf, "Content-type: text/html\r\n");
+  if(rio_writen(fd, buf, strlen(buf)) < 0) {
+    if(errno != EPIPE)
+      close(fd);
+  }
+  sprintf(buf, "Content-length: %d\r\n\r\n", (int)strlen(body));
+  if(rio_writen(fd, buf, strlen(buf)) < 0) {
+    if(errno != EPIPE)
+      close(fd);
+  }
+  if(rio_writen(fd, body, strlen(body)) < 0) {
+    if(errno != EPIPE)
+      close(fd);
+  }
+}
+
+/*
+ * send_status: Sends the error page for a status code
+ *              returned by parse_request.
+ */
+void send_status(int fd, int status) {
+  switch(status) {
+  case 400:
+    clienterror(fd, "GET", "400", "Bad Request",
+                "Proxy could not be understood");
+    break;
+  case 501:
+    clienterror(fd, "GET", "501", "Not Implemented",
+                "Proxy only supports GET method");
+    break;
+  case 503:
+    clienterror(fd, "GET", "503", "Service Unavailable",
+                "Proxy is too busy to handle the request");
+    break;
+  default:
+    clienterror(fd, "GET", "404", "Not found",
+                "Requested URL could not be found");
+    break;
+  }
+}
+
+/*
+ * response_length: Returns the Content-Length of a response given its first
+ *                  len bytes in buf, or -1 if the headers within those bytes
+ *                  do not announce one.
+ */
+long response_length(char *buf, int len) {
+  char *line = buf;
+  char *end = buf + len;
+  char *eol;
+
+  /* Skip the status line, then scan the headers up to the blank line */
+  if((eol = memchr(line, '\n', end - line)) == NULL)
+    return -1;
+  for(line = eol + 1; line < end; line = eol + 1) {
+    if((eol = memchr(line, '\n', end - line)) == NULL)
+      return -1;
+    if(eol - line <= 1)
+      return -1;
+    if(eol - line > 15 && !strncasecmp(line, "Content-Length:", 15)) {
+      char num[32];
+      int n = eol - (line + 15);
+      if(n >= (int)sizeof(num))
+        n = sizeof(num) - 1;
+      memcpy(num, line + 15, n);
+      num[n] = '\0';
+      return strtol(num, NULL, 10);
+    }
+  }
+  return -1;
+}
+
+/*
+ * frame_init: Prepares f to follow a new response.
+ */
+void frame_init(framing *f) {
+  f->state = FRAME_HEADERS;
+  f->remaining = 0;
+  f->length = -1;
+  f->status = 0;
+  f->chunked = 0;
+  f->keep_alive = 0;
+  f->line_len = 0;
+}
+
+/*
+ * frame_line: Handles a complete header, chunk size, or trailer line of
+ *             the response, without its line terminator.
+ */
+static void frame_line(framing *f, char *line) {
+  int major = 0, minor = 0;
+
+  switch(f->state) {
+  case FRAME_HEADERS:
+    if(f->status == 0) {
+      /* Status line; HTTP/1.1 connections persist by default */
+      if(sscanf(line, "HTTP/%d.%d %d", &major, &minor, &f->status) != 3)
+        f->status = 500;
+      f->keep_alive = (major > 1 || (major == 1 && minor >= 1));
+    }
+    else if(line[0] != '\0') {
+      if(!strncasecmp(line, "Content-Length:", 15))
+        f->length = strtol(line + 15, NULL, 10);
+      else if(!strncasecmp(line, "Transfer-Encoding:", 18))
+        f->chunked = (strcasestr(line + 18, "chunked") != NULL);
+      else if(!strncasecmp(line, "Connection:", 11)) {
+        if(strcasestr(line + 11, "close"))
+          f->keep_alive = 0;
+        else if(strcasestr(line + 11, "keep-alive"))
+          f->keep_alive = 1;
+      }
+    }
+    else if(f->status / 100 == 1) {
+      /* Interim response, so the real one follows */
+      f->status = 0;
+      f->length = -1;
+      f->chunked = 0;
+    }
+    else if(f->status == 204 || f->status == 304) {
+      f->state = FRAME_DONE;
+    }
+    else if(f->chunked) {
+      f->state = FRAME_CHUNK_SIZE;
+    }
+    else if(f->length >= 0) {
+      f->remaining = f->length;
+      f->state = (f->length > 0) ? FRAME_LENGTH : FRAME_DONE;
+    }
+    else {
+      /* Delimited by the server closing the connection */
+      f->keep_alive = 0;
+      f->state = FRAME_UNTIL_CLOSE;
+    }
+    break;
+  case FRAME_CHUNK_SIZE:
+    f->remaining = strtol(line, NULL, 16);
+    f->state = (f->remaining > 0) ? FRAME_CHUNK_DATA : FRAME_TRAILER;
+    break;
+  case FRAME_CHUNK_END:
+    f->state = FRAME_CHUNK_SIZE;
+    break;
+  case FRAME_TRAILER:
+    if(line[0] == '\0')
+      f->state = FRAME_DONE;
+    break;
+  }
+}
+
+/*
+ * frame_delimited: Returns 1 if the framed response marks its own end, so
+ *                  the connection it was sent on can carry another one, or
+ *                  0 if it ends only when the connection is closed.
+ */
+int frame_delimited(framing *f) {
+  if(f->state == FRAME_HEADERS || f->state == FRAME_UNTIL_CLOSE)
+    return 0;
+  return (f->status == 204 || f->status == 304 ||
+          f->chunked || f->length >= 0);
+}
+
+/*
+ * frame_scan: Follows the next len bytes of the response in buf. Returns
+ *             how many of them belong to the response, which is less than
+ *             len only if it ends within buf.
+ */
+int frame_scan(framing *f, char *buf, int len) {
+  int i = 0;
+
+  while(i < len && f->state != FRAME_DONE) {
+    switch(f->state) {
+    case FRAME_LENGTH:
+    case FRAME_CHUNK_DATA: {
+      long n = len - i;
+      if(n > f->remaining)
+        n = f->remaining;
+      i += n;
+      f->remaining -= n;
+      if(f->remaining == 0)
+        f->state = (f->state == FRAME_LENGTH) ? FRAME_DONE : FRAME_CHUNK_END;
+      break;
+    }
+    case FRAME_UNTIL_CLOSE:
+      i = len;
+      break;
+    default: {
+      /* Line oriented parts, where only the start of long lines matters */
+      char c = buf[i++];
+      if(c != '\n') {
+        if(f->line_len < FRAME_LINE - 1)
+          f->line[f->line_len++] = c;
+        break;
+      }
+      if(f->line_len > 0 && f->line[f->line_len - 1] == '\r')
+        f->line_len--;
+      f->line[f->line_len] = '\0';
+      f->line_len = 0;
+      frame_line(f, f->line);
+      break;
+    }
+    }
+  }
+  return i;
+}
+
+/*
+ * http_date: Parses an HTTP-date. Returns the time, or 0 if it is not a
+ *            valid date.
+ */
+static time_t http_date(char *value) {
+  struct tm tm;
+
+  memset(&tm, 0, sizeof(tm));
+  while(*value == ' ' || *value == '\t')
+    value++;
+  if(strptime(value, "%a, %d %b %Y %H:%M:%S GMT", &tm) == NULL)
+    return 0;
+  return timegm(&tm);
+}
+
+/*
+ * header_value: Copies the value of a header line, without the leading
+ *               whitespace and line terminator, into value of size n.
+ */
+static void header_value(char *line, char *value, int n) {
+  char *colon = strchr(line, ':');
+  int len = 0;
+
+  value[0] = '\0';
+  if(colon == NULL)
+    return;
+  for(line = colon + 1; *line == ' ' || *line == '\t'; line++)
+    ;
+  while(line[len] != '\0' && line[len] != '\r' && line[len] != '\n')
+    len++;
+  if(len >= n)
+    len = n - 1;
+  memcpy(value, line, len);
+  value[len] = '\0';
+}
+
+/*
+ * cache_control: Applies the directives of a Cache-Control header value.
+ */
+static void cache_control(char *value, freshness *fp, int *s_maxage) {
+  char *dir, *save;
+  long secs;
+
+  for(dir = strtok_r(value, ",", &save); dir != NULL;
+      dir = strtok_r(NULL, ",", &save)) {
+    while(*dir == ' ' || *dir == '\t')
+      dir++;
+    if(!strncasecmp(dir, "no-store", 8) || !strncasecmp(dir, "private", 7))
+      fp->no_store = 1;
+    else if(!strncasecmp(dir, "no-cache", 8))
+      fp->no_cache = 1;
+    else if(!strncasecmp(dir, "s-maxage=", 9)) {
+      secs = strtol(dir + 9, NULL, 10);
+      fp->max_age = (secs > 0) ? secs : 0;
+      *s_maxage = 1;
+    }
+    else if(!strncasecmp(dir, "max-age=", 8) && !*s_maxage) {
+      secs = strtol(dir + 8, NULL, 10);
+      fp->max_age = (secs > 0) ? secs : 0;
+    }
+  }
+}
+
+/*
+ * fresh_parse: Reads the caching information from the headers of the
+ *              response whose first len bytes are in buf.
+ */
+void fresh_parse(char *buf, int len, freshness *fp) {
+  char line[MAXLINE], value[MAXLINE];
+  char *p = buf, *end = buf + len, *eol;
+  int s_maxage = 0;
+  int n;
+
+  memset(fp, 0, sizeof(freshness));
+  fp->max_age = -1;
+
+  for(; p < end; p = eol + 1) {
+    if((eol = memchr(p, '\n', end - p)) == NULL)
+      break;
+    n = eol - p;
+    if(n >= MAXLINE)
+      n = MAXLINE - 1;
+    memcpy(line, p, n);
+    line[n] = '\0';
+    if(n > 0 && line[n - 1] == '\r')
+      line[--n] = '\0';
+
+    if(fp->status == 0) {
+      if(sscanf(line, "HTTP/%*d.%*d %d", &fp->status) != 1)
+        break;
+      continue;
+    }
+    if(n == 0)
+      break;
+
+    header_value(line, value, sizeof(value));
+    if(!strncasecmp(line, "Cache-Control:", 14))
+      cache_control(value, fp, &s_maxage);
+    else if(!strncasecmp(line, "Pragma:", 7) && strcasestr(value, "no-cache"))
+      fp->no_cache = 1;
+    else if(!strncasecmp(line, "Expires:", 8))
+      fp->expires = (http_date(value) > 0) ? http_date(value) : 1;
+    else if(!strncasecmp(line, "Date:", 5))
+      fp->date = http_date(value);
+    else if(!strncasecmp(line, "Age:", 4))
+      fp->age = strtol(value, NULL, 10);
+    else if(!strncasecmp(line, "Last-Modified:", 14)) {
+      fp->modified = http_date(value);
+      header_value(line, fp->last_modified, VALIDATOR_LEN);
+    }
+    else if(!strncasecmp(line, "ETag:", 5))
+      header_value(line, fp->etag, VALIDATOR_LEN);
+    else if(!strncasecmp(line, "Vary:", 5) && strchr(value, '*'))
+      fp->no_store = 1;
+  }
+}
+
+/*
+ * fresh_storable: Returns 1 if a shared cache may store the response, or
+ *                 0 otherwise. Only statuses that RFC 9110 makes
+ *                 cacheable by default are stored.
+ */
+int fresh_storable(freshness *fp) {
+  if(fp->no_store)
+    return 0;
+  switch(fp->status) {
+  case 200: case 203: case 204: case 300: case 301: case 308:
+  case 404: case 405: case 410: case 414: case 501:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+/*
+ * fresh_until: Returns the time until which the response, received at
+ *              now, stays fresh.
+ */
+time_t fresh_until(freshness *fp, time_t now) {
+  time_t date = (fp->date > 0) ? fp->date : now;
+  long lifetime;
+
+  if(fp->no_cache)
+    return now;
+  if(fp->max_age >= 0)
+    lifetime = fp->max_age;
+  else if(fp->expires > 0)
+    lifetime = (fp->expires > date) ? fp->expires - date : 0;
+  else if(fp->modified > 0 && fp->modified < date) {
+    lifetime = (date - fp->modified) / FRESH_HEURISTIC_DIV;
+    if(lifetime > FRESH_HEURISTIC_MAX)
+      lifetime = FRESH_HEURISTIC_MAX;
+  }
+  else
+    lifetime = FRESH_DEFAULT;
+
+  lifetime -= fp->age;
+  return (lifetime > 0) ? now + lifetime : now;
+}
@@ -0,0 +1,101 @@
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+#include "csapp.h"
+
+/* States of a response being framed */
+#define FRAME_HEADERS 0
+#define FRAME_LENGTH 1
+#define FRAME_CHUNK_SIZE 2
+#define FRAME_CHUNK_DATA 3
+#define FRAME_CHUNK_END 4
+#define FRAME_TRAILER 5
+#define FRAME_UNTIL_CLOSE 6
+#define FRAME_DONE 7
+
+/* Longest header line prefix kept while framing */
+#define FRAME_LINE 256
+
+/* Seconds a response without explicit freshness information stays fresh */
+#define FRESH_DEFAULT 60
+
+/* Fraction of its age a response with only Last-Modified stays fresh */
+#define FRESH_HEURISTIC_DIV 10
+
+/* Upper bound on heuristic freshness, in seconds */
+#define FRESH_HEURISTIC_MAX 86400
+
+/* Longest validator kept for revalidation */
+#define VALIDATOR_LEN 256
+
+/* What the proxy does with a request header, by its name */
+#define HDR_OTHER 0         /* Forwarded as is */
+#define HDR_HOST 1          /* Forwarded, and the proxy adds no Host */
+#define HDR_REPLACED 2      /* Dropped, since the proxy sends its own */
+#define HDR_CONNECTION 3    /* Dropped, and may ask to close the client */
+
+/* Slots in the perfect hash table of the header names the proxy handles
+   (a power of two) */
+#define HEADER_SLOTS 16
+
+/* Room left at the end of the forwarded headers for the proxy's own */
+#define PROXYHDRS_LEN 320
+
+/* Caching information from the headers of a response */
+typedef struct {
+  int status;       /* Status code, or 0 if the status line is missing */
+  int no_store;     /* Must not be stored by a shared cache */
+  int no_cache;     /* Must be revalidated before every use */
+  long max_age;     /* s-maxage or max-age in seconds, or -1 */
+  long age;         /* Age header in seconds */
+  time_t date;      /* Date header, or 0 */
+  time_t expires;   /* Expires header, 1 if invalid, or 0 if absent */
+  time_t modified;  /* Last-Modified header, or 0 */
+  char etag[VALIDATOR_LEN];           /* ETag, or "" */
+  char last_modified[VALIDATOR_LEN];  /* Last-Modified as sent, or "" */
+} freshness;
+
+/* A header line, split in place without copying */
+typedef struct {
+  char *name;       /* Name, or the whole line if it has no colon */
+  int name_len;     /* Bytes of the name, or 0 if the line has no colon */
+  char *value;      /* Value without surrounding whitespace */
+  int value_len;
+  int line_len;     /* Bytes of the line, with its line terminator */
+} http_header;
+
+/* Tracks where a response on a persistent connection ends */
+typedef struct {
+  int state;        /* One of the FRAME_ states */
+  long remaining;   /* Bytes left in the body or current chunk */
+  long length;      /* Content-Length, or -1 if not given */
+  int status;       /* Status code, or 0 before the status line */
+  int chunked;      /* Whether the body is chunked */
+  int keep_alive;   /* Whether the server keeps the connection open */
+  int line_len;     /* Bytes of the current line in line */
+  char line[FRAME_LINE];
+} framing;
+
+int read_request(rio_t *rio, char *request, char *uri, int *keep_alive);
+int parse_request_line(char *line, int len, char *uri, int *keep_alive);
+int parse_request(char *buf, char *request, char *host, char *req_port,
+                  char **server_req);
+void read_uri(char *uri, char *host, char *port, char *remain);
+int cat_requesthdrs(rio_t *rio, char *req_headers, char *host, char *port,
+                    int http11, int *keep_alive);
+int split_header(char *line, char *end, http_header *h);
+int header_kind(char *name, int len);
+void cat_proxyhdrs(char *req_headers, int keep_alive);
+void remove_newline(char *header);
+void clienterror(int fd, char *cause, char *errnum,
+		 char *shortmsg, char *longmsg);
+void send_status(int fd, int status);
+long response_length(char *buf, int len);
+void frame_init(framing *f);
+int frame_scan(framing *f, char *buf, int len);
+int frame_delimited(framing *f);
+void fresh_parse(char *buf, int len, freshness *fp);
+int fresh_storable(freshness *fp);
+time_t fresh_until(freshness *fp, time_t now);
+
+#endif /* __HTTP_H__ */
@@ -0,0 +1,160 @@
+/*
+ * idle.c
+ *
+ * Derek Tzeng
+ * dtzeng
+ *
+ * Idle keep-alive client connections in the thread engine.
+ *
+ * A client that keeps its connection open may wait seconds before sending
+ * its next request, and a worker thread waiting with it serves no one
+ * else meanwhile. Instead, once a worker has no request left to read, it
+ * parks the connection here and moves on. A single thread waits on all
+ * parked connections with epoll, and hands each one that becomes readable
+ * back to the workers through the shared buffer of connections.
+ *
+ * Parked connections are kept in the order they were parked, so those
+ * idle for CLIENT_IDLE_TIMEOUT seconds are found at the front and closed.
+ * At most IDLE_MAX_CONNS connections are parked at once; past that, a
+ * connection is closed instead of being parked. Only the idle thread
+ * unlinks and frees parked connections, so the pointer in each epoll
+ * event stays valid until the event is handled.
+ *
+ */
+
+#include "idle.h"
+#include <sys/epoll.h>
+
+typedef struct parked parked;
+
+/* A parked client connection */
+struct parked {
+  int fd;
+  time_t since;
+  parked *prev;
+  parked *next;
+};
+
+static sbuf_t *ready;
+static int epfd;
+static parked *oldest = NULL;
+static parked *newest = NULL;
+static int num_parked = 0;
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *idler(void *vargp);
+static void unlink_parked(parked *p);
+static void sweep(time_t now);
+
+/*
+ * idle_init: Starts the thread that waits on parked connections and
+ *            inserts readable ones into sp.
+ */
+void idle_init(sbuf_t *sp) {
+  pthread_t tid;
+
+  ready = sp;
+  if((epfd = epoll_create1(0)) < 0)
+    unix_error("epoll_create1 error");
+  Pthread_create(&tid, NULL, idler, NULL);
+}
+
+/*
+ * idle_park: Waits for the next request on connfd without a worker
+ *            thread, or closes it if too many connections are parked.
+ */
+void idle_park(int connfd) {
+  struct epoll_event ev;
+  parked *p = NULL;
+
+  pthread_mutex_lock(&idle_lock);
+  if(num_parked < IDLE_MAX_CONNS) {
+    p = Malloc(sizeof(parked));
+    p->fd = connfd;
+    p->since = time(NULL);
+    p->prev = newest;
+    p->next = NULL;
+    if(newest != NULL)
+      newest->next = p;
+    else
+      oldest = p;
+    newest = p;
+    num_parked++;
+
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.ptr = p;
+    if(epoll_ctl(epfd, EPOLL_CTL_ADD, connfd, &ev) < 0) {
+      unlink_parked(p);
+      Free(p);
+      p = NULL;
+    }
+  }
+  pthread_mutex_unlock(&idle_lock);
+
+  if(p == NULL)
+    close(connfd);
+}
+
+/*
+ * idler: Thread routine that hands readable parked connections back to
+ *        the workers, and closes those idle for too long.
+ */
+static void *idler(void *vargp) {
+  struct epoll_event events[IDLE_EVENTS];
+  int i, n;
+
+  Pthread_detach(pthread_self());
+  while(1) {
+    if((n = epoll_wait(epfd, events, IDLE_EVENTS, 1000)) < 0) {
+      if(errno != EINTR)
+        unix_error("epoll_wait error");
+      n = 0;
+    }
+    for(i = 0; i < n; i++) {
+      parked *p = events[i].data.ptr;
+      int fd = p->fd;
+
+      pthread_mutex_lock(&idle_lock);
+      unlink_parked(p);
+      pthread_mutex_unlock(&idle_lock);
+      epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+      Free(p);
+      sbuf_insert(ready, fd);
+    }
+    sweep(time(NULL));
+  }
+  return NULL;
+}
+
+/*
+ * unlink_parked: Removes p from the parked connections. The caller holds
+ *                idle_lock.
+ */
+static void unlink_parked(parked *p) {
+  if(p->prev != NULL)
+    p->prev->next = p->next;
+  else
+    oldest = p->next;
+  if(p->next != NULL)
+    p->next->prev = p->prev;
+  else
+    newest = p->prev;
+  num_parked--;
+}
+
+/*
+ * sweep: Closes the connections parked for CLIENT_IDLE_TIMEOUT seconds
+ *        or more.
+ */
+static void sweep(time_t now) {
+  parked *p;
+
+  pthread_mutex_lock(&idle_lock);
+  while((p = oldest) != NULL && now - p->since >= CLIENT_IDLE_TIMEOUT) {
+    unlink_parked(p);
+    epoll_ctl(epfd, EPOLL_CTL_DEL, p->fd, NULL);
+    close(p->fd);
+    Free(p);
+  }
+  pthread_mutex_unlock(&idle_lock);
+}
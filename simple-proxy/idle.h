@@ -0,0 +1,19 @@
+#ifndef __IDLE_H__
+#define __IDLE_H__
+
+#include "csapp.h"
+#include "sbuf.h"
+
+/* Seconds a client connection may sit idle between requests */
+#define CLIENT_IDLE_TIMEOUT 5
+
+/* Maximum number of idle client connections kept open */
+#define IDLE_MAX_CONNS 4096
+
+/* Readiness events handled per wait */
+#define IDLE_EVENTS 64
+
+void idle_init(sbuf_t *sp);
+void idle_park(int connfd);
+
+#endif /* __IDLE_H__ */
@@ -0,0 +1,327 @@
+/*
+ * inflight.c
+ *
+ * Derek Tzeng
+ * dtzeng
+ *
+ * Request collapsing for cache misses.
+ *
+ * When a popular object is not cached, every concurrent request for it
+ * would otherwise open its own connection to the origin. Instead, misses
+ * join a fetch in the in-flight table, a chained hash table keyed like the
+ * cache by the request and its FNV-1a hash. The first miss for a request
+ * becomes the leader, which fetches the response and reads it into the
+ * fetch's segbuf. Later misses attach as followers and stream the bytes to
+ * their own clients as the leader publishes them.
+ *
+ * The leader publishes each chunk under the fetch's mutex and wakes the
+ * followers with its condition variable. Followers only send up to the
+ * size they read under the mutex (see seg_iov), so they never touch the
+ * part of the chain that is still being filled.
+ *
+ * Once the response is complete, the leader hands the fetch the new cache
+ * object, if any, which pins it so followers can finish sending even if
+ * the cache evicts it. If the leader fails, or the response turns out to
+ * be uncacheable before any of it was published, the fetch is abandoned:
+ * followers that have not sent anything fall back to fetching the
+ * response themselves, and new misses no longer join it. A response that
+ * outgrows the maximum object size after followers have started sending
+ * it is still read into the body for them, and only abandoned once no
+ * followers are left. Meanwhile the body is drained: segments every
+ * follower has sent are dropped, except the first, which holds the
+ * headers, and the leader waits for the slowest follower rather than
+ * buffering more than the maximum object size. A drained fetch takes no
+ * new followers, since the start of the body is gone. A fetch is unlinked
+ * and freed once its last user leaves.
+ *
+ */
+
+#include "inflight.h"
+
+static fetch *table[INFLIGHT_BUCKETS];
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void drop_sent(fetch *F);
+static int behind(fetch *F);
+static void unfollow(fetch *F, follower *me);
+
+/*
+ * inflight_join: Joins the running or completed fetch for request, or
+ *                starts a new one if there is none. Sets leader to 1 if
+ *                the caller must perform the fetch, or 0 if it follows.
+ */
+fetch *inflight_join(char *request, int *leader) {
+  uint64_t hash = cache_hash(request);
+  fetch **bucket = &table[hash % INFLIGHT_BUCKETS];
+  fetch *F;
+
+  pthread_mutex_lock(&table_lock);
+  for(F = *bucket; F != NULL; F = F->chain) {
+    if(F->hash == hash && !strcmp(F->request, request)) {
+      pthread_mutex_lock(&F->lock);
+      int state = F->state;
+      int dropped = F->dropped;
+      pthread_mutex_unlock(&F->lock);
+      if(state != FETCH_ABANDONED && dropped == 0)
+        break;
+    }
+  }
+  if(F != NULL) {
+    F->refcount++;
+    *leader = 0;
+  }
+  else {
+    F = Malloc(sizeof(fetch));
+    F->request = Malloc(strlen(request) + 1);
+    strcpy(F->request, request);
+    F->hash = hash;
+    segbuf_init(&F->body);
+    F->dropped = 0;
+    F->followers = NULL;
+    F->obj = NULL;
+    F->state = FETCH_RUNNING;
+    F->refcount = 1;
+    pthread_mutex_init(&F->lock, NULL);
+    pthread_cond_init(&F->cond, NULL);
+    F->chain = *bucket;
+    *bucket = F;
+    *leader = 1;
+  }
+  pthread_mutex_unlock(&table_lock);
+  return F;
+}
+
+/*
+ * inflight_space: Returns the free space at the end of the fetch's body
+ *                 for the leader to read into. See segbuf_space.
+ */
+char *inflight_space(fetch *F, int *room) {
+  char *space;
+
+  pthread_mutex_lock(&F->lock);
+  space = segbuf_space(&F->body, room);
+  pthread_mutex_unlock(&F->lock);
+  return space;
+}
+
+/*
+ * inflight_publish: Adds n bytes read into the space returned by
+ *                   inflight_space to the body and wakes the followers.
+ */
+void inflight_publish(fetch *F, int n) {
+  pthread_mutex_lock(&F->lock);
+  segbuf_commit(&F->body, n);
+  pthread_cond_broadcast(&F->cond);
+  pthread_mutex_unlock(&F->lock);
+}
+
+/*
+ * inflight_drain: Drops the segments of the body that every follower has
+ *                 sent, for a response that will not be cached. While more
+ *                 than max_size bytes are still buffered, waits for the
+ *                 slowest follower to catch up.
+ */
+void inflight_drain(fetch *F, int max_size) {
+  pthread_mutex_lock(&F->lock);
+  drop_sent(F);
+  while(F->body.size > max_size && behind(F)) {
+    pthread_cond_wait(&F->cond, &F->lock);
+    drop_sent(F);
+  }
+  pthread_mutex_unlock(&F->lock);
+}
+
+/*
+ * inflight_complete: Ends the fetch with its body complete and wakes the
+ *                    followers. obj is the cache object made from the body,
+ *                    which the fetch pins, or NULL if it was not cached.
+ */
+void inflight_complete(fetch *F, object *obj) {
+  pthread_mutex_lock(&F->lock);
+  if(obj != NULL) {
+    __atomic_add_fetch(&obj->refcount, 1, __ATOMIC_RELAXED);
+    F->obj = obj;
+  }
+  F->state = FETCH_DONE;
+  pthread_cond_broadcast(&F->cond);
+  pthread_mutex_unlock(&F->lock);
+}
+
+/*
+ * inflight_abandon: Ends the fetch without completing its body and wakes
+ *                   the followers.
+ */
+void inflight_abandon(fetch *F) {
+  pthread_mutex_lock(&F->lock);
+  F->state = FETCH_ABANDONED;
+  pthread_cond_broadcast(&F->cond);
+  pthread_mutex_unlock(&F->lock);
+}
+
+/*
+ * inflight_detach: Abandons the fetch if nothing has been published yet or
+ *                  no followers are attached, so the leader can stop filling
+ *                  the body. Returns 0 if abandoned, -1 if followers still
+ *                  depend on it.
+ */
+int inflight_detach(fetch *F) {
+  int rc = -1;
+
+  /* Holding the table lock keeps new followers out while deciding */
+  pthread_mutex_lock(&table_lock);
+  if(F->refcount == 1 || F->body.size == 0) {
+    inflight_abandon(F);
+    rc = 0;
+  }
+  pthread_mutex_unlock(&table_lock);
+  return rc;
+}
+
+/*
+ * inflight_follow: Streams the fetch's body to fd as it is published.
+ *                  Returns FOLLOW_DONE once all of it has been sent,
+ *                  FOLLOW_RETRY if the fetch was abandoned before anything
+ *                  was sent, or FOLLOW_ERROR if it was abandoned later or
+ *                  writing to fd fails.
+ */
+int inflight_follow(fetch *F, int fd) {
+  follower me;
+  int sent = 0;
+
+  /* Once the body has been drained, its start can no longer be sent */
+  pthread_mutex_lock(&F->lock);
+  if(F->dropped > 0) {
+    pthread_mutex_unlock(&F->lock);
+    return FOLLOW_RETRY;
+  }
+  me.sent = 0;
+  me.next = F->followers;
+  F->followers = &me;
+
+  while(1) {
+    while(F->dropped + F->body.size == sent && F->state == FETCH_RUNNING) {
+      pthread_cond_wait(&F->cond, &F->lock);
+    }
+    int size = F->dropped + F->body.size;
+    int state = F->state;
+
+    /*
+     * Find where to resume while holding the lock. Segments before it may
+     * be dropped meanwhile, but it and those after it are kept until this
+     * follower reports having sent them.
+     */
+    segment *seg = F->body.head;
+    int skip = sent - F->dropped;
+    while(seg != NULL && skip >= seg->len) {
+      skip -= seg->len;
+      seg = seg->next;
+    }
+    pthread_mutex_unlock(&F->lock);
+
+    if(state == FETCH_ABANDONED) {
+      unfollow(F, &me);
+      return (sent == 0) ? FOLLOW_RETRY : FOLLOW_ERROR;
+    }
+    if(state == FETCH_DONE && size == sent) {
+      unfollow(F, &me);
+      return FOLLOW_DONE;
+    }
+
+    while(sent < size) {
+      ssize_t rc = seg_write(fd, seg, skip, skip + size - sent);
+      if(rc < 0) {
+        unfollow(F, &me);
+        return FOLLOW_ERROR;
+      }
+      skip += rc;
+      sent += rc;
+    }
+    pthread_mutex_lock(&F->lock);
+    me.sent = sent;
+    pthread_cond_broadcast(&F->cond);
+  }
+}
+
+/*
+ * inflight_leave: Drops the caller's reference to the fetch, and unlinks
+ *                 and frees it once the last one is gone.
+ */
+void inflight_leave(fetch *F) {
+  fetch **p;
+
+  pthread_mutex_lock(&table_lock);
+  if(--F->refcount > 0) {
+    pthread_mutex_unlock(&table_lock);
+    return;
+  }
+  for(p = &table[F->hash % INFLIGHT_BUCKETS]; *p != F; p = &(*p)->chain)
+    ;
+  *p = F->chain;
+  pthread_mutex_unlock(&table_lock);
+
+  /* The body belongs to the cache object if it was cached */
+  if(F->obj != NULL)
+    release_object(F->obj);
+  else
+    segbuf_free(&F->body);
+  pthread_mutex_destroy(&F->lock);
+  pthread_cond_destroy(&F->cond);
+  free(F->request);
+  free(F);
+}
+
+/*
+ * drop_sent: Drops the segments after the first that every follower has
+ *            sent, keeping the last, which the leader is filling. The
+ *            fetch's lock must be held.
+ */
+static void drop_sent(fetch *F) {
+  segment *head = F->body.head;
+  segment *seg;
+  follower *f;
+  int min_sent = F->dropped + F->body.size;
+
+  for(f = F->followers; f != NULL; f = f->next) {
+    if(f->sent < min_sent)
+      min_sent = f->sent;
+  }
+  if(head == NULL)
+    return;
+  while((seg = head->next) != NULL && seg != F->body.tail &&
+        F->dropped + head->len + seg->len <= min_sent) {
+    head->next = seg->next;
+    F->dropped += seg->len;
+    F->body.size -= seg->len;
+    seg->next = NULL;
+    seg_put(seg);
+  }
+}
+
+/*
+ * behind: Returns 1 if a follower has not sent all of the body yet, or 0
+ *         otherwise. The fetch's lock must be held.
+ */
+static int behind(fetch *F) {
+  follower *f;
+
+  for(f = F->followers; f != NULL; f = f->next) {
+    if(f->sent < F->dropped + F->body.size)
+      return 1;
+  }
+  return 0;
+}
+
+/*
+ * unfollow: Removes the follower from the fetch, waking a leader that may
+ *           be waiting for it.
+ */
+static void unfollow(fetch *F, follower *me) {
+  follower **p;
+
+  pthread_mutex_lock(&F->lock);
+  for(p = &F->followers; *p != me; p = &(*p)->next)
+    ;
+  *p = me->next;
+  pthread_cond_broadcast(&F->cond);
+  pthread_mutex_unlock(&F->lock);
+}
@@ -0,0 +1,54 @@
+#ifndef __INFLIGHT_H__
+#define __INFLIGHT_H__
+
+#include "csapp.h"
+#include "cache.h"
+
+/* Number of buckets in the in-flight table */
+#define INFLIGHT_BUCKETS 256
+
+/* States of a fetch */
+#define FETCH_RUNNING 0
+#define FETCH_DONE 1
+#define FETCH_ABANDONED 2
+
+/* Results of following a fetch */
+#define FOLLOW_DONE 0
+#define FOLLOW_RETRY 1
+#define FOLLOW_ERROR -1
+
+typedef struct fetch fetch;
+typedef struct follower follower;
+
+/* A follower streaming a fetch's body, and how much of it it has sent */
+struct follower {
+  int sent;
+  follower *next;
+};
+
+/* An origin fetch that concurrent misses for the same request share */
+struct fetch {
+  char *request;
+  uint64_t hash;
+  segbuf body;
+  int dropped;          /* Bytes dropped from the body after its head */
+  follower *followers;
+  object *obj;
+  int state;
+  int refcount;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  fetch *chain;
+};
+
+fetch *inflight_join(char *request, int *leader);
+char *inflight_space(fetch *F, int *room);
+void inflight_publish(fetch *F, int n);
+void inflight_drain(fetch *F, int max_size);
+void inflight_complete(fetch *F, object *obj);
+void inflight_abandon(fetch *F);
+int inflight_detach(fetch *F);
+int inflight_follow(fetch *F, int fd);
+void inflight_leave(fetch *F);
+
+#endif /* __INFLIGHT_H__ */
@@ -1,41 +1,123 @@
 #include "open_clientfd_r.h"
 
 /*
- * open_clientfd_r - thread-safe version of open_clientfd
+ * now_ms - milliseconds on the monotonic clock
  */
-int open_clientfd_r(char *hostname, char *port) {
-    int clientfd;
-    struct addrinfo *addlist, *p;
-    int rv;
+static long now_ms(void) {
+    struct timespec ts;
 
-    /* Create the socket descriptor */
-    if ((clientfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        return -1;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+/*
+ * interleave - orders the addresses for connecting, alternating between
+ * address families starting with the family of the first one
+ */
+static void interleave(dns_addrs *addrs, int *order) {
+    int used[DNS_MAX_ADDRS] = {0};
+    int family = addrs->addr[0].family;
+    int n, i;
+
+    for (n = 0; n < addrs->num; n++) {
+        /* Take the next unused address of the wanted family, if any */
+        for (i = 0; i < addrs->num; i++) {
+            if (!used[i] && addrs->addr[i].family == family)
+                break;
+        }
+        if (i == addrs->num) {
+            for (i = 0; used[i]; i++)
+                ;
+        }
+        used[i] = 1;
+        order[n] = i;
+        family = (addrs->addr[i].family == AF_INET6) ? AF_INET : AF_INET6;
     }
+}
 
-    /* Get a list of addrinfo structs */
-    if ((rv = getaddrinfo(hostname, port, NULL, &addlist)) != 0) {
+/*
+ * open_clientfd_r - thread-safe version of open_clientfd, which resolves
+ * the server through the DNS cache (see "dns.c") and connects in the
+ * manner of Happy Eyeballs (RFC 8305): non-blocking connects to the IPv4
+ * and IPv6 addresses, alternating between families, are started
+ * CONNECT_STAGGER ms apart, or as soon as the previous attempts have all
+ * failed. The first socket to connect wins, the others are closed, and
+ * all are given up after CONNECT_TIMEOUT ms.
+ */
+int open_clientfd_r(char *hostname, char *port) {
+    dns_addrs addrs;
+    int order[DNS_MAX_ADDRS];
+    struct pollfd fds[DNS_MAX_ADDRS];
+    int started = 0, active = 0, clientfd = -1;
+    long now, next_start, deadline;
+    int i;
+
+    /* Get the server's addresses */
+    if (dns_lookup(hostname, port, &addrs) < 0) {
         return -1;
     }
+    interleave(&addrs, order);
+
+    now = next_start = now_ms();
+    deadline = now + CONNECT_TIMEOUT;
+    while (clientfd < 0) {
+        now = now_ms();
+
+        /* Start the next attempt when its turn comes */
+        if (started < addrs.num && (now >= next_start || active == 0)) {
+            dns_addr *p = &addrs.addr[order[started++]];
+            int fd = socket(p->family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+            next_start = now + CONNECT_STAGGER;
+            if (fd < 0)
+                continue;
+            if (connect(fd, (SA *)&p->addr, p->len) == 0) {
+                clientfd = fd; /* success */
+                break;
+            }
+            if (errno != EINPROGRESS) {
+                close(fd);
+                next_start = now;
+                continue;
+            }
+            fds[active].fd = fd;
+            fds[active].events = POLLOUT;
+            active++;
+            continue;
+        }
+        if (active == 0 || now >= deadline)
+            break; /* all connects failed or timed out */
 
-    /* Walk the list, using each addrinfo to try to connect */
-    for (p = addlist; p; p = p->ai_next) {
-        if ((p->ai_family == AF_INET)) {
-            if (connect(clientfd, p->ai_addr, p->ai_addrlen) == 0) {
-                break; /* success */
+        /* Wait for an attempt to finish or the next one to start */
+        long timeout = deadline - now;
+        if (started < addrs.num && next_start - now < timeout)
+            timeout = next_start - now;
+        if (poll(fds, active, timeout) < 0 && errno != EINTR)
+            break;
+        for (i = 0; i < active && clientfd < 0; i++) {
+            int err = 0;
+            socklen_t len = sizeof(err);
+            if (fds[i].revents == 0)
+                continue;
+            if (getsockopt(fds[i].fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0
+                && err == 0) {
+                clientfd = fds[i].fd; /* success */
             }
+            else {
+                close(fds[i].fd);
+                next_start = now; /* start the next attempt right away */
+            }
+            fds[i--] = fds[--active];
         }
     }
 
-    /* Clean up */
-    freeaddrinfo(addlist);
-    if (!p) { /* all connects failed */
-        close(clientfd);
-        return -1;
+    /* Cancel the attempts that lost */
+    for (i = 0; i < active; i++) {
+        close(fds[i].fd);
     }
-    else { /* one of the connects succeeded */
-        return clientfd;
+    if (clientfd >= 0) {
+        fcntl(clientfd, F_SETFL, fcntl(clientfd, F_GETFL) & ~O_NONBLOCK);
     }
+    return clientfd;
 }
 
 int Open_clientfd_r(char *hostname, char *port) {
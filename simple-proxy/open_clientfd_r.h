@@ -1,7 +1,20 @@
+#ifndef __OPEN_CLIENTFD_R_H__
+#define __OPEN_CLIENTFD_R_H__
+
 #include "csapp.h"
+#include "dns.h"
+#include <poll.h>
+
+/* Milliseconds between staggered connection attempts */
+#define CONNECT_STAGGER 250
+
+/* Milliseconds before all connection attempts are given up */
+#define CONNECT_TIMEOUT 10000
 
 /* Thread safe open_clientfd */
 int open_clientfd_r(char *hostname, char *port);
 
 /* Wrapper for thread safe open_clientfd */
 int Open_clientfd_r(char *hostname, char *port);
+
+#endif /* __OPEN_CLIENTFD_R_H__ */
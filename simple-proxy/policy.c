@@ -0,0 +1,225 @@
+/*
+ * policy.c
+ *
+ * Derek Tzeng
+ * dtzeng
+ *
+ * Eviction policies of the cache.
+ *
+ * A policy decides which object a shard evicts next. The cache tells it
+ * about every insertion, removal, and hit, and asks it for a victim
+ * whenever it needs space. A victim may still be spared by admission, so
+ * picking one only settles pending hits, and whatever the policy
+ * remembers about evictions is recorded once the cache tells it the
+ * victim is really evicted. Hits hold no lock, so a policy can only count
+ * them with atomic operations, and must act on them lazily when it picks
+ * a victim under the shard's lock.
+ *
+ * The policies are:
+ *
+ *   lru     The cache's original policy, an LRU approximated by giving
+ *           referenced objects at the LRA end a second chance.
+ *   s3fifo  S3-FIFO, see "s3fifo.c".
+ *   arc     ARC, in its clock-based form, see "arc.c".
+ *   gdsf    GreedyDual-Size-Frequency, see "gdsf.c".
+ *
+ * This file also holds the queues and ghost lists shared by the policies.
+ * A ghost list remembers the hashes of recently evicted objects, so a
+ * policy can tell when an object comes back soon after being evicted.
+ *
+ */
+
+#include "policy.h"
+
+static policy *policies[] = {
+  &lru_policy, &s3fifo_policy, &arc_policy, &gdsf_policy, NULL
+};
+
+/*
+ * policy_find: Returns the policy with the given name, or NULL if there
+ *              is none.
+ */
+policy *policy_find(char *name) {
+  int i;
+
+  for(i = 0; policies[i] != NULL; i++) {
+    if(!strcmp(policies[i]->name, name))
+      return policies[i];
+  }
+  return NULL;
+}
+
+/*
+ * qlist_init: Initializes an empty queue.
+ */
+void qlist_init(qlist *q) {
+  q->head = NULL;
+  q->tail = NULL;
+  q->bytes = 0;
+  q->count = 0;
+}
+
+/*
+ * qlist_push: Adds the object at the head of the queue.
+ */
+void qlist_push(qlist *q, object *obj) {
+  obj->qprev = NULL;
+  obj->qnext = q->head;
+  if(q->head != NULL)
+    q->head->qprev = obj;
+  else
+    q->tail = obj;
+  q->head = obj;
+  q->bytes += obj->charge;
+  q->count++;
+}
+
+/*
+ * qlist_remove: Unlinks the object from the queue.
+ */
+void qlist_remove(qlist *q, object *obj) {
+  if(obj->qprev != NULL)
+    obj->qprev->qnext = obj->qnext;
+  else
+    q->head = obj->qnext;
+  if(obj->qnext != NULL)
+    obj->qnext->qprev = obj->qprev;
+  else
+    q->tail = obj->qprev;
+  obj->qprev = NULL;
+  obj->qnext = NULL;
+  q->bytes -= obj->charge;
+  q->count--;
+}
+
+/*
+ * ghost_new: Allocates an empty ghost list remembering up to max_bytes
+ *            worth of objects, and returns it.
+ */
+ghost *ghost_new(long max_bytes) {
+  ghost *G = Calloc(1, sizeof(ghost));
+  G->max_bytes = max_bytes;
+  return G;
+}
+
+/*
+ * ghost_free: Frees the ghost list.
+ */
+void ghost_free(ghost *G) {
+  while(G->oldest != NULL)
+    ghost_drop_oldest(G);
+  free(G);
+}
+
+/*
+ * ghost_add: Remembers an evicted object, forgetting the oldest ones if
+ *            the list is full.
+ */
+void ghost_add(ghost *G, uint64_t hash, int size) {
+  ghost_entry *e = Malloc(sizeof(ghost_entry));
+  ghost_entry **bucket = &G->buckets[hash % GHOST_BUCKETS];
+
+  e->hash = hash;
+  e->size = size;
+  e->chain = *bucket;
+  *bucket = e;
+  e->older = G->newest;
+  e->newer = NULL;
+  if(G->newest != NULL)
+    G->newest->newer = e;
+  else
+    G->oldest = e;
+  G->newest = e;
+  G->bytes += size;
+
+  while(G->bytes > G->max_bytes && G->oldest != NULL)
+    ghost_drop_oldest(G);
+}
+
+/*
+ * ghost_take: Forgets the object with the given hash. Returns 1 if it was
+ *             remembered, or 0 otherwise.
+ */
+int ghost_take(ghost *G, uint64_t hash) {
+  ghost_entry **scan = &G->buckets[hash % GHOST_BUCKETS];
+  ghost_entry *e;
+
+  for(; (e = *scan) != NULL; scan = &e->chain) {
+    if(e->hash == hash) {
+      *scan = e->chain;
+      if(e->older != NULL)
+        e->older->newer = e->newer;
+      else
+        G->oldest = e->newer;
+      if(e->newer != NULL)
+        e->newer->older = e->older;
+      else
+        G->newest = e->older;
+      G->bytes -= e->size;
+      free(e);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * ghost_drop_oldest: Forgets the oldest object in the list.
+ */
+void ghost_drop_oldest(ghost *G) {
+  if(G->oldest != NULL)
+    ghost_take(G, G->oldest->hash);
+}
+
+/*
+ * lru_init, lru_destroy, lru_insert, lru_remove, lru_evicted: The LRU
+ * policy uses the shard's object list itself, so it keeps no state of its
+ * own.
+ */
+static void lru_init(shard *S) {
+  S->state = NULL;
+}
+
+static void lru_destroy(shard *S) {
+}
+
+static void lru_insert(shard *S, object *obj) {
+}
+
+static void lru_remove(shard *S, object *obj) {
+}
+
+static void lru_evicted(shard *S, object *obj) {
+}
+
+/*
+ * lru_victim: Returns the LRA object, first moving referenced LRA objects
+ *             back to the MRA end, at most once per object.
+ */
+static object *lru_victim(shard *S) {
+  int chances = S->num_objects;
+  object *victim = S->LRA;
+
+  while(chances > 0 &&
+        __atomic_load_n(&victim->referenced, __ATOMIC_RELAXED)) {
+    __atomic_store_n(&victim->referenced, 0, __ATOMIC_RELAXED);
+    move_to_MRA(S, victim);
+    victim = S->LRA;
+    chances--;
+  }
+  return victim;
+}
+
+/*
+ * lru_hit: Marks the object as referenced.
+ */
+static void lru_hit(object *obj) {
+  /* Only store when clear, so hot objects do not bounce cache lines */
+  if(!__atomic_load_n(&obj->referenced, __ATOMIC_RELAXED))
+    __atomic_store_n(&obj->referenced, 1, __ATOMIC_RELAXED);
+}
+
+policy lru_policy = {
+  "lru", lru_init, lru_destroy, lru_insert, lru_remove, lru_victim,
+  lru_evicted, lru_hit
+};
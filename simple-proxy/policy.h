@@ -0,0 +1,64 @@
+#ifndef __POLICY_H__
+#define __POLICY_H__
+
+#include "csapp.h"
+#include "cache.h"
+
+/* Share of an S3-FIFO shard's bytes given to its small queue, in percent */
+#define S3FIFO_SMALL_PERCENT 10
+
+/* Frequency at which S3-FIFO stops counting hits */
+#define S3FIFO_MAX_FREQ 3
+
+/* Number of buckets in a ghost list's hash table */
+#define GHOST_BUCKETS 1024
+
+/* Initial number of slots in a GDSF heap */
+#define GDSF_INIT_HEAP 256
+
+typedef struct ghost_entry ghost_entry;
+
+/* A queue of objects linked through qprev and qnext, newest at the head */
+typedef struct {
+  object *head;
+  object *tail;
+  long bytes;
+  int count;
+} qlist;
+
+/* A remembered evicted object */
+struct ghost_entry {
+  uint64_t hash;
+  int size;
+  ghost_entry *newer;
+  ghost_entry *older;
+  ghost_entry *chain;
+};
+
+/* Hashes of recently evicted objects, bounded by their total size */
+typedef struct {
+  ghost_entry *buckets[GHOST_BUCKETS];
+  ghost_entry *newest;
+  ghost_entry *oldest;
+  long bytes;
+  long max_bytes;
+} ghost;
+
+extern policy lru_policy;
+extern policy s3fifo_policy;
+extern policy arc_policy;
+extern policy gdsf_policy;
+
+policy *policy_find(char *name);
+
+void qlist_init(qlist *q);
+void qlist_push(qlist *q, object *obj);
+void qlist_remove(qlist *q, object *obj);
+
+ghost *ghost_new(long max_bytes);
+void ghost_free(ghost *G);
+void ghost_add(ghost *G, uint64_t hash, int size);
+int ghost_take(ghost *G, uint64_t hash);
+void ghost_drop_oldest(ghost *G);
+
+#endif /* __POLICY_H__ */
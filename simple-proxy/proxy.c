@@ -8,326 +8,834 @@
  * the server, and then forwards the response from the server back to the
  * client.
  *
- * Multiple concurrent connections are supported. The proxy will spawn a new
- * thread for each new connection with the Pthreads library.
+ * Multiple concurrent connections are supported. The proxy prethreads a
+ * fixed pool of worker threads with the Pthreads library (-t flag), and the
+ * main thread hands accepted connections to them through a bounded buffer
+ * (-q flag). When the buffer is full, the main thread waits for a free slot
+ * by default, or turns the connection away with a 503 if -r is given.
  *
- * This proxy also maintains a cache that caches most recently added web
- * objects. The cache will be restricted to a maximum size, and each object
- * will also be restricted to a maximum size, so no object will
- * unproportionally consume the cache.  For more cache implementation
- * information, see "cache.c".
+ * Alternatively, "-e epoll" selects an event-driven engine in which -t
+ * event loop threads multiplex non-blocking sockets with epoll, and
+ * "-e uring" selects an engine in which -t threads drive batched socket
+ * operations through io_uring. If the kernel lacks io_uring, the proxy
+ * falls back to the thread engine. For more information, see "event.c"
+ * and "uring.c".
  *
- * To keep the cache thread-safe, the proxy uses the read/write locking
- * primitives that are included in the Pthreads library.
+ * This proxy also maintains a cache that caches most recently accessed web
+ * objects. The cache will be restricted to a maximum size (-c flag), which
+ * covers the memory its objects take up along with their requests and
+ * bookkeeping, and each object will also be restricted to a maximum size
+ * (-m flag), so no object will unproportionally consume the cache. Both
+ * accept a K, M, or G suffix. The eviction policy can be chosen
+ * with the -p flag, and -a only admits new objects requested more often
+ * than those they would evict. For more cache implementation information, see
+ * "cache.c" and "policy.c".
+ *
+ * In the thread engine, server connections for HTTP/1.1 clients speak
+ * HTTP/1.1 and are kept open after a response, in a pool of idle
+ * connections per host and port, so repeated misses to the same server
+ * skip connecting. For more information, see "connpool.c". Requests from
+ * HTTP/1.0 clients go out as HTTP/1.0 on a connection closed afterwards,
+ * since responses are relayed and cached byte for byte, and must never
+ * reach those clients chunked. The request line, version and all, keys
+ * the cache, so each version only gets responses fetched for it. Client
+ * connections from HTTP/1.1 clients are kept open too, and their
+ * requests, which may be pipelined, are served in order until the client
+ * closes the connection or leaves it idle. Between requests, the
+ * connection waits on epoll rather than on a worker thread, and every
+ * read from the client times out. For more information, see "idle.c".
+ *
+ * Responses are cached only when HTTP allows it, and only for as long as
+ * their Cache-Control, Expires, or Last-Modified headers say they stay
+ * fresh. In the thread engine, a stale object with an ETag or
+ * Last-Modified date is revalidated with a conditional request, so a 304
+ * from the server freshens it without the body being sent again, and it
+ * is served as is if the server cannot be reached. The other engines
+ * fetch stale objects anew. For more information, see "http.c".
+ *
+ * With -W, stale objects are still served for that many seconds past
+ * their expiry while a small pool of threads refreshes them in the
+ * background, and with -k, the k objects hit most often are refreshed
+ * shortly before they go stale. For more information, see "refresh.c".
+ *
+ * Concurrent misses for the same request are collapsed into a single
+ * fetch from the server, whose response is streamed to every waiting
+ * client as it arrives. For more information, see "inflight.c".
+ *
+ * Server names are resolved through a cache of lookups, whose size can be
+ * set with the -d flag. Sending the proxy SIGUSR1 prints its hit, miss,
+ * and refresh counters. For more information, see "dns.c".
+ *
+ * With -D, objects evicted from the cache are demoted to a disk tier in
+ * a preallocated file of -z megabytes, which the thread engine serves
+ * hits from with sendfile. For more information, see "disk.c".
+ *
+ * With -w, the cache is saved to a snapshot file when the proxy receives
+ * SIGTERM, after which it exits, or SIGUSR2, and the next proxy started
+ * with the same file loads it in the background while it starts serving.
+ * For more information, see "snapshot.c".
+ *
+ * To keep the cache thread-safe, changes to each cache shard are
+ * serialized by a Pthreads mutex, while lookups take no lock and rely on
+ * epoch-based reclamation instead (see "epoch.c"). The number of shards
+ * can be set at startup with the -s flag.
  *
  */
 
-#include "csapp.h"
-#include "open_clientfd_r.h"
-#include "cache.h"
-
-/* Recommended max cache and object sizes */
-#define MAX_CACHE_SIZE 1049000
-#define MAX_OBJECT_SIZE 102400
-
-/* You won't lose style points for including these long lines in your code */
-static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
-static const char *accept_hdr = "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n";
-static const char *accept_encoding_hdr = "Accept-Encoding: gzip, deflate\r\n";
-static const char *connection_hdr = "Connection: close\r\n";
-static const char *proxy_connection_hdr = "Proxy-Connection: close\r\n";
-
-/* Global variables for caching and locking */
+#define _GNU_SOURCE /* for splice */
+#include "proxy.h"
+#include "sbuf.h"
+#include "event.h"
+#include "uring.h"
+#include "inflight.h"
+#include "connpool.h"
+#include "disk.h"
+#include "snapshot.h"
+#include "policy.h"
+#include "refresh.h"
+#include "idle.h"
+#include <poll.h>
+#include <limits.h>
+
+/* Default number of cache shards */
+#define DEFAULT_SHARDS 8
+
+/* Connection engines */
+#define ENGINE_THREAD 0
+#define ENGINE_EPOLL 1
+#define ENGINE_URING 2
+
+/* Bytes moved per splice call when relaying uncacheable responses */
+#define SPLICE_SIZE 65536
+
+/* Seconds a single read from a client may wait for data */
+#define CLIENT_READ_TIMEOUT 5
+
+/* Default number of worker threads and pending connection slots */
+#define DEFAULT_THREADS 16
+#define DEFAULT_QUEUE 256
+
+/* Global variables for caching */
 cache *proxy_cache;
-pthread_rwlock_t rwlock;
+int max_object_size = DEFAULT_OBJECT_SIZE;
+
+/* Shared buffer of accepted connections */
+sbuf_t conn_buf;
 
 /* Function declarations */
-void *new_request(void *vargp);
-void read_request(int fd, rio_t *rio, char *request, char *uri);
-char *read_uri(char *uri, char *host, char *remain);
-void cat_requesthdrs(rio_t *rio, char *req_headers);
-void remove_newline(char *header);
-void clienterror(int fd, char *cause, char *errnum,
-		 char *shortmsg, char *longmsg);
+void usage(char *prog);
+int64_t parse_size(char *str);
+void sigusr1_handler(int sig);
+void sigterm_handler(int sig);
+void sigusr2_handler(int sig);
+void *worker(void *vargp);
+void serve_client(int connfd);
+int new_request(int connfd, rio_t *rio_toclient);
+int send_object(int connfd, object *obj);
+int delimited(segment *seg, int size);
+int frame_ends(char *buf, int len);
+int send_request(char *host, char *req_port, char *remain,
+                 char *req_headers, int http11, int *reused);
+int splice_response(int serverfd, int connfd, long len);
 
 
 int main(int argc, char **argv) {
-  int port, listenfd, clientlen, *connfd;
+  int port, listenfd, clientlen, connfd;
   struct sockaddr_in clientaddr;
+  struct timeval read_timeout = { CLIENT_READ_TIMEOUT, 0 };
   pthread_t tid;
+  int shards = DEFAULT_SHARDS;
+  int threads = DEFAULT_THREADS;
+  int queue = DEFAULT_QUEUE;
+  int reject = 0;
+  int engine = ENGINE_THREAD;
+  int dns_entries = DNS_DEFAULT_ENTRIES;
+  char *disk_path = NULL;
+  char *snap_path = NULL;
+  policy *evict_policy = &lru_policy;
+  int admission = 0;
+  int stale_window = 0;
+  int top_k = 0;
+  int64_t cache_size = DEFAULT_CACHE_SIZE;
+  int64_t object_size = DEFAULT_OBJECT_SIZE;
+  long disk_mb = DISK_DEFAULT_MB;
+  int opt, i, n;
+
+  while((opt = getopt(argc, argv, "s:t:q:re:d:D:z:w:p:aW:k:c:m:")) != -1) {
+    switch(opt) {
+    case 'e':
+      if(!strcmp(optarg, "thread"))
+        engine = ENGINE_THREAD;
+      else if(!strcmp(optarg, "epoll"))
+        engine = ENGINE_EPOLL;
+      else if(!strcmp(optarg, "uring"))
+        engine = ENGINE_URING;
+      else
+        usage(argv[0]);
+      break;
+    case 's':
+      shards = atoi(optarg);
+      break;
+    case 't':
+      threads = atoi(optarg);
+      break;
+    case 'q':
+      queue = atoi(optarg);
+      break;
+    case 'r':
+      reject = 1;
+      break;
+    case 'd':
+      dns_entries = atoi(optarg);
+      break;
+    case 'D':
+      disk_path = optarg;
+      break;
+    case 'z':
+      disk_mb = atol(optarg);
+      break;
+    case 'w':
+      snap_path = optarg;
+      break;
+    case 'p':
+      if((evict_policy = policy_find(optarg)) == NULL)
+        usage(argv[0]);
+      break;
+    case 'a':
+      admission = 1;
+      break;
+    case 'W':
+      stale_window = atoi(optarg);
+      break;
+    case 'k':
+      top_k = atoi(optarg);
+      break;
+    case 'c':
+      cache_size = parse_size(optarg);
+      break;
+    case 'm':
+      object_size = parse_size(optarg);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if(optind >= argc || threads < 1 || queue < 1 || dns_entries < 1 ||
+     disk_mb < 1 || stale_window < 0 || top_k < 0 || cache_size < 1 ||
+     object_size < 1 || object_size > INT_MAX || object_size > cache_size)
+    usage(argv[0]);
+  max_object_size = object_size;
+  port = atoi(argv[optind]);
+
+  /* Every shard must be able to hold at least one maximum size object */
+  if(shards < 1)
+    shards = 1;
+  n = cache_fit_shards(cache_size, shards, max_object_size, admission);
+  if(n < shards) {
+    shards = n;
+    fprintf(stderr, "Limiting cache to %d shards\n", shards);
+  }
 
-  /* Initialize cache and lock */
-  proxy_cache = cache_init(MAX_CACHE_SIZE);
-  pthread_rwlock_init(&rwlock, NULL);
+  /* Initialize cache, demoting evicted objects to disk if asked to */
+  proxy_cache = cache_init(cache_size, shards, evict_policy);
+  if(admission)
+    cache_admission(proxy_cache);
+  if(disk_path != NULL) {
+    if(disk_init(disk_path, disk_mb * 1024 * 1024) < 0)
+      unix_error("disk_init error");
+    proxy_cache->demote = disk_demote;
+  }
 
-  if(argc < 2) {
-    fprintf(stderr, "usage: %s <port>\n", argv[0]);
-    exit(1);
+  /* Warm the cache from the last snapshot, and snapshot it when asked to */
+  if(snap_path != NULL) {
+    snapshot_load(proxy_cache, snap_path, max_object_size);
+    snapshot_init(proxy_cache, snap_path);
+    Signal(SIGTERM, sigterm_handler);
+    Signal(SIGUSR2, sigusr2_handler);
   }
-  port = atoi(argv[1]);
 
-  /* Ignore broken pipe signals */
+  /* Refresh stale and soon to be stale objects in the background */
+  if(stale_window > 0 || top_k > 0)
+    refresh_init(proxy_cache, stale_window, top_k);
+
+  /* Initialize the DNS cache */
+  dns_init(dns_entries);
+
+  /* Ignore broken pipe signals, and report DNS counters on SIGUSR1 */
   Signal(SIGPIPE, SIG_IGN);
+  Signal(SIGUSR1, sigusr1_handler);
 
   listenfd = Open_listenfd(port);
+  if(engine == ENGINE_EPOLL) {
+    event_run(listenfd, threads);
+    return 0;
+  }
+  if(engine == ENGINE_URING && uring_run(listenfd, threads) < 0)
+    fprintf(stderr, "io_uring is not supported, using thread engine\n");
+
+  /* Prethread the worker pool */
+  sbuf_init(&conn_buf, queue);
+  idle_init(&conn_buf);
+  for(i = 0; i < threads; i++) {
+    Pthread_create(&tid, NULL, worker, NULL);
+  }
+
   while(1) {
     clientlen = sizeof(clientaddr);
-    connfd = Malloc(sizeof(int));
-    *connfd = Accept(listenfd, (SA *)&clientaddr, (socklen_t *)&clientlen);
-    Pthread_create(&tid, NULL, new_request, connfd);
+    connfd = Accept(listenfd, (SA *)&clientaddr, (socklen_t *)&clientlen);
+    setsockopt(connfd, SOL_SOCKET, SO_RCVTIMEO, &read_timeout,
+               sizeof(read_timeout));
+    if(!reject) {
+      sbuf_insert(&conn_buf, connfd);
+    }
+    else if(sbuf_tryinsert(&conn_buf, connfd) < 0) {
+      send_status(connfd, 503);
+      close(connfd);
+    }
   }
   return 0;
 }
 
 /*
- * new_request: Spawns a new thread for an incoming request.
+ * usage: Prints the command line usage and exits.
  */
-void *new_request(void *vargp) {
+void usage(char *prog) {
+  fprintf(stderr, "usage: %s [-e thread|epoll|uring] [-s shards] [-t threads] "
+          "[-q queue] [-r] [-d dns_entries] [-D disk_file] [-z disk_mb] "
+          "[-w snapshot_file] [-p lru|s3fifo|arc|gdsf] [-a] [-W stale_window] "
+          "[-k top_k] [-c cache_size] [-m max_object] <port>\n", prog);
+  exit(1);
+}
+
+/*
+ * parse_size: Returns the size in bytes given by str, a number optionally
+ *             followed by K, M, or G, or -1 if str is not a size.
+ */
+int64_t parse_size(char *str) {
+  char *end;
+  int64_t size = strtoll(str, &end, 10);
+  int shift = 0;
+
+  if(end == str || size < 0)
+    return -1;
+  if(*end == 'K' || *end == 'k')
+    shift = 10;
+  else if(*end == 'M' || *end == 'm')
+    shift = 20;
+  else if(*end == 'G' || *end == 'g')
+    shift = 30;
+  if(shift > 0)
+    end++;
+  return (*end == '\0') ? size << shift : -1;
+}
+
+/*
+ * sigusr1_handler: Asks for the DNS cache counters to be printed.
+ */
+void sigusr1_handler(int sig) {
+  dns_report();
+}
+
+/*
+ * sigterm_handler: Asks for a snapshot of the cache, then exits.
+ */
+void sigterm_handler(int sig) {
+  snapshot_request(1);
+}
+
+/*
+ * sigusr2_handler: Asks for a snapshot of the cache.
+ */
+void sigusr2_handler(int sig) {
+  snapshot_request(0);
+}
+
+/*
+ * worker: Worker thread routine that serves connections from the
+ *         shared buffer forever.
+ */
+void *worker(void *vargp) {
   Pthread_detach(pthread_self());
+  while(1) {
+    int connfd = sbuf_remove(&conn_buf);
+    serve_client(connfd);
+  }
+  return NULL;
+}
 
-  char buf[MAXLINE];
+/*
+ * serve_client: Serves requests on a connection with data to read,
+ *               including pipelined ones, until no request is waiting,
+ *               then parks it to wait for the next one (see "idle.c").
+ *               Closes it instead if the client closes it, a read takes
+ *               CLIENT_READ_TIMEOUT seconds, or a response cannot be
+ *               followed by another.
+ */
+void serve_client(int connfd) {
+  rio_t rio_toclient;
+  struct pollfd pfd;
+
+  Rio_readinitb(&rio_toclient, connfd);
+  pfd.fd = connfd;
+  pfd.events = POLLIN;
+  while(1) {
+    if(!new_request(connfd, &rio_toclient)) {
+      close(connfd);
+      return;
+    }
+    /* Pipelined requests may already be buffered */
+    if(rio_toclient.rio_cnt == 0 && poll(&pfd, 1, 0) <= 0)
+      break;
+  }
+  idle_park(connfd);
+}
+
+/*
+ * new_request: Serves the next request on the client connection. Returns 1
+ *              if the connection can carry another request, or 0 if it
+ *              must be closed.
+ */
+int new_request(int connfd, rio_t *rio_toclient) {
   char request[MAXLINE], uri[MAXLINE], host[MAXLINE], remain[MAXLINE];
   char req_port[MAXLINE], req_headers[MAXLINE];
-  rio_t rio_toclient, rio_toserver;
-  int connfd = *((int *)vargp);
-  free(vargp);
+  int status, keep_alive, http11;
 
-  read_request(connfd, &rio_toclient, request, uri);
-  strcpy(req_port, read_uri(uri, host, remain));
-  strcpy(req_headers, "");
-  cat_requesthdrs(&rio_toclient, req_headers);
-
-  /* Check if request is in the cache */
-  object *retrieve;
-  int found = 0;
-  pthread_rwlock_rdlock(&rwlock);
-  retrieve = find_request(proxy_cache, request);
-  if(retrieve != NULL)
-    found = 1;
-  pthread_rwlock_unlock(&rwlock);
-  if(found) {
-    pthread_rwlock_rdlock(&rwlock);
-    rio_writen(connfd, retrieve->response, retrieve->size);
-    pthread_rwlock_unlock(&rwlock);
-    if(errno != EPIPE)
-      close(connfd); //Close connfd if not prematurely closed
-    return NULL;
+  if((status = read_request(rio_toclient, request, uri, &keep_alive)) != 0) {
+    if(status > 0)
+      send_status(connfd, status);
+    return 0;
   }
 
-  /* Send request to server */
-  int serverfd;
-  remove_newline(host);
-  if((serverfd = open_clientfd_r(host, req_port)) < 0) {
-    clienterror(connfd, "GET", "404", "Not found",
-                "Requested URL could not be found");
-    close(connfd);
-    return NULL;
-  }
-  Rio_readinitb(&rio_toserver, serverfd);
-  sprintf(buf, "GET %s HTTP/1.0\r\n", remain);
-  if((rio_writen(serverfd, buf, strlen(buf))) < 0) {
-    if(errno != EPIPE)
-      close(serverfd); //Close serverfd if not prematurely closed
-    close(connfd);
-    return NULL;
+  /* Only HTTP/1.1 clients keep connections open by default */
+  http11 = keep_alive;
+  read_uri(uri, host, req_port, remain);
+  strcpy(req_headers, "");
+  if(cat_requesthdrs(rio_toclient, req_headers, host, req_port, http11,
+                     &keep_alive) < 0)
+    return 0;
+
+  /* Check if request is in the cache, which pins the object until sent */
+  object *retrieve, *stale = NULL;
+  if((retrieve = cache_lookup(proxy_cache, request)) != NULL) {
+    /* Stale objects in the stale window are refreshed in the background */
+    if(object_fresh(retrieve) || refresh_stale(retrieve)) {
+      if(!send_object(connfd, retrieve))
+        keep_alive = 0;
+      release_object(retrieve);
+      return keep_alive;
+    }
+
+    /* Revalidate a stale object if it has validators, or fetch it anew */
+    if(retrieve->etag != NULL || retrieve->last_modified != NULL)
+      stale = retrieve;
+    else
+      release_object(retrieve);
   }
-  sprintf(buf, "%s\r\n", req_headers);
-  if((rio_writen(serverfd, buf, strlen(buf))) < 0) {
-    if(errno != EPIPE)
-      close(serverfd); //Close serverfd if not prematurely closed
-    close(connfd);
-    return NULL;
+
+  /* Then the disk tier, which sends the object straight from its file */
+  disk_entry *demoted;
+  if(stale == NULL && (demoted = disk_lookup(request)) != NULL) {
+    if(disk_fresh(demoted)) {
+      if(disk_send(connfd, demoted) < 0 ||
+         !frame_ends(disk_data(demoted),
+                     (demoted->size < SEG_SIZE) ? demoted->size : SEG_SIZE))
+        keep_alive = 0;
+      disk_release(demoted);
+      return keep_alive;
+    }
+    disk_release(demoted);
   }
 
-  /* Forward response to client */
-  int rc;
-  int flag = 1;
-  int total_size = 0;
-  char *response = Malloc(MAX_OBJECT_SIZE);
-  memset(response, '\0', MAX_OBJECT_SIZE);
-  while((rc = rio_readnb(&rio_toserver, buf, MAXLINE)) > 0) {
-    if(flag) {
-      if((total_size + rc) <= MAX_OBJECT_SIZE) {
-        memcpy(response + total_size, buf, rc);
-        total_size += rc;
-      }
-      else {
-        flag = 0;
-        free(response);
-      }
+  /* Collapse concurrent misses for the same request into one fetch */
+  int leader;
+  remove_newline(host);
+  fetch *F = inflight_join(request, &leader);
+  if(leader) {
+    if(!fetch_response(connfd, host, req_port, remain, req_headers, http11,
+                       F, stale))
+      keep_alive = 0;
+    inflight_leave(F);
+  }
+  else if((status = inflight_follow(F, connfd)) == FOLLOW_RETRY) {
+    /*
+     * The fetch was abandoned, possibly because the leader revalidated
+     * the cached object, so use that if it is fresh now, or fetch the
+     * response ourselves
+     */
+    inflight_leave(F);
+    if((retrieve = cache_lookup(proxy_cache, request)) != NULL &&
+       object_fresh(retrieve)) {
+      if(!send_object(connfd, retrieve))
+        keep_alive = 0;
     }
-    if((rio_writen(connfd, buf, rc)) < 0) {
-      if(errno != EPIPE)
-        close(connfd); //Close connfd if not prematurely closed
-      close(serverfd);
-      return NULL;
+    else if(!fetch_response(connfd, host, req_port, remain, req_headers,
+                            http11, NULL, NULL)) {
+      keep_alive = 0;
     }
+    if(retrieve != NULL)
+      release_object(retrieve);
   }
-
-  /* Add new object to cache if necessary */
-  if(flag && (errno != ECONNRESET)) {
-    char *new_req = Malloc(strlen(request) + 1);
-    memcpy(new_req, request, strlen(request) + 1);
-    char *new_resp = Malloc(total_size);
-    memcpy(new_resp, response, total_size);
-    free(response);
-    object *new_obj = new_object(new_req, new_resp, total_size);
-    pthread_rwlock_wrlock(&rwlock);
-    cache_insert(proxy_cache, new_obj);
-    pthread_rwlock_unlock(&rwlock);
+  else {
+    if(status != FOLLOW_DONE || !delimited(F->body.head, F->body.size))
+      keep_alive = 0;
+    inflight_leave(F);
   }
 
-  if(errno != ECONNRESET)
-    close(serverfd); //Close serverfd if not prematurely closed
-  close(connfd);
-  return NULL;
+  if(stale != NULL)
+    release_object(stale);
+  return keep_alive;
 }
 
 /*
- * read_request: Reads and parses the request line.
+ * send_object: Sends a cached object to the client. Returns 1 if it was
+ *              sent in full and marks its own end, or 0 otherwise.
  */
-void read_request(int fd, rio_t *rio, char *request, char *uri) {
-  char buf[MAXLINE];
-  char method[MAXLINE], version[MAXLINE];
-  Rio_readinitb(rio, fd);
-  if((rio_readlineb(rio, buf, MAXLINE)) < 0) {
-    clienterror(fd, method, "400", "Bad Request",
-                "Proxy could not be understood");
-  }
-  strcpy(request, buf);
-  sscanf(buf, "%s %s %s", method, uri, version);
-  if(strcasecmp(method, "GET")) {
-    clienterror(fd, method, "501", "Not Implemented",
-                "Proxy only supports GET method");
-  }
-  return;
+int send_object(int connfd, object *obj) {
+  return (seg_writen(connfd, obj->response, obj->size) >= 0 &&
+          delimited(obj->response, obj->size));
 }
 
 /*
- * read_uri : Parses the URI into host and remain,
- *            and returns the requested port (default 80).
+ * response_object: Makes a cache object of the complete response to the
+ *                  request held in body, taking over its segments, with
+ *                  the freshness and validators from its headers. Returns
+ *                  NULL, leaving body alone, if the response may not be
+ *                  stored.
  */
-char *read_uri(char *uri, char *host, char *remain) {
-  char *uri_p = uri;
-  char *req_port = "-1";
+object *response_object(char *request, segbuf *body) {
+  freshness fresh;
+  object *obj;
+
+  if(body->head == NULL)
+    return NULL;
+  fresh_parse(body->head->data, (body->size < SEG_SIZE) ? body->size
+                                                         : SEG_SIZE, &fresh);
+  if(!fresh_storable(&fresh))
+    return NULL;
 
-  /* Ignore "http://" */
-  if(strncasecmp(uri, "http://", 7) == 0) {
-    uri_p += 7;
+  obj = new_object(request, body->head, body->size);
+  obj->expires = fresh_until(&fresh, time(NULL));
+  object_validators(obj, fresh.etag, fresh.last_modified);
+  return obj;
+}
+
+/*
+ * delimited: Returns 1 if the response held in the chain starting at seg
+ *            marks its own end, so the client connection can carry
+ *            another response after it, or 0 otherwise.
+ */
+int delimited(segment *seg, int size) {
+  if(seg == NULL)
+    return 0;
+  return frame_ends(seg->data, (size < SEG_SIZE) ? size : SEG_SIZE);
+}
+
+/*
+ * frame_ends: Returns 1 if the response whose first len bytes are in buf
+ *             marks its own end, or 0 otherwise.
+ */
+int frame_ends(char *buf, int len) {
+  framing fr;
+
+  frame_init(&fr);
+  frame_scan(&fr, buf, len);
+  return frame_delimited(&fr);
+}
+
+/*
+ * fetch_response: Sends the request to the server and forwards the
+ *                 response to the client. As the leader of fetch F, reads
+ *                 the response into F's body for its followers and caches
+ *                 it if it is received in full. Without F, just relays the
+ *                 response. With a stale object, asks the server only for
+ *                 a changed response, and refreshes and sends the stale
+ *                 object if it has not changed. Without a client, as when
+ *                 connfd is -1 for a background refresh, only fills F and
+ *                 the cache. The request is sent as HTTP/1.1 if http11 is
+ *                 set, and as HTTP/1.0 otherwise. The server connection is
+ *                 returned to the pool if the response ended cleanly.
+ *                 Returns 1 if the client was sent a complete response
+ *                 that marks its own end, or 0 otherwise.
+ */
+int fetch_response(int connfd, char *host, char *req_port, char *remain,
+                   char *req_headers, int http11, fetch *F, object *stale) {
+  char buf[MAXLINE], cond_headers[MAXLINE], hold[MAXBUF];
+  char *headers = req_headers;
+  int serverfd, reused;
+  int held = 0, replayed = 0;
+  framing fr;
+
+  /* Make the request conditional on the stale object's validators */
+  if(stale != NULL) {
+    int len = strlen(req_headers);
+    strcpy(cond_headers, req_headers);
+    if(stale->etag != NULL && len + strlen(stale->etag) + 20 < MAXLINE)
+      len += sprintf(cond_headers + len, "If-None-Match: %s\r\n",
+                     stale->etag);
+    if(stale->last_modified != NULL &&
+       len + strlen(stale->last_modified) + 24 < MAXLINE)
+      len += sprintf(cond_headers + len, "If-Modified-Since: %s\r\n",
+                     stale->last_modified);
+    headers = cond_headers;
   }
 
-  /* Copy host */
-  int i;
-  for(i = 0; (*uri_p != '\0') && (*uri_p != '/'); i++) {
-    /* Record requested port if necessary */
-    if(*uri_p == ':') {
-      char port_s[10] = "";
-      char *port_p = uri_p + 1;
-      int y;
-      for(y = 0; (*port_p != '\0') && (*port_p != '/'); y++) {
-        port_s[y] = *port_p;
-        port_p++;
+  /* Send request to server, serving a stale object if it is unreachable */
+  if((serverfd = send_request(host, req_port, remain, headers, http11,
+                              &reused)) < 0) {
+    if(F != NULL)
+      inflight_abandon(F);
+    if(stale != NULL)
+      return send_object(connfd, stale);
+    clienterror(connfd, "GET", "404", "Not found",
+                "Requested URL could not be found");
+    return 0;
+  }
+
+  /*
+   * When revalidating, hold the response back until its headers are in.
+   * A 304 refreshes the stale object, which is sent instead, and any other
+   * response is replayed below as if it had just been read.
+   */
+  int rc, n, room;
+  frame_init(&fr);
+  while(stale != NULL && fr.state == FRAME_HEADERS && held < MAXBUF) {
+    while((rc = read(serverfd, hold + held, MAXBUF - held)) < 0 &&
+          errno == EINTR)
+      ;
+    if(rc <= 0) {
+      close(serverfd);
+      if(held == 0 && reused &&
+         (serverfd = send_request(host, req_port, remain, headers,
+                                  http11, &reused)) >= 0)
+        continue;
+      if(F != NULL)
+        inflight_abandon(F);
+      return send_object(connfd, stale);
+    }
+    if((n = frame_scan(&fr, hold + held, rc)) < rc)
+      fr.keep_alive = 0;
+    held += rc;
+  }
+  if(stale != NULL && fr.status == 304 && fr.state == FRAME_DONE) {
+    freshness fresh;
+    fresh_parse(hold, held, &fresh);
+    __atomic_store_n(&stale->expires, fresh_until(&fresh, time(NULL)),
+                     __ATOMIC_RELAXED);
+
+    /* Followers retry, and find the refreshed object in the cache */
+    if(F != NULL)
+      inflight_abandon(F);
+    if(fr.keep_alive)
+      pool_put(host, req_port, serverfd);
+    else
+      close(serverfd);
+    return send_object(connfd, stale);
+  }
+
+  /*
+   * Forward response to client, reading it straight into the fetch body.
+   * Keep filling the body for followers even if the response is too big
+   * to cache or the client goes away, until none depend on it.
+   */
+  int cacheable = 1;
+  int client = (connfd >= 0);
+  int received = 0;
+  frame_init(&fr);
+  while(fr.state != FRAME_DONE) {
+    /* The rest will not be cached, so let the kernel move it */
+    if(F == NULL && replayed == held &&
+       (fr.state == FRAME_LENGTH || fr.state == FRAME_UNTIL_CLOSE)) {
+      if(client && splice_response(serverfd, connfd, (fr.state == FRAME_LENGTH)
+                                   ? fr.remaining : -1) == 0)
+        fr.state = FRAME_DONE;
+      break;
+    }
+
+    char *dst = buf;
+    room = MAXLINE;
+    if(F != NULL)
+      dst = inflight_space(F, &room);
+    if(replayed < held) {
+      rc = (held - replayed < room) ? held - replayed : room;
+      memcpy(dst, hold + replayed, rc);
+      replayed += rc;
+    }
+    else {
+      while((rc = read(serverfd, dst, room)) < 0 && errno == EINTR)
+        ;
+    }
+    if(rc <= 0) {
+      /* The server may have closed a pooled connection, so reconnect */
+      if(received == 0 && reused) {
+        close(serverfd);
+        if((serverfd = send_request(host, req_port, remain, headers,
+                                    http11, &reused)) >= 0)
+          continue;
+        clienterror(connfd, "GET", "404", "Not found",
+                    "Requested URL could not be found");
       }
-      for(; y < 10; y++) {
-        port_s[y] = '\0';
+      else if(rc == 0 && fr.state == FRAME_UNTIL_CLOSE) {
+        fr.state = FRAME_DONE;
       }
-      uri_p = port_p;
-      req_port = port_s;
       break;
     }
-    host[i] = *uri_p;
-    uri_p++;
-  }
-  for(; i < MAXLINE; i++) {
-    host[i] = '\0';
-  }
+    received += rc;
+
+    /* Anything past the end of the response is not ours */
+    if((n = frame_scan(&fr, dst, rc)) < rc)
+      fr.keep_alive = 0;
+    rc = n;
+    if(client && (rio_writen(connfd, dst, rc)) < 0)
+      client = 0;
+    if(F == NULL) {
+      if(!client)
+        break;
+      continue;
+    }
 
-  /* Copy remaining path */
-  strcpy(remain, uri_p);
+    if(fr.length > max_object_size || (F->body.size + rc) > max_object_size)
+      cacheable = 0;
+    if((!cacheable || (!client && connfd >= 0)) &&
+       inflight_detach(F) == 0) {
+      F = NULL;
+      if(!client)
+        break;
+      continue;
+    }
+    inflight_publish(F, rc);
 
-  if(atoi(req_port) < 0) {
-    return "80";
+    /* Followers still need it, but keep no more than a cacheable object */
+    if(!cacheable)
+      inflight_drain(F, max_object_size);
   }
-  return req_port;
-}
 
-/*
- * cat_requesthdrs: Reads the request headers and
- *                  appends them to req_headers.
- */
-void cat_requesthdrs(rio_t *rio, char *req_headers) {
-  char buf[MAXLINE];
-
-  Rio_readlineb(rio, buf, MAXLINE);
-  while(strcmp(buf, "\r\n")) {
-    char h_key[MAXLINE], h_value[MAXLINE];
-    sscanf(buf, "%[^:]: %s", h_key, h_value);
-
-    /* Keep additional request headers */
-    if(strcasecmp(h_key, "User-Agent") &&
-       strcasecmp(h_key, "Accept") &&
-       strcasecmp(h_key, "Accept-Encoding") &&
-       strcasecmp(h_key, "Connection") &&
-       strcasecmp(h_key, "Proxy-Connection")) {
-      strcat(req_headers, buf);
+  /* Add new object to cache if it was received in full and may be stored */
+  if(F != NULL) {
+    object *new_obj;
+    segbuf body;
+    if(fr.state == FRAME_DONE && cacheable && inflight_detach(F) == 0) {
+      /* With no followers, the body is ours alone and can be trimmed */
+      body = F->body;
+      segbuf_init(&F->body);
+      segbuf_trim(&body);
+      if((new_obj = response_object(F->request, &body)) != NULL)
+        cache_store(proxy_cache, new_obj);
+      else
+        segbuf_free(&body);
+    }
+    else if(fr.state == FRAME_DONE && cacheable &&
+            (new_obj = response_object(F->request, &F->body)) != NULL) {
+      inflight_complete(F, new_obj);
+      cache_store(proxy_cache, new_obj);
+    }
+    else if(fr.state == FRAME_DONE) {
+      inflight_complete(F, NULL);
+    }
+    else {
+      inflight_abandon(F);
     }
-    Rio_readlineb(rio, buf, MAXLINE);
   }
 
-  /* Concatenate remaining request headers */
-  strcat(req_headers, user_agent_hdr);
-  strcat(req_headers, accept_hdr);
-  strcat(req_headers, accept_encoding_hdr);
-  strcat(req_headers, connection_hdr);
-  strcat(req_headers, proxy_connection_hdr);
+  if(serverfd < 0)
+    return 0;
+  if(fr.state == FRAME_DONE && fr.keep_alive)
+    pool_put(host, req_port, serverfd);
+  else
+    close(serverfd);
+  return (client && fr.state == FRAME_DONE && frame_delimited(&fr));
 }
 
 /*
- * remove_newline: Removes the termination characters in a header value
+ * send_request: Sends the request to the server over a pooled connection,
+ *               or a new one if there is none or the pooled ones fail, and
+ *               sets reused to say which. Uses HTTP/1.1 if http11 is set,
+ *               or HTTP/1.0 otherwise. Returns the connection, or -1 on
+ *               error.
  */
-void remove_newline(char *header) {
-  int x;
-  char *header_p = header;
-  for(x = 0; (*header_p != '\r') && (*header_p != '\0'); x++) {
-    header_p++;
-  }
-  for(; x < MAXLINE; x++) {
-    header[x] = '\0';
+int send_request(char *host, char *req_port, char *remain,
+                 char *req_headers, int http11, int *reused) {
+  char buf[MAXLINE];
+  int serverfd;
+
+  sprintf(buf, "GET %s HTTP/1.%d\r\n", remain, http11);
+  while((serverfd = pool_connect(host, req_port, reused)) >= 0) {
+    if((rio_writen(serverfd, buf, strlen(buf))) >= 0 &&
+       (rio_writen(serverfd, req_headers, strlen(req_headers))) >= 0 &&
+       (rio_writen(serverfd, "\r\n", 2)) >= 0)
+      return serverfd;
+    close(serverfd);
+    if(!*reused)
+      break;
   }
+  return -1;
 }
 
 /*
- * clienterror - returns an error message to the client
+ * splice_response: Relays the next len bytes of the response on serverfd,
+ *                  or all of the rest if len is -1, to the client without
+ *                  copying them through user space, by splicing them
+ *                  through a pipe. Falls back to copying if splicing is
+ *                  not supported. Returns 0 on success, -1 on error.
  */
-void clienterror(int fd, char *cause, char *errnum,
-		 char *shortmsg, char *longmsg) {
-  char buf[MAXLINE], body[MAXBUF];
-
-  /* Build the HTTP response body */
-  sprintf(body, "<html><title>Tiny Error</title>");
-  sprintf(body, "%s<body bgcolor=""ffffff"">\r\n", body);
-  sprintf(body, "%s%s: %s\r\n", body, errnum, shortmsg);
-  sprintf(body, "%s<p>%s: %s\r\n", body, longmsg, cause);
-  sprintf(body, "%s<hr><em>The Tiny Web server</em>\r\n", body);
-
-  /* Print the HTTP response */
-  sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-  if(rio_writen(fd, buf, strlen(buf)) < 0) {
-    if(errno != EPIPE)
-      close(fd);
-  }
-  sprintf(buf, "Content-type: text/html\r\n");
-  if(rio_writen(fd, buf, strlen(buf)) < 0) {
-    if(errno != EPIPE)
-      close(fd);
+int splice_response(int serverfd, int connfd, long len) {
+  char buf[MAXBUF];
+  int pipefd[2];
+  ssize_t n = 0, m;
+
+  if(pipe(pipefd) < 0)
+    pipefd[0] = pipefd[1] = -1;
+  while(pipefd[0] >= 0 && len != 0) {
+    n = splice(serverfd, NULL, pipefd[1], NULL,
+               (len < 0 || len > SPLICE_SIZE) ? SPLICE_SIZE : len,
+               SPLICE_F_MOVE | SPLICE_F_MORE);
+    if(n == 0)
+      break;
+    if(n < 0) {
+      if(errno == EINTR)
+        continue;
+      if(errno == EINVAL)
+        break; //Not supported on these descriptors, so copy instead
+      close(pipefd[0]);
+      close(pipefd[1]);
+      return -1;
+    }
+    if(len > 0)
+      len -= n;
+    while(n > 0) {
+      if((m = splice(pipefd[0], NULL, connfd, NULL, n,
+                     SPLICE_F_MOVE | SPLICE_F_MORE)) < 0) {
+        if(errno == EINTR)
+          continue;
+        close(pipefd[0]);
+        close(pipefd[1]);
+        return -1;
+      }
+      n -= m;
+    }
   }
-  sprintf(buf, "Content-length: %d\r\n\r\n", (int)strlen(body));
-  if(rio_writen(fd, buf, strlen(buf)) < 0) {
-    if(errno != EPIPE)
-      close(fd);
+  if(pipefd[0] >= 0) {
+    close(pipefd[0]);
+    close(pipefd[1]);
+    if(len == 0 || (len < 0 && n == 0))
+      return 0;
+    if(n == 0)
+      return -1; //Server closed before sending len bytes
   }
-  if(rio_writen(fd, body, strlen(body)) < 0) {
-    if(errno != EPIPE)
-      close(fd);
+
+  /*
+   * Copy instead, through a buffer of our own, since nothing else may be
+   * read from serverfd meanwhile
+   */
+  while(len != 0) {
+    n = read(serverfd, buf, (len < 0 || len > MAXBUF) ? MAXBUF : len);
+    if(n < 0 && errno == EINTR)
+      continue;
+    if(n <= 0)
+      return (len < 0 && n == 0) ? 0 : -1;
+    if(rio_writen(connfd, buf, n) < 0)
+      return -1;
+    if(len > 0)
+      len -= n;
   }
+  return 0;
 }
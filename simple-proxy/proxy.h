@@ -0,0 +1,24 @@
+#ifndef __PROXY_H__
+#define __PROXY_H__
+
+#include "csapp.h"
+#include "open_clientfd_r.h"
+#include "cache.h"
+#include "http.h"
+#include "inflight.h"
+
+/* Default max cache and object sizes */
+#define DEFAULT_CACHE_SIZE 1049000
+#define DEFAULT_OBJECT_SIZE 102400
+
+/* Cache shared by every connection engine */
+extern cache *proxy_cache;
+
+/* Largest response cached, settable with -m */
+extern int max_object_size;
+
+object *response_object(char *request, segbuf *body);
+int fetch_response(int connfd, char *host, char *req_port, char *remain,
+                   char *req_headers, int http11, fetch *F, object *stale);
+
+#endif /* __PROXY_H__ */
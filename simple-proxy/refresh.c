@@ -0,0 +1,248 @@
+/*
+ * refresh.c
+ *
+ * Derek Tzeng
+ * dtzeng
+ *
+ * Background refresh of cached objects.
+ *
+ * Without it, the first client to request an object after it goes stale
+ * waits for the server, even when the object is hit constantly. With a
+ * stale window (-W), a stale object is still served from the cache for
+ * that many seconds past its expiry, as with stale-while-revalidate, and
+ * is queued to be fetched again in the background. With -k, a scanner
+ * thread also looks through the cache every REFRESH_INTERVAL seconds for
+ * the objects hit most often that will go stale within REFRESH_AHEAD
+ * seconds, and queues the k hottest, so they are usually refreshed before
+ * any client sees them stale.
+ *
+ * Queued objects are pinned and handed to a small pool of refresh threads
+ * through a bounded queue, built like the connection buffer in "sbuf.c".
+ * An object is only queued once at a time, and when the queue is full the
+ * refresh is skipped rather than waited for. A refresh thread fetches the
+ * object as the leader of an in-flight fetch (see "inflight.c"), so
+ * clients that miss on it meanwhile share the fetch, and a refresh is
+ * skipped if a fetch for the object is already running. The object is
+ * revalidated if it has validators, and the new response otherwise
+ * replaces it in the cache.
+ *
+ * Hits are counted on each object as find_request finds it, and every
+ * refresh the scanner asks for halves the count, so an object must keep
+ * being hit to keep being refreshed.
+ *
+ */
+
+#include "proxy.h"
+#include "refresh.h"
+#include "inflight.h"
+
+static cache *refresh_cache;
+static int stale_window = 0;
+static int hot_objects = 0;
+
+/* Bounded queue of pinned objects waiting for a refresh thread */
+static object *queue[REFRESH_QUEUE];
+static int front = 0, rear = 0;
+static sem_t mutex, slots, items;
+
+static void *refresher(void *vargp);
+static void *scanner(void *vargp);
+static void refresh_object(object *obj);
+static int hottest(shard *S, object **hot, int count, time_t now);
+
+/*
+ * refresh_init: Starts the refresh threads, which serve stale objects for
+ *               window seconds past their expiry while they are refreshed,
+ *               and, if top_k is positive, the scanner that refreshes the
+ *               top_k hottest objects before they go stale.
+ */
+void refresh_init(cache *C, int window, int top_k) {
+  pthread_t tid;
+  int i;
+
+  refresh_cache = C;
+  stale_window = window;
+  hot_objects = top_k;
+  Sem_init(&mutex, 0, 1);
+  Sem_init(&slots, 0, REFRESH_QUEUE);
+  Sem_init(&items, 0, 0);
+  for(i = 0; i < REFRESH_THREADS; i++)
+    Pthread_create(&tid, NULL, refresher, NULL);
+  if(top_k > 0)
+    Pthread_create(&tid, NULL, scanner, NULL);
+}
+
+/*
+ * refresh_stale: Returns 1 if the stale object may still be served, since
+ *                it is within the stale window, after queueing it to be
+ *                refreshed, or 0 if it must not be served.
+ */
+int refresh_stale(object *obj) {
+  time_t expires = __atomic_load_n(&obj->expires, __ATOMIC_RELAXED);
+
+  if(stale_window <= 0 || time(NULL) >= expires + stale_window)
+    return 0;
+  refresh_request(obj);
+  return 1;
+}
+
+/*
+ * refresh_request: Queues the object to be refreshed, pinning it until
+ *                  it is. Returns 1 if it was queued, or 0 if it is
+ *                  already queued or the queue is full.
+ */
+int refresh_request(object *obj) {
+  int idle = 0;
+
+  if(!__atomic_compare_exchange_n(&obj->refreshing, &idle, 1, 0,
+                                  __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+    return 0;
+  while(sem_trywait(&slots) < 0) {
+    if(errno != EINTR) {
+      __atomic_store_n(&obj->refreshing, 0, __ATOMIC_RELEASE);
+      return 0;
+    }
+  }
+  __atomic_add_fetch(&obj->refcount, 1, __ATOMIC_RELAXED);
+  P(&mutex);
+  rear = (rear + 1) % REFRESH_QUEUE;
+  queue[rear] = obj;
+  V(&mutex);
+  V(&items);
+  return 1;
+}
+
+/*
+ * refresher: Refresh thread routine that refreshes queued objects forever.
+ */
+static void *refresher(void *vargp) {
+  object *obj;
+
+  Pthread_detach(pthread_self());
+  while(1) {
+    P(&items);
+    P(&mutex);
+    front = (front + 1) % REFRESH_QUEUE;
+    obj = queue[front];
+    V(&mutex);
+    V(&slots);
+
+    refresh_object(obj);
+    __atomic_store_n(&obj->refreshing, 0, __ATOMIC_RELEASE);
+    release_object(obj);
+  }
+  return NULL;
+}
+
+/*
+ * refresh_object: Fetches the object's request from the server again, in
+ *                 its own HTTP version, revalidating the object if it has
+ *                 validators, and caches the response. Skips the fetch if
+ *                 one is already running.
+ */
+static void refresh_object(object *obj) {
+  char method[MAXLINE], uri[MAXLINE], version[MAXLINE];
+  char host[MAXLINE], remain[MAXLINE], req_port[MAXLINE];
+  char req_headers[MAXLINE];
+  object *stale = NULL;
+  fetch *F;
+  int leader, http11, n;
+
+  if(sscanf(obj->request, "%s %s %s", method, uri, version) != 3)
+    return;
+  read_uri(uri, host, req_port, remain);
+  http11 = !strcasecmp(version, "HTTP/1.1");
+
+  /*
+   * Send the headers a client without any of its own would get, leaving
+   * room for the proxy's own, and skip the refresh if they do not fit
+   */
+  if(strcmp(req_port, "80"))
+    n = snprintf(req_headers, MAXLINE - PROXYHDRS_LEN, "Host: %s:%s\r\n",
+                 host, req_port);
+  else
+    n = snprintf(req_headers, MAXLINE - PROXYHDRS_LEN, "Host: %s\r\n", host);
+  if(n >= MAXLINE - PROXYHDRS_LEN)
+    return;
+  cat_proxyhdrs(req_headers, http11);
+
+  if(obj->etag != NULL || obj->last_modified != NULL)
+    stale = obj;
+  F = inflight_join(obj->request, &leader);
+  if(leader)
+    fetch_response(-1, host, req_port, remain, req_headers, http11, F,
+                   stale);
+  inflight_leave(F);
+}
+
+/*
+ * scanner: Scanner thread routine that queues the hottest objects about to
+ *          go stale for a refresh every REFRESH_INTERVAL seconds.
+ */
+static void *scanner(void *vargp) {
+  object **hot = Malloc(hot_objects * sizeof(object *));
+  int count, i;
+
+  Pthread_detach(pthread_self());
+  while(1) {
+    sleep(REFRESH_INTERVAL);
+    time_t now = time(NULL);
+    count = 0;
+    for(i = 0; i < refresh_cache->num_shards; i++) {
+      shard *S = &refresh_cache->shards[i];
+      pthread_mutex_lock(&S->lock);
+      count = hottest(S, hot, count, now);
+      pthread_mutex_unlock(&S->lock);
+    }
+
+    for(i = 0; i < count; i++) {
+      if(refresh_request(hot[i])) {
+        int hits = __atomic_load_n(&hot[i]->hits, __ATOMIC_RELAXED);
+        __atomic_store_n(&hot[i]->hits, hits / 2, __ATOMIC_RELAXED);
+      }
+      release_object(hot[i]);
+    }
+  }
+  return NULL;
+}
+
+/*
+ * hottest: Merges the shard's objects that have been hit and go stale
+ *          within REFRESH_AHEAD seconds of now into hot, which holds count
+ *          pinned objects, keeping only the hot_objects hit most often.
+ *          Returns the new count. The caller holds the shard's lock.
+ */
+static int hottest(shard *S, object **hot, int count, time_t now) {
+  object *obj;
+  int i, coldest, coldest_hits;
+
+  for(obj = S->MRA; obj != NULL; obj = obj->next) {
+    time_t expires = __atomic_load_n(&obj->expires, __ATOMIC_RELAXED);
+    int hits = __atomic_load_n(&obj->hits, __ATOMIC_RELAXED);
+    if(expires == 0 || expires <= now || expires > now + REFRESH_AHEAD ||
+       hits == 0)
+      continue;
+
+    if(count < hot_objects) {
+      coldest = count++;
+    }
+    else {
+      /* Hits keep changing under lookups, so each is loaded once */
+      coldest = 0;
+      coldest_hits = __atomic_load_n(&hot[0]->hits, __ATOMIC_RELAXED);
+      for(i = 1; i < count; i++) {
+        int h = __atomic_load_n(&hot[i]->hits, __ATOMIC_RELAXED);
+        if(h < coldest_hits) {
+          coldest = i;
+          coldest_hits = h;
+        }
+      }
+      if(coldest_hits >= hits)
+        continue;
+      release_object(hot[coldest]);
+    }
+    __atomic_add_fetch(&obj->refcount, 1, __ATOMIC_RELAXED);
+    hot[coldest] = obj;
+  }
+  return count;
+}
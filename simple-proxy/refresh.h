@@ -0,0 +1,23 @@
+#ifndef __REFRESH_H__
+#define __REFRESH_H__
+
+#include "csapp.h"
+#include "cache.h"
+
+/* Number of threads fetching refreshes */
+#define REFRESH_THREADS 4
+
+/* Most refreshes waiting for a thread */
+#define REFRESH_QUEUE 256
+
+/* Seconds between scans for hot objects about to go stale */
+#define REFRESH_INTERVAL 1
+
+/* Hot objects are refreshed once they are this many seconds from stale */
+#define REFRESH_AHEAD 5
+
+void refresh_init(cache *C, int window, int top_k);
+int refresh_stale(object *obj);
+int refresh_request(object *obj);
+
+#endif /* __REFRESH_H__ */
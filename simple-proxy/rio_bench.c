@@ -0,0 +1,242 @@
+/*
+ * rio_bench.c
+ *
+ * Derek Tzeng
+ * dtzeng
+ *
+ * Microbenchmark for the buffered line reader, rio_readlineb.
+ *
+ * Reads a file of request lines through rio_readlineb, and through the
+ * byte-at-a-time reader it replaced, which called rio_read once for every
+ * character, and reports the time per line and the throughput of each.
+ * Without a file, a temporary one is filled with -n requests carrying
+ * the headers of a typical browser. The file is read -r times by each
+ * reader and the fastest pass is reported, leaving out the warmup. Both
+ * readers must read the same lines, or the benchmark fails.
+ *
+ * The benchmark is not part of the proxy; build it on its own with
+ *
+ *   gcc -O2 -o rio_bench rio_bench.c csapp.c -lpthread
+ *
+ */
+
+#include "csapp.h"
+#include <stdint.h>
+#include <time.h>
+
+/* Requests in the generated file, and passes over the file, by default */
+#define BENCH_REQUESTS 100000
+#define BENCH_PASSES 5
+
+/* FNV-1a 64-bit parameters, to check that both readers agree */
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+typedef ssize_t (*line_reader)(rio_t *rp, void *usrbuf, size_t maxlen);
+
+static const char *request =
+  "GET http://www.example.com/static/images/logo.png HTTP/1.1\r\n"
+  "Host: www.example.com\r\n"
+  "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) "
+  "Gecko/20120305 Firefox/10.0.3\r\n"
+  "Accept: image/png,image/*;q=0.8,*/*;q=0.5\r\n"
+  "Accept-Language: en-US,en;q=0.5\r\n"
+  "Accept-Encoding: gzip, deflate\r\n"
+  "Referer: http://www.example.com/index.html\r\n"
+  "Cookie: session=8f14e45fceea167a5a36dedd4bea2543; theme=dark\r\n"
+  "Connection: keep-alive\r\n"
+  "\r\n";
+
+void usage(char *prog);
+int make_requests(int n);
+void bench(char *name, line_reader read_line, int fd, int passes);
+uint64_t checksum(line_reader read_line, int fd);
+static ssize_t bytewise_read(rio_t *rp, char *usrbuf, size_t n);
+static ssize_t bytewise_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
+
+int main(int argc, char **argv) {
+  int requests = BENCH_REQUESTS;
+  int passes = BENCH_PASSES;
+  int opt, fd;
+
+  while((opt = getopt(argc, argv, "n:r:")) != -1) {
+    switch(opt) {
+    case 'n':
+      requests = atoi(optarg);
+      break;
+    case 'r':
+      passes = atoi(optarg);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if(requests < 1 || passes < 1)
+    usage(argv[0]);
+
+  if(optind < argc) {
+    if((fd = open(argv[optind], O_RDONLY)) < 0)
+      unix_error("open error");
+  }
+  else {
+    fd = make_requests(requests);
+  }
+
+  if(checksum(bytewise_readlineb, fd) != checksum(rio_readlineb, fd))
+    app_error("rio_bench error: readers disagree");
+
+  printf("%-10s %12s %12s %12s\n", "reader", "lines", "ns/line", "MB/s");
+  bench("bytewise", bytewise_readlineb, fd, passes);
+  bench("memchr", rio_readlineb, fd, passes);
+  close(fd);
+  return 0;
+}
+
+/*
+ * usage: Prints the command line usage and exits.
+ */
+void usage(char *prog) {
+  fprintf(stderr, "usage: %s [-n requests] [-r passes] [file]\n", prog);
+  exit(1);
+}
+
+/*
+ * make_requests: Returns a descriptor for an unlinked temporary file
+ *                holding n copies of the request.
+ */
+int make_requests(int n) {
+  char path[] = "/tmp/rio_benchXXXXXX";
+  int fd, i;
+
+  if((fd = mkstemp(path)) < 0)
+    unix_error("mkstemp error");
+  unlink(path);
+  for(i = 0; i < n; i++) {
+    if(rio_writen(fd, (char *)request, strlen(request)) < 0)
+      unix_error("rio_writen error");
+  }
+  return fd;
+}
+
+/*
+ * bench: Reads the file line by line with the reader passes times, and
+ *        prints the lines read and the fastest pass's time per line and
+ *        throughput.
+ */
+void bench(char *name, line_reader read_line, int fd, int passes) {
+  char buf[MAXLINE];
+  struct timespec start, end;
+  double best = -1, elapsed;
+  long lines = 0, bytes = 0;
+  ssize_t n;
+  rio_t rio;
+  int pass;
+
+  for(pass = 0; pass < passes; pass++) {
+    if(lseek(fd, 0, SEEK_SET) < 0)
+      unix_error("lseek error");
+    rio_readinitb(&rio, fd);
+    lines = 0;
+    bytes = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while((n = read_line(&rio, buf, MAXLINE)) > 0) {
+      lines++;
+      bytes += n;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if(n < 0)
+      unix_error("read_line error");
+
+    elapsed = (end.tv_sec - start.tv_sec) +
+              (end.tv_nsec - start.tv_nsec) / 1e9;
+    if(best < 0 || elapsed < best)
+      best = elapsed;
+  }
+
+  printf("%-10s %12ld %12.1f %12.1f\n", name, lines,
+         (lines > 0) ? best * 1e9 / lines : 0.0,
+         (best > 0) ? bytes / best / 1e6 : 0.0);
+}
+
+/*
+ * checksum: Reads the file line by line with the reader, and returns the
+ *           FNV-1a hash of the lines, each ended by its terminating null.
+ */
+uint64_t checksum(line_reader read_line, int fd) {
+  char buf[MAXLINE];
+  uint64_t hash = FNV_OFFSET;
+  unsigned char *p;
+  ssize_t n;
+  rio_t rio;
+
+  if(lseek(fd, 0, SEEK_SET) < 0)
+    unix_error("lseek error");
+  rio_readinitb(&rio, fd);
+  while((n = read_line(&rio, buf, MAXLINE)) > 0) {
+    p = (unsigned char *)buf;
+    do {
+      hash ^= *p;
+      hash *= FNV_PRIME;
+    } while(*p++ != '\0');
+  }
+  if(n < 0)
+    unix_error("read_line error");
+  return hash;
+}
+
+/*
+ * bytewise_read: The buffered read that the byte-at-a-time reader called
+ *                for every character, as rio_read was in "csapp.c".
+ */
+static ssize_t bytewise_read(rio_t *rp, char *usrbuf, size_t n) {
+  int cnt;
+
+  while(rp->rio_cnt <= 0) {
+    rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, sizeof(rp->rio_buf));
+    if(rp->rio_cnt < 0) {
+      if(errno != EINTR)
+        return -1;
+    }
+    else if(rp->rio_cnt == 0)
+      return 0;
+    else
+      rp->rio_bufptr = rp->rio_buf;
+  }
+
+  cnt = n;
+  if((size_t)(rp->rio_cnt) < n)
+    cnt = rp->rio_cnt;
+  memcpy(usrbuf, rp->rio_bufptr, cnt);
+  rp->rio_bufptr += cnt;
+  rp->rio_cnt -= cnt;
+  return cnt;
+}
+
+/*
+ * bytewise_readlineb: The line reader rio_readlineb replaced, which reads
+ *                     one byte at a time.
+ */
+static ssize_t bytewise_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) {
+  size_t n;
+  int rc;
+  char c, *bufp = usrbuf;
+
+  for(n = 1; n < maxlen; n++) {
+    if((rc = bytewise_read(rp, &c, 1)) == 1) {
+      *bufp++ = c;
+      if(c == '\n')
+        break;
+    }
+    else if(rc == 0) {
+      if(n == 1)
+        return 0;
+      else
+        break;
+    }
+    else
+      return -1;
+  }
+  *bufp = 0;
+  return n;
+}
@@ -0,0 +1,146 @@
+/*
+ * s3fifo.c
+ *
+ * Derek Tzeng
+ * dtzeng
+ *
+ * S3-FIFO eviction policy.
+ *
+ * Most web objects are only requested once, and under LRU every one of
+ * them travels the whole list before being evicted, pushing out objects
+ * that are requested again. S3-FIFO instead admits new objects into a
+ * small FIFO queue holding S3FIFO_SMALL_PERCENT of the shard's bytes, and
+ * evicts those that see no hit while in it. Objects that are hit move to
+ * the main FIFO queue, which gives an object with hits another pass per
+ * hit, up to S3FIFO_MAX_FREQ, instead of evicting it.
+ *
+ * Objects evicted from the small queue are remembered in a ghost list,
+ * and one that comes back while still remembered goes straight to the
+ * main queue.
+ *
+ * Hits only bump the object's frequency, so a hit never takes the shard's
+ * lock, and every queue is a plain FIFO.
+ *
+ */
+
+#include "policy.h"
+
+/* Queues holding an object */
+#define S3FIFO_SMALL 0
+#define S3FIFO_MAIN 1
+
+typedef struct {
+  qlist small;
+  qlist main;
+  ghost *ghosts;
+  long small_bytes;   /* Bytes the small queue may hold before evicting */
+} s3fifo;
+
+/*
+ * s3fifo_init: Sets up empty queues for the shard.
+ */
+static void s3fifo_init(shard *S) {
+  s3fifo *Q = Malloc(sizeof(s3fifo));
+
+  qlist_init(&Q->small);
+  qlist_init(&Q->main);
+  Q->small_bytes = (long)S->capacity * S3FIFO_SMALL_PERCENT / 100;
+  Q->ghosts = ghost_new(S->capacity - Q->small_bytes);
+  S->state = Q;
+}
+
+/*
+ * s3fifo_destroy: Frees the shard's queues.
+ */
+static void s3fifo_destroy(shard *S) {
+  s3fifo *Q = S->state;
+
+  ghost_free(Q->ghosts);
+  free(Q);
+}
+
+/*
+ * s3fifo_insert: Queues a new object in the small queue, or in the main
+ *                queue if it was evicted recently.
+ */
+static void s3fifo_insert(shard *S, object *obj) {
+  s3fifo *Q = S->state;
+
+  obj->freq = 0;
+  if(ghost_take(Q->ghosts, obj->hash)) {
+    obj->mark = S3FIFO_MAIN;
+    qlist_push(&Q->main, obj);
+  }
+  else {
+    obj->mark = S3FIFO_SMALL;
+    qlist_push(&Q->small, obj);
+  }
+}
+
+/*
+ * s3fifo_remove: Unlinks the object from its queue.
+ */
+static void s3fifo_remove(shard *S, object *obj) {
+  s3fifo *Q = S->state;
+
+  qlist_remove((obj->mark == S3FIFO_MAIN) ? &Q->main : &Q->small, obj);
+}
+
+/*
+ * s3fifo_victim: Returns the next object to evict, from the small queue
+ *                while it is over its share, or from the main queue.
+ */
+static object *s3fifo_victim(shard *S) {
+  s3fifo *Q = S->state;
+  object *obj;
+
+  while(1) {
+    if(Q->small.count > 0 &&
+       (Q->small.bytes > Q->small_bytes || Q->main.count == 0)) {
+      obj = Q->small.tail;
+      if(__atomic_load_n(&obj->freq, __ATOMIC_RELAXED) > 0) {
+        qlist_remove(&Q->small, obj);
+        __atomic_store_n(&obj->freq, 0, __ATOMIC_RELAXED);
+        obj->mark = S3FIFO_MAIN;
+        qlist_push(&Q->main, obj);
+        continue;
+      }
+      return obj;
+    }
+
+    obj = Q->main.tail;
+    if(__atomic_load_n(&obj->freq, __ATOMIC_RELAXED) > 0) {
+      __atomic_sub_fetch(&obj->freq, 1, __ATOMIC_RELAXED);
+      qlist_remove(&Q->main, obj);
+      qlist_push(&Q->main, obj);
+      continue;
+    }
+    return obj;
+  }
+}
+
+/*
+ * s3fifo_evicted: Remembers a victim evicted from the small queue in the
+ *                 ghost list.
+ */
+static void s3fifo_evicted(shard *S, object *obj) {
+  s3fifo *Q = S->state;
+
+  if(obj->mark == S3FIFO_SMALL)
+    ghost_add(Q->ghosts, obj->hash, obj->charge);
+}
+
+/*
+ * s3fifo_hit: Counts a hit, up to S3FIFO_MAX_FREQ.
+ */
+static void s3fifo_hit(object *obj) {
+  int freq = __atomic_load_n(&obj->freq, __ATOMIC_RELAXED);
+
+  if(freq < S3FIFO_MAX_FREQ)
+    __atomic_store_n(&obj->freq, freq + 1, __ATOMIC_RELAXED);
+}
+
+policy s3fifo_policy = {
+  "s3fifo", s3fifo_init, s3fifo_destroy, s3fifo_insert, s3fifo_remove,
+  s3fifo_victim, s3fifo_evicted, s3fifo_hit
+};
@@ -0,0 +1,84 @@
+/*
+ * sbuf.c
+ *
+ * Derek Tzeng
+ * dtzeng
+ *
+ * A bounded producer/consumer buffer of integers, used by the proxy to hand
+ * accepted connection descriptors from the main thread to the worker pool.
+ *
+ * The buffer is a circular array protected by a mutex semaphore, with a
+ * slots semaphore counting free slots and an items semaphore counting
+ * filled ones. The front and rear indices wrap around modulo the number
+ * of slots, so they never overflow however long the proxy runs.
+ * sbuf_insert blocks while the buffer is full, whereas sbuf_tryinsert
+ * fails immediately so the caller can shed load instead.
+ *
+ */
+
+#include "sbuf.h"
+
+/*
+ * sbuf_init: Creates an empty, bounded, shared FIFO buffer with n slots.
+ */
+void sbuf_init(sbuf_t *sp, int n) {
+  sp->buf = Calloc(n, sizeof(int));
+  sp->n = n;
+  sp->front = sp->rear = 0;
+  Sem_init(&sp->mutex, 0, 1);
+  Sem_init(&sp->slots, 0, n);
+  Sem_init(&sp->items, 0, 0);
+}
+
+/*
+ * sbuf_deinit: Cleans up buffer sp.
+ */
+void sbuf_deinit(sbuf_t *sp) {
+  free(sp->buf);
+}
+
+/*
+ * sbuf_insert: Inserts item onto the rear of shared buffer sp,
+ *              waiting for an available slot if it is full.
+ */
+void sbuf_insert(sbuf_t *sp, int item) {
+  P(&sp->slots);
+  P(&sp->mutex);
+  sp->rear = (sp->rear + 1) % sp->n;
+  sp->buf[sp->rear] = item;
+  V(&sp->mutex);
+  V(&sp->items);
+}
+
+/*
+ * sbuf_tryinsert: Inserts item onto the rear of shared buffer sp if there
+ *                 is an available slot. Returns 0 on success, and -1 if
+ *                 the buffer is full.
+ */
+int sbuf_tryinsert(sbuf_t *sp, int item) {
+  while(sem_trywait(&sp->slots) < 0) {
+    if(errno != EINTR)
+      return -1;
+  }
+  P(&sp->mutex);
+  sp->rear = (sp->rear + 1) % sp->n;
+  sp->buf[sp->rear] = item;
+  V(&sp->mutex);
+  V(&sp->items);
+  return 0;
+}
+
+/*
+ * sbuf_remove: Removes and returns the first item from buffer sp,
+ *              waiting for one to arrive if it is empty.
+ */
+int sbuf_remove(sbuf_t *sp) {
+  int item;
+  P(&sp->items);
+  P(&sp->mutex);
+  sp->front = (sp->front + 1) % sp->n;
+  item = sp->buf[sp->front];
+  V(&sp->mutex);
+  V(&sp->slots);
+  return item;
+}
@@ -0,0 +1,23 @@
+#ifndef __SBUF_H__
+#define __SBUF_H__
+
+#include "csapp.h"
+
+/* Bounded buffer of connection descriptors shared by the worker threads */
+typedef struct {
+  int *buf;     /* Buffer array */
+  int n;        /* Maximum number of slots */
+  int front;    /* buf[(front+1)%n] is first item, with front < n */
+  int rear;     /* buf[rear] is last item, with rear < n */
+  sem_t mutex;  /* Protects accesses to buf */
+  sem_t slots;  /* Counts available slots */
+  sem_t items;  /* Counts available items */
+} sbuf_t;
+
+void sbuf_init(sbuf_t *sp, int n);
+void sbuf_deinit(sbuf_t *sp);
+void sbuf_insert(sbuf_t *sp, int item);
+int sbuf_tryinsert(sbuf_t *sp, int item);
+int sbuf_remove(sbuf_t *sp);
+
+#endif /* __SBUF_H__ */
@@ -0,0 +1,227 @@
+/*
+ * segbuf.c
+ *
+ * Derek Tzeng
+ * dtzeng
+ *
+ * Segmented buffers for filling cache objects while a response streams in.
+ *
+ * A segbuf is a singly linked chain of fixed-size segments. Responses are
+ * read straight into the free space at the end of the last segment, and a
+ * new segment is chained on when it fills up, so a response is neither
+ * preallocated at the maximum object size nor copied again once complete:
+ * the chain itself becomes the cached object's storage. Small responses
+ * only ever touch one segment.
+ *
+ * Segments come from slab pools (see "slab.c"), so steady churn of cache
+ * objects reuses the same memory instead of going back to malloc. Since
+ * a response's size is not known until it is complete, its segments are
+ * all full size while it is read. A complete response that no one else
+ * is reading can then be trimmed, moving the data of its last segment
+ * into the smallest of the smaller segment sizes it fits in, so a small
+ * cached response does not hold on to a whole segment.
+ *
+ * Chains are sent with writev, gathering up to SEG_IOVS segments per call.
+ *
+ */
+
+#include "segbuf.h"
+
+/* Pools of segments, from the smallest trimmed size to full ones */
+static slab_pool pools[SEG_POOLS];
+static pthread_once_t pools_once = PTHREAD_ONCE_INIT;
+
+static void init_pools(void);
+
+/*
+ * seg_get: Returns an empty full size segment. The payload is not cleared.
+ */
+segment *seg_get(void) {
+  segment *seg;
+
+  pthread_once(&pools_once, init_pools);
+  seg = slab_alloc(&pools[SEG_POOLS - 1]);
+  seg->next = NULL;
+  seg->len = 0;
+  seg->cap = SEG_SIZE;
+  return seg;
+}
+
+/*
+ * seg_put: Returns a chain of segments to their pools.
+ */
+void seg_put(segment *seg) {
+  while(seg != NULL) {
+    segment *next = seg->next;
+    slab_free(seg);
+    seg = next;
+  }
+}
+
+/*
+ * segbuf_init: Initializes an empty buffer.
+ */
+void segbuf_init(segbuf *b) {
+  b->head = NULL;
+  b->tail = NULL;
+  b->size = 0;
+}
+
+/*
+ * segbuf_space: Returns the free space at the end of the buffer, chaining
+ *               on a new segment if the last one is full, and stores its
+ *               size in room.
+ */
+char *segbuf_space(segbuf *b, int *room) {
+  if(b->tail == NULL || b->tail->len == b->tail->cap) {
+    segment *seg = seg_get();
+    if(b->tail == NULL)
+      b->head = seg;
+    else
+      b->tail->next = seg;
+    b->tail = seg;
+  }
+  *room = b->tail->cap - b->tail->len;
+  return b->tail->data + b->tail->len;
+}
+
+/*
+ * segbuf_commit: Adds n bytes written into the space returned by
+ *                segbuf_space to the buffer.
+ */
+void segbuf_commit(segbuf *b, int n) {
+  b->tail->len += n;
+  b->size += n;
+}
+
+/*
+ * segbuf_append: Copies n bytes of data onto the end of the buffer.
+ */
+void segbuf_append(segbuf *b, char *data, int n) {
+  while(n > 0) {
+    int room;
+    char *space = segbuf_space(b, &room);
+    if(room > n)
+      room = n;
+    memcpy(space, data, room);
+    segbuf_commit(b, room);
+    data += room;
+    n -= room;
+  }
+}
+
+/*
+ * segbuf_free: Returns the buffer's segments to the pool and empties it.
+ */
+void segbuf_free(segbuf *b) {
+  seg_put(b->head);
+  segbuf_init(b);
+}
+
+/*
+ * segbuf_trim: Moves the data of the buffer's last segment into the
+ *              smallest segment it fits in, if that is smaller. Nothing
+ *              may be appended afterwards, and no one else may be reading
+ *              the buffer.
+ */
+void segbuf_trim(segbuf *b) {
+  segment *tail = b->tail, *seg, *prev;
+  int i;
+
+  if(tail == NULL)
+    return;
+  for(i = 0; i < SEG_POOLS - 1; i++) {
+    if(sizeof(segment) + tail->len <= pools[i].size)
+      break;
+  }
+  if(i == SEG_POOLS - 1)
+    return;
+
+  seg = slab_alloc(&pools[i]);
+  seg->next = NULL;
+  seg->len = tail->len;
+  seg->cap = pools[i].size - sizeof(segment);
+  memcpy(seg->data, tail->data, tail->len);
+  if(b->head == tail) {
+    b->head = seg;
+  }
+  else {
+    for(prev = b->head; prev->next != tail; prev = prev->next)
+      ;
+    prev->next = seg;
+  }
+  b->tail = seg;
+  slab_free(tail);
+}
+
+/*
+ * seg_iov: Fills iov with up to max entries describing the first size bytes
+ *          of the chain starting at seg, skipping its first skip bytes.
+ *          Returns the number of entries used.
+ *
+ *          Every segment of a chain but the last is full, so only size is
+ *          needed to find the data, and segments and lengths past it are
+ *          never read. This lets a chain that is still being filled be sent
+ *          up to a size published under a lock.
+ */
+int seg_iov(segment *seg, int skip, int size, struct iovec *iov, int max) {
+  int n = 0;
+
+  while(skip >= SEG_SIZE) {
+    seg = seg->next;
+    skip -= SEG_SIZE;
+    size -= SEG_SIZE;
+  }
+  while(size > skip && n < max) {
+    iov[n].iov_base = seg->data + skip;
+    iov[n].iov_len = (size < SEG_SIZE ? size : SEG_SIZE) - skip;
+    size -= SEG_SIZE;
+    skip = 0;
+    n++;
+    if(size > 0)
+      seg = seg->next;
+  }
+  return n;
+}
+
+/*
+ * seg_write: Writes as much of the first size bytes of the chain starting
+ *            at seg, after its first skip bytes, as fd accepts in one
+ *            writev. Returns the number of bytes written, or -1 on error.
+ */
+ssize_t seg_write(int fd, segment *seg, int skip, int size) {
+  struct iovec iov[SEG_IOVS];
+  int n = seg_iov(seg, skip, size, iov, SEG_IOVS);
+  ssize_t rc;
+
+  while((rc = writev(fd, iov, n)) < 0 && errno == EINTR)
+    ;
+  return rc;
+}
+
+/*
+ * seg_writen: Robustly writes the size bytes of the chain starting at seg.
+ *             Returns size on success, -1 on error.
+ */
+ssize_t seg_writen(int fd, segment *seg, int size) {
+  int sent = 0;
+
+  while(sent < size) {
+    ssize_t rc = seg_write(fd, seg, sent, size);
+    if(rc < 0)
+      return -1;
+    sent += rc;
+  }
+  return size;
+}
+
+/*
+ * init_pools: Creates the segment pools, once.
+ */
+static void init_pools(void) {
+  int i;
+
+  for(i = 0; i < SEG_POOLS - 1; i++)
+    slab_pool_init(&pools[i], SEG_TRIM_MIN << i);
+  slab_pool_init(&pools[SEG_POOLS - 1], sizeof(segment) + SEG_SIZE);
+}
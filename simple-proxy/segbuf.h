@@ -0,0 +1,49 @@
+#ifndef __SEGBUF_H__
+#define __SEGBUF_H__
+
+#include "csapp.h"
+#include "slab.h"
+#include <sys/uio.h>
+
+/* Payload bytes per segment */
+#define SEG_SIZE 4096
+
+/* Maximum number of segments gathered per writev */
+#define SEG_IOVS 64
+
+/* Block size of the smallest segments, which double in size up to the
+   full one, that the last segment of a complete response is trimmed to */
+#define SEG_TRIM_MIN 256
+
+/* Number of segment sizes, including the full one */
+#define SEG_POOLS 5
+
+typedef struct segment segment;
+
+struct segment {
+  segment *next;
+  int len;
+  int cap;            /* Payload bytes, SEG_SIZE unless trimmed */
+  char data[];
+};
+
+/* A growable buffer made of a chain of segments */
+typedef struct {
+  segment *head;
+  segment *tail;
+  int size;
+} segbuf;
+
+segment *seg_get(void);
+void seg_put(segment *seg);
+void segbuf_init(segbuf *b);
+char *segbuf_space(segbuf *b, int *room);
+void segbuf_commit(segbuf *b, int n);
+void segbuf_append(segbuf *b, char *data, int n);
+void segbuf_free(segbuf *b);
+void segbuf_trim(segbuf *b);
+int seg_iov(segment *seg, int skip, int size, struct iovec *iov, int max);
+ssize_t seg_write(int fd, segment *seg, int skip, int size);
+ssize_t seg_writen(int fd, segment *seg, int size);
+
+#endif /* __SEGBUF_H__ */
@@ -0,0 +1,151 @@
+/*
+ * sketch.c
+ *
+ * Derek Tzeng
+ * dtzeng
+ *
+ * Count-min sketch of request frequencies, for TinyLFU admission.
+ *
+ * The sketch estimates how often each request has been seen recently in
+ * a fixed amount of memory. It has SKETCH_DEPTH rows of small counters,
+ * and a request bumps one counter per row, picked by a different mix of
+ * its hash. Collisions can only inflate a counter, so the smallest of a
+ * request's counters is the estimate. Only the counters equal to that
+ * minimum are bumped (a conservative update), which keeps collisions from
+ * inflating the other counters further.
+ *
+ * Counters stop at SKETCH_MAX, and once the sketch has seen
+ * SKETCH_SAMPLE_FACTOR additions per counter in a row, every counter is
+ * halved, so requests that were popular long ago fade away and the
+ * estimates follow the current workload.
+ *
+ * Additions come from lookups, which hold no lock, so counters are
+ * updated with relaxed atomic operations. Races can lose an update now
+ * and then, which only makes an estimate slightly low.
+ *
+ */
+
+#include "sketch.h"
+
+static int sketch_width(int64_t capacity);
+static int row_index(sketch *K, uint64_t hash, int row);
+static void age(sketch *K);
+
+/*
+ * sketch_new: Allocates an empty sketch sized for a cache of capacity
+ *             bytes, and returns it.
+ */
+sketch *sketch_new(int64_t capacity) {
+  sketch *K = Malloc(sizeof(sketch));
+
+  K->width = sketch_width(capacity);
+  K->counters = Calloc(SKETCH_DEPTH * K->width, 1);
+  K->additions = 0;
+  K->sample = (long)SKETCH_SAMPLE_FACTOR * K->width;
+  return K;
+}
+
+/*
+ * sketch_free: Frees the sketch.
+ */
+void sketch_free(sketch *K) {
+  free(K->counters);
+  free(K);
+}
+
+/*
+ * sketch_add: Counts one more occurrence of the hash, and ages the sketch
+ *             once enough have been counted.
+ */
+void sketch_add(sketch *K, uint64_t hash) {
+  unsigned char *c[SKETCH_DEPTH];
+  int min = SKETCH_MAX;
+  int row, v;
+
+  for(row = 0; row < SKETCH_DEPTH; row++) {
+    c[row] = &K->counters[row * K->width + row_index(K, hash, row)];
+    v = __atomic_load_n(c[row], __ATOMIC_RELAXED);
+    if(v < min)
+      min = v;
+  }
+  if(min < SKETCH_MAX) {
+    for(row = 0; row < SKETCH_DEPTH; row++) {
+      if(__atomic_load_n(c[row], __ATOMIC_RELAXED) == min)
+        __atomic_store_n(c[row], min + 1, __ATOMIC_RELAXED);
+    }
+  }
+
+  /* Exactly one caller sees the count reach the sample size */
+  if(__atomic_add_fetch(&K->additions, 1, __ATOMIC_RELAXED) == K->sample)
+    age(K);
+}
+
+/*
+ * sketch_estimate: Returns the estimated number of recent occurrences of
+ *                  the hash.
+ */
+int sketch_estimate(sketch *K, uint64_t hash) {
+  int min = SKETCH_MAX;
+  int row, v;
+
+  for(row = 0; row < SKETCH_DEPTH; row++) {
+    v = __atomic_load_n(&K->counters[row * K->width +
+                                     row_index(K, hash, row)],
+                        __ATOMIC_RELAXED);
+    if(v < min)
+      min = v;
+  }
+  return min;
+}
+
+/*
+ * sketch_bytes: Returns the bytes of memory the sketch takes up.
+ */
+long sketch_bytes(sketch *K) {
+  return sizeof(sketch) + (long)SKETCH_DEPTH * K->width;
+}
+
+/*
+ * sketch_capacity_bytes: Returns the bytes of memory a sketch sized for a
+ *                        cache of capacity bytes takes up.
+ */
+long sketch_capacity_bytes(int64_t capacity) {
+  return sizeof(sketch) + (long)SKETCH_DEPTH * sketch_width(capacity);
+}
+
+/*
+ * sketch_width: Returns the counters per row of a sketch sized for a cache
+ *               of capacity bytes.
+ */
+static int sketch_width(int64_t capacity) {
+  int width = SKETCH_MIN_WIDTH;
+
+  while(width < capacity / SKETCH_BYTES_PER_COUNTER)
+    width *= 2;
+  return width;
+}
+
+/*
+ * row_index: Returns the counter of the hash in the given row.
+ */
+static int row_index(sketch *K, uint64_t hash, int row) {
+  uint64_t h = hash + (uint64_t)(row + 1) * 0x9e3779b97f4a7c15ULL;
+
+  /* Mix non-linearly, so requests colliding in one row rarely do in all */
+  h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+  return (h ^ (h >> 31)) & (K->width - 1);
+}
+
+/*
+ * age: Halves every counter and restarts the count of additions.
+ */
+static void age(sketch *K) {
+  int i;
+
+  for(i = 0; i < SKETCH_DEPTH * K->width; i++) {
+    unsigned char v = __atomic_load_n(&K->counters[i], __ATOMIC_RELAXED);
+    __atomic_store_n(&K->counters[i], v >> 1, __ATOMIC_RELAXED);
+  }
+  __atomic_store_n(&K->additions, 0, __ATOMIC_RELAXED);
+}
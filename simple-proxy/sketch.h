@@ -0,0 +1,37 @@
+#ifndef __SKETCH_H__
+#define __SKETCH_H__
+
+#include "csapp.h"
+#include <stdint.h>
+
+/* Number of rows of counters, each indexed by a different hash */
+#define SKETCH_DEPTH 4
+
+/* Largest count a counter holds */
+#define SKETCH_MAX 15
+
+/* Minimum number of counters per row (must be a power of two) */
+#define SKETCH_MIN_WIDTH 256
+
+/* Cache bytes per counter in a row */
+#define SKETCH_BYTES_PER_COUNTER 512
+
+/* Counters are halved after this many additions per counter in a row */
+#define SKETCH_SAMPLE_FACTOR 10
+
+/* A count-min sketch of request frequencies */
+typedef struct {
+  unsigned char *counters;
+  int width;
+  long additions;
+  long sample;
+} sketch;
+
+sketch *sketch_new(int64_t capacity);
+void sketch_free(sketch *K);
+void sketch_add(sketch *K, uint64_t hash);
+int sketch_estimate(sketch *K, uint64_t hash);
+long sketch_bytes(sketch *K);
+long sketch_capacity_bytes(int64_t capacity);
+
+#endif /* __SKETCH_H__ */
@@ -0,0 +1,279 @@
+/*
+ * slab.c
+ *
+ * Derek Tzeng
+ * dtzeng
+ *
+ * Slab allocator for the cache's storage.
+ *
+ * Cache objects, their requests, and the segments holding their responses
+ * are allocated and freed constantly by every thread as objects come and
+ * go. With malloc, they end up scattered across the arenas of many
+ * threads, which fragments over time and keeps memory that the cache no
+ * longer uses. Instead, each kind of block comes from a pool of slabs:
+ * SLAB_SIZE byte regions mapped straight from the kernel and carved into
+ * blocks of a single size. A slab is aligned to its size, so the slab,
+ * and with it the pool, of any block is found by masking its address.
+ *
+ * Each pool keeps a list of the slabs with room, and allocates from the
+ * first one. Blocks never handed out are carved off lazily, so the pages
+ * of a new slab are only touched as they are needed. When eviction frees
+ * the last block of a slab, the whole slab is unmapped, unless it is the
+ * pool's only slab with room, so memory goes back to the kernel as the
+ * cache shrinks and stays flat under churn.
+ *
+ * To keep threads from contending on a pool's lock, every thread keeps a
+ * magazine of up to SLAB_MAGAZINE free blocks per pool. Allocations and
+ * frees are served from the magazine, and only refilling an empty one or
+ * draining a full one takes the lock, half a magazine at a time. A thread
+ * returns its magazines to the pools when it exits.
+ *
+ */
+
+#include "slab.h"
+#include <sys/mman.h>
+
+/* Bytes at the start of a slab taken by its header */
+#define SLAB_HEADER ((sizeof(slab) + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1))
+
+static slab_pool *pools[SLAB_MAX_POOLS];
+static int num_pools = 0;
+static pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Each thread's magazines of free blocks, one per pool */
+static __thread void *magazine[SLAB_MAX_POOLS][SLAB_MAGAZINE];
+static __thread int loaded[SLAB_MAX_POOLS];
+static __thread int registered = 0;
+static pthread_key_t flush_key;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+
+static slab *slab_of(void *block);
+static slab *slab_new(slab_pool *P);
+static void *take(slab_pool *P);
+static void give(void *block);
+static int full(slab *S);
+static void link_slab(slab_pool *P, slab *S);
+static void unlink_slab(slab_pool *P, slab *S);
+static void register_thread(void);
+static void make_key(void);
+static void flush(void *unused);
+
+/*
+ * slab_pool_init: Initializes an empty pool of blocks of at least size
+ *                 bytes.
+ */
+void slab_pool_init(slab_pool *P, int size) {
+  P->size = (size + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1);
+  if(P->size > SLAB_SIZE - SLAB_HEADER)
+    app_error("slab_pool_init error: block too large");
+  pthread_mutex_init(&P->lock, NULL);
+  P->partial = NULL;
+  P->slabs = 0;
+
+  pthread_mutex_lock(&pools_lock);
+  if(num_pools == SLAB_MAX_POOLS)
+    app_error("slab_pool_init error: too many pools");
+  P->id = num_pools;
+  pools[num_pools++] = P;
+  pthread_mutex_unlock(&pools_lock);
+}
+
+/*
+ * slab_alloc: Returns a block from the pool, refilling the thread's
+ *             magazine first if it is empty.
+ */
+void *slab_alloc(slab_pool *P) {
+  int n;
+
+  if(loaded[P->id] == 0) {
+    register_thread();
+    pthread_mutex_lock(&P->lock);
+    for(n = 0; n < SLAB_MAGAZINE / 2; n++)
+      magazine[P->id][n] = take(P);
+    pthread_mutex_unlock(&P->lock);
+    loaded[P->id] = n;
+  }
+  return magazine[P->id][--loaded[P->id]];
+}
+
+/*
+ * slab_free: Returns a block to its pool, through the thread's magazine,
+ *            draining half of it first if it is full. Ignores NULL.
+ */
+void slab_free(void *block) {
+  slab_pool *P;
+  int n;
+
+  if(block == NULL)
+    return;
+  P = slab_of(block)->pool;
+  if(loaded[P->id] == 0) {
+    register_thread();
+  }
+  else if(loaded[P->id] == SLAB_MAGAZINE) {
+    pthread_mutex_lock(&P->lock);
+    for(n = 0; n < SLAB_MAGAZINE / 2; n++)
+      give(magazine[P->id][--loaded[P->id]]);
+    pthread_mutex_unlock(&P->lock);
+  }
+  magazine[P->id][loaded[P->id]++] = block;
+}
+
+/*
+ * slab_block_size: Returns the size of the pool's blocks that the block
+ *                  was allocated from.
+ */
+int slab_block_size(void *block) {
+  return slab_of(block)->pool->size;
+}
+
+/*
+ * slab_of: Returns the slab the block is in.
+ */
+static slab *slab_of(void *block) {
+  return (slab *)((uintptr_t)block & ~(uintptr_t)(SLAB_SIZE - 1));
+}
+
+/*
+ * slab_new: Maps a new, empty slab for the pool and adds it to the
+ *           pool's slabs with room. The caller holds the pool's lock.
+ */
+static slab *slab_new(slab_pool *P) {
+  char *map, *start;
+  slab *S;
+
+  /* Map twice the size, then unmap around an aligned slab */
+  if((map = mmap(NULL, 2 * SLAB_SIZE, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+    unix_error("mmap error");
+  start = (char *)(((uintptr_t)map + SLAB_SIZE - 1) &
+                   ~(uintptr_t)(SLAB_SIZE - 1));
+  if(start > map)
+    munmap(map, start - map);
+  munmap(start + SLAB_SIZE, map + SLAB_SIZE - start);
+
+  S = (slab *)start;
+  S->pool = P;
+  S->free = NULL;
+  S->unused = start + SLAB_HEADER;
+  S->used = 0;
+  link_slab(P, S);
+  P->slabs++;
+  return S;
+}
+
+/*
+ * take: Takes a block from the pool's first slab with room, mapping a new
+ *       slab if there is none. The caller holds the pool's lock.
+ */
+static void *take(slab_pool *P) {
+  slab *S = (P->partial != NULL) ? P->partial : slab_new(P);
+  void *block;
+
+  if((block = S->free) != NULL) {
+    S->free = *(void **)block;
+  }
+  else {
+    block = S->unused;
+    S->unused += P->size;
+  }
+  S->used++;
+
+  /* A full slab leaves the list until one of its blocks is freed */
+  if(full(S))
+    unlink_slab(P, S);
+  return block;
+}
+
+/*
+ * give: Puts a block back in its slab, and unmaps the slab if it is now
+ *       empty and the pool has other slabs with room. The caller holds
+ *       the pool's lock.
+ */
+static void give(void *block) {
+  slab *S = slab_of(block);
+  slab_pool *P = S->pool;
+
+  if(full(S))
+    link_slab(P, S);
+  *(void **)block = S->free;
+  S->free = block;
+  S->used--;
+
+  if(S->used == 0 && (S->prev != NULL || S->next != NULL)) {
+    unlink_slab(P, S);
+    munmap(S, SLAB_SIZE);
+    P->slabs--;
+  }
+}
+
+/*
+ * full: Returns 1 if the slab has no blocks left to hand out, or 0
+ *       otherwise.
+ */
+static int full(slab *S) {
+  return (S->free == NULL &&
+          S->unused + S->pool->size > (char *)S + SLAB_SIZE);
+}
+
+/*
+ * link_slab: Adds the slab to the front of the pool's slabs with room.
+ */
+static void link_slab(slab_pool *P, slab *S) {
+  S->prev = NULL;
+  S->next = P->partial;
+  if(P->partial != NULL)
+    P->partial->prev = S;
+  P->partial = S;
+}
+
+/*
+ * unlink_slab: Removes the slab from the pool's slabs with room.
+ */
+static void unlink_slab(slab_pool *P, slab *S) {
+  if(S->prev != NULL)
+    S->prev->next = S->next;
+  else
+    P->partial = S->next;
+  if(S->next != NULL)
+    S->next->prev = S->prev;
+  S->prev = NULL;
+  S->next = NULL;
+}
+
+/*
+ * register_thread: Arranges for the calling thread's magazines to be
+ *                  flushed when it exits, the first time it uses one.
+ */
+static void register_thread(void) {
+  if(registered)
+    return;
+  pthread_once(&key_once, make_key);
+  pthread_setspecific(flush_key, &registered);
+  registered = 1;
+}
+
+/*
+ * make_key: Creates the key whose destructor flushes a thread's
+ *           magazines.
+ */
+static void make_key(void) {
+  pthread_key_create(&flush_key, flush);
+}
+
+/*
+ * flush: Returns every block in the exiting thread's magazines to its
+ *        pool.
+ */
+static void flush(void *unused) {
+  int id;
+
+  for(id = 0; id < num_pools; id++) {
+    if(loaded[id] == 0)
+      continue;
+    pthread_mutex_lock(&pools[id]->lock);
+    while(loaded[id] > 0)
+      give(magazine[id][--loaded[id]]);
+    pthread_mutex_unlock(&pools[id]->lock);
+  }
+}
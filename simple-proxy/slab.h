@@ -0,0 +1,46 @@
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+#include "csapp.h"
+#include <stdint.h>
+
+/* Bytes per slab, which slabs are also aligned to (a power of two) */
+#define SLAB_SIZE (256 * 1024)
+
+/* Alignment of the blocks in a slab */
+#define SLAB_ALIGN 16
+
+/* Free blocks each thread keeps per pool before returning them */
+#define SLAB_MAGAZINE 32
+
+/* Most pools that can be created */
+#define SLAB_MAX_POOLS 32
+
+typedef struct slab slab;
+typedef struct slab_pool slab_pool;
+
+/* A slab of equal blocks, with this header at its start */
+struct slab {
+  slab_pool *pool;
+  slab *prev;         /* Links in the pool's list of slabs with room */
+  slab *next;
+  void *free;         /* Freed blocks, linked through their first word */
+  char *unused;       /* Start of the blocks never handed out */
+  int used;           /* Blocks handed out, including those in magazines */
+};
+
+/* Slabs of blocks of one size */
+struct slab_pool {
+  int size;           /* Bytes per block */
+  int id;             /* Index of the pool's magazines */
+  pthread_mutex_t lock;
+  slab *partial;      /* Slabs with room */
+  long slabs;         /* Slabs mapped */
+};
+
+void slab_pool_init(slab_pool *P, int size);
+void *slab_alloc(slab_pool *P);
+void slab_free(void *block);
+int slab_block_size(void *block);
+
+#endif /* __SLAB_H__ */
@@ -0,0 +1,278 @@
+/*
+ * snapshot.c
+ *
+ * Derek Tzeng
+ * dtzeng
+ *
+ * Snapshots of the cache, so a restarted proxy starts warm.
+ *
+ * A snapshot is a header followed by one record per cached object,
+ * holding the request, the response, and when it goes stale along with
+ * its validators. Each shard's objects are written
+ * from least to most recently accessed, so loading the records in file
+ * order rebuilds each shard's recency order. Objects are pinned under the
+ * shard's lock and written after it is dropped, so serving goes on
+ * while a snapshot is taken. The snapshot is written to a temporary file
+ * and renamed over the old one, so a crash mid-write never leaves a torn
+ * snapshot behind.
+ *
+ * Snapshots are written by a thread of their own, which waits on a
+ * semaphore that snapshot_request posts, so they can be asked for from a
+ * signal handler.
+ *
+ * At startup the snapshot is mapped into memory, and a background thread
+ * inserts its records into the cache while the proxy already accepts
+ * connections, so loaded objects are served as soon as they are inserted
+ * instead of after the whole snapshot has been read.
+ *
+ */
+
+#include "snapshot.h"
+#include <sys/mman.h>
+
+/* Snapshot being loaded */
+typedef struct {
+  cache *C;
+  char *map;
+  long size;
+  int max_object;
+} loader;
+
+static cache *snap_cache = NULL;
+static char *snap_path = NULL;
+static sem_t pending;
+static volatile sig_atomic_t exit_after = 0;
+
+static void *saver(void *vargp);
+static void *load(void *vargp);
+static void copy_string(char *dst, char *src, int len);
+
+/*
+ * snapshot_init: Starts the thread that writes snapshots of the cache to
+ *                path whenever snapshot_request is called.
+ */
+void snapshot_init(cache *C, char *path) {
+  pthread_t tid;
+
+  snap_cache = C;
+  snap_path = path;
+  Sem_init(&pending, 0, 0);
+  Pthread_create(&tid, NULL, saver, NULL);
+}
+
+/*
+ * snapshot_request: Asks for a snapshot to be written, and for the proxy
+ *                   to exit afterwards if then_exit is set. Safe to call
+ *                   from a signal handler.
+ */
+void snapshot_request(int then_exit) {
+  if(then_exit)
+    exit_after = 1;
+  V(&pending);
+}
+
+/*
+ * snapshot_save: Writes every object in the cache to a snapshot at path.
+ *                Returns the number of objects written, or -1 on error.
+ */
+int snapshot_save(cache *C, char *path) {
+  char tmp[MAXLINE];
+  snap_header hdr;
+  FILE *fp;
+  int count = 0;
+  int i, j, ok;
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  if((fp = fopen(tmp, "w")) == NULL)
+    return -1;
+  hdr.magic = SNAP_MAGIC;
+  hdr.version = SNAP_VERSION;
+  ok = (fwrite(&hdr, sizeof(hdr), 1, fp) == 1);
+
+  for(i = 0; i < C->num_shards && ok; i++) {
+    shard *S = &C->shards[i];
+    object **objs, *obj;
+    int n = 0;
+
+    /* Pin the shard's objects from LRA to MRA, then drop the lock */
+    pthread_mutex_lock(&S->lock);
+    objs = Malloc((S->num_objects + 1) * sizeof(object *));
+    for(obj = S->LRA; obj != NULL; obj = obj->prev) {
+      __atomic_add_fetch(&obj->refcount, 1, __ATOMIC_RELAXED);
+      objs[n++] = obj;
+    }
+    pthread_mutex_unlock(&S->lock);
+
+    for(j = 0; j < n; j++) {
+      snap_record rec;
+      segment *seg;
+      int left;
+
+      obj = objs[j];
+      rec.magic = SNAP_RECORD_MAGIC;
+      rec.req_len = strlen(obj->request);
+      rec.size = obj->size;
+      rec.etag_len = (obj->etag != NULL) ? strlen(obj->etag) : 0;
+      rec.modified_len = (obj->last_modified != NULL) ?
+                         strlen(obj->last_modified) : 0;
+      rec.expires = __atomic_load_n(&obj->expires, __ATOMIC_RELAXED);
+      if(ok) {
+        ok = (fwrite(&rec, sizeof(rec), 1, fp) == 1 &&
+              fwrite(obj->request, 1, rec.req_len, fp) == rec.req_len &&
+              fwrite(obj->etag, 1, rec.etag_len, fp) == rec.etag_len &&
+              fwrite(obj->last_modified, 1, rec.modified_len, fp) ==
+              rec.modified_len);
+        left = obj->size;
+        for(seg = obj->response; ok && seg != NULL && left > 0;
+            seg = seg->next) {
+          int len = (seg->len < left) ? seg->len : left;
+          ok = (fwrite(seg->data, 1, len, fp) == len);
+          left -= len;
+        }
+        count++;
+      }
+      release_object(obj);
+    }
+    free(objs);
+  }
+
+  if(fflush(fp) != 0 || fsync(fileno(fp)) < 0)
+    ok = 0;
+  if(fclose(fp) != 0)
+    ok = 0;
+  if(!ok || rename(tmp, path) < 0) {
+    unlink(tmp);
+    return -1;
+  }
+  return count;
+}
+
+/*
+ * snapshot_load: Maps the snapshot at path and starts inserting its
+ *                objects into the cache in the background, skipping any
+ *                larger than max_object. Returns 0 if loading started, or
+ *                -1 if there is no valid snapshot.
+ */
+int snapshot_load(cache *C, char *path, int max_object) {
+  struct stat st;
+  snap_header *hdr;
+  loader *L;
+  pthread_t tid;
+  char *map;
+  int fd;
+
+  if((fd = open(path, O_RDONLY)) < 0)
+    return -1;
+  if(fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(snap_header)) {
+    close(fd);
+    return -1;
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(map == MAP_FAILED)
+    return -1;
+
+  hdr = (snap_header *)map;
+  if(hdr->magic != SNAP_MAGIC || hdr->version != SNAP_VERSION) {
+    munmap(map, st.st_size);
+    return -1;
+  }
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+  L = Malloc(sizeof(loader));
+  L->C = C;
+  L->map = map;
+  L->size = st.st_size;
+  L->max_object = max_object;
+  Pthread_create(&tid, NULL, load, L);
+  return 0;
+}
+
+/*
+ * saver: Snapshot thread routine. Writes a snapshot each time one is
+ *        requested, and exits the proxy afterwards if asked to.
+ */
+static void *saver(void *vargp) {
+  int count;
+
+  Pthread_detach(pthread_self());
+  while(1) {
+    P(&pending);
+    if((count = snapshot_save(snap_cache, snap_path)) < 0)
+      fprintf(stderr, "snapshot: cannot write %s\n", snap_path);
+    else
+      fprintf(stderr, "snapshot: saved %d objects\n", count);
+    if(exit_after)
+      exit(0);
+  }
+  return NULL;
+}
+
+/*
+ * load: Loader thread routine. Inserts the records of a mapped snapshot
+ *       into the cache in file order, stopping at the first damaged one,
+ *       then unmaps the snapshot.
+ */
+static void *load(void *vargp) {
+  loader *L = (loader *)vargp;
+  long off = sizeof(snap_header);
+  int count = 0;
+
+  Pthread_detach(pthread_self());
+  while(off + (long)sizeof(snap_record) <= L->size) {
+    snap_record rec;
+    object *obj;
+    segbuf body;
+    char req[MAXLINE], etag[MAXLINE], modified[MAXLINE];
+    int skip;
+
+    memcpy(&rec, L->map + off, sizeof(rec));
+    if(rec.magic != SNAP_RECORD_MAGIC || rec.req_len >= MAXLINE ||
+       rec.etag_len >= MAXLINE || rec.modified_len >= MAXLINE ||
+       off + (long)sizeof(rec) + rec.req_len + rec.etag_len +
+       rec.modified_len + rec.size > L->size)
+      break;
+    off += sizeof(rec);
+
+    copy_string(req, L->map + off, rec.req_len);
+    off += rec.req_len;
+    copy_string(etag, L->map + off, rec.etag_len);
+    off += rec.etag_len;
+    copy_string(modified, L->map + off, rec.modified_len);
+    off += rec.modified_len;
+
+    /*
+     * Skip anything fetched since startup, which is fresher. This only
+     * saves copying the body, since a fetch may still finish before the
+     * object is stored, which is checked again under the shard's lock.
+     */
+    skip = (rec.size == 0 || rec.size > L->max_object ||
+            cache_contains(L->C, req));
+    if(skip) {
+      off += rec.size;
+      continue;
+    }
+
+    segbuf_init(&body);
+    segbuf_append(&body, L->map + off, rec.size);
+    segbuf_trim(&body);
+    off += rec.size;
+    obj = new_object(req, body.head, body.size);
+    obj->expires = rec.expires;
+    object_validators(obj, etag, modified);
+    count += cache_store_absent(L->C, obj);
+  }
+
+  fprintf(stderr, "snapshot: loaded %d objects\n", count);
+  munmap(L->map, L->size);
+  free(L);
+  return NULL;
+}
+
+/*
+ * copy_string: Copies the len bytes at src into dst as a string.
+ */
+static void copy_string(char *dst, char *src, int len) {
+  memcpy(dst, src, len);
+  dst[len] = '\0';
+}
@@ -0,0 +1,38 @@
+#ifndef __SNAPSHOT_H__
+#define __SNAPSHOT_H__
+
+#include "csapp.h"
+#include "cache.h"
+
+/* Marks the start of a snapshot file and of every record in it */
+#define SNAP_MAGIC 0x50414e53
+#define SNAP_RECORD_MAGIC 0x4a424f53
+
+/* Version of the snapshot format */
+#define SNAP_VERSION 2
+
+/* Header of a snapshot file */
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+} snap_header;
+
+/*
+ * Header of a record, followed by the request, the ETag, the Last-Modified
+ * date, and the response
+ */
+typedef struct {
+  uint32_t magic;
+  uint32_t req_len;
+  uint32_t size;
+  uint32_t etag_len;
+  uint32_t modified_len;
+  int64_t expires;
+} snap_record;
+
+void snapshot_init(cache *C, char *path);
+int snapshot_save(cache *C, char *path);
+int snapshot_load(cache *C, char *path, int max_object);
+void snapshot_request(int then_exit);
+
+#endif /* __SNAPSHOT_H__ */
@@ -0,0 +1,786 @@
+/*
+ * uring.c
+ *
+ * Derek Tzeng
+ * dtzeng
+ *
+ * An io_uring engine for the proxy, selected with "-e uring". Every socket
+ * operation (accept, recv, connect, send, read) is queued as a submission
+ * on a ring shared with the kernel, and all submissions queued while
+ * handling a batch of completions go to the kernel in a single
+ * io_uring_enter call, which also waits for the next completions. This
+ * replaces the read/write syscall per buffer of the other engines.
+ *
+ * The ring is driven directly through the io_uring_setup, io_uring_enter
+ * and io_uring_register system calls and the kernel's <linux/io_uring.h>,
+ * so no extra library is needed.
+ *
+ * Each of the -t threads owns a ring. On it the thread posts a multishot
+ * accept on the shared listening socket, which keeps producing a completion
+ * per new connection. Origin responses are read with IORING_OP_READ_FIXED
+ * into buffers registered with the ring, so the kernel does not have to map
+ * the user pages on every read. A cache hit is sent with a single sendmsg
+ * gathering its segments, linked to a close of the client socket, so the
+ * whole hit costs one submission.
+ *
+ * Server names missing from the DNS cache are resolved on the resolver
+ * threads rather than the ring's own. Each ring keeps a read of its DNS
+ * pipe in flight, and the resolvers write finished lookups to the pipe, so
+ * their completions arrive on the ring like those of any other operation.
+ *
+ * A connection has at most one operation in flight, counting a lookup on
+ * a resolver thread, except for the linked send and close of a hit, so the
+ * connection is freed once the operation that finishes it completes.
+ *
+ * If the kernel lacks io_uring or one of the operations above, uring_run
+ * fails before serving anything, and the proxy falls back to the thread
+ * engine.
+ *
+ */
+
+#define _GNU_SOURCE
+#include "proxy.h"
+#include "refresh.h"
+#include "uring.h"
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+/* Submission queue entries per ring */
+#define RING_ENTRIES 256
+
+/* Registered buffers per ring for reading origin responses */
+#define FIXED_BUFS 64
+
+/* Finished lookups taken from the DNS pipe per read */
+#define DNS_BATCH 32
+
+/*
+ * Operations, stored in the low bits of the user data of a submission,
+ * which are free since connections come from malloc and are 16-byte
+ * aligned
+ */
+#define OP_ACCEPT 0
+#define OP_RECV 1
+#define OP_CONNECT 2
+#define OP_SEND_SERVER 3
+#define OP_READ_SERVER 4
+#define OP_SEND_CLIENT 5
+#define OP_SEND_HIT 6
+#define OP_CLOSE 7
+#define OP_DNS 8
+#define OP_MASK 15
+
+typedef struct ring ring;
+typedef struct uconn uconn;
+
+struct ring {
+  int fd;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+  unsigned to_submit;
+
+  int listenfd;
+  int multishot;
+
+  /* Pipe the resolver threads write finished lookups to */
+  int dnsfd[2];
+  dns_query *dns_done[DNS_BATCH];
+
+  /* Registered buffers and the indices of the free ones */
+  char *bufs;
+  int free_bufs[FIXED_BUFS];
+  int num_free;
+};
+
+struct uconn {
+  ring *R;
+  int clientfd;
+  int serverfd;
+  int pending;
+  int failed;
+
+  /* Request from the client */
+  char in[MAXLINE];
+  int in_len;
+  char request[MAXLINE];
+
+  /* Rewritten request to the server */
+  char *out;
+  int out_len;
+  int out_pos;
+  dns_addrs addrs;
+  int next_addr;
+
+  /* Cached object being sent on a hit */
+  object *hit;
+  int hit_pos;
+  int hit_linked;
+  struct iovec hit_iov[SEG_IOVS];
+  struct msghdr hit_msg;
+
+  /* Response being relayed on a miss */
+  char *relay;
+  int buf_index;
+  int relay_len;
+  int relay_pos;
+  segbuf response;
+  int cacheable;
+  framing frame;
+};
+
+static int ring_init(ring *R, int listenfd);
+static struct io_uring_sqe *get_sqe(ring *R);
+static int ring_enter(ring *R, unsigned wait_nr);
+static void *ring_loop(void *vargp);
+static void run_ring(ring *R);
+static void handle_cqe(ring *R, uint64_t data, int res, unsigned flags);
+static void queue_accept(ring *R);
+static void queue_dns(ring *R);
+static void queue_recv(uconn *c);
+static void queue_hit(uconn *c);
+static void queue_connect(uconn *c);
+static void queue_send(uconn *c, int op, int fd, char *buf, int len);
+static void queue_read(uconn *c);
+static void start_request(uconn *c);
+static void finish_resolve(ring *R, int res);
+static void start_relay(uconn *c);
+static void relay_chunk(uconn *c, int n);
+static void finish_conn(uconn *c);
+
+/*
+ * uring_run: Starts an io_uring event loop on the listening socket in each
+ *            of the given number of threads. Returns -1 without serving
+ *            anything if the kernel does not support the engine, and never
+ *            returns otherwise.
+ */
+int uring_run(int listenfd, int loops) {
+  ring *R = Malloc(sizeof(ring));
+  pthread_t tid;
+  int i;
+
+  if(ring_init(R, listenfd) < 0) {
+    free(R);
+    return -1;
+  }
+  for(i = 1; i < loops; i++) {
+    Pthread_create(&tid, NULL, ring_loop, &listenfd);
+  }
+  run_ring(R);
+  return 0;
+}
+
+/*
+ * ring_loop: Thread routine for the additional rings.
+ */
+static void *ring_loop(void *vargp) {
+  ring *R = Malloc(sizeof(ring));
+
+  if(ring_init(R, *((int *)vargp)) < 0)
+    unix_error("io_uring setup error");
+  run_ring(R);
+  return NULL;
+}
+
+/*
+ * ring_init: Sets up a ring, maps its queues, checks that the kernel
+ *            supports every operation the engine uses, and registers the
+ *            relay buffers. Returns 0 on success, -1 on error.
+ */
+static int ring_init(ring *R, int listenfd) {
+  struct io_uring_params p;
+  struct io_uring_probe *probe;
+  struct iovec iov[FIXED_BUFS];
+  size_t sq_size, cq_size, probe_size;
+  char *sq_ptr, *cq_ptr;
+  int ops[] = {IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_CONNECT,
+               IORING_OP_SEND, IORING_OP_SENDMSG, IORING_OP_READ_FIXED,
+               IORING_OP_CLOSE, IORING_OP_READ};
+  int i;
+
+  memset(&p, 0, sizeof(p));
+  if((R->fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &p)) < 0)
+    return -1;
+
+  /* Completions must never be dropped, or connections would leak */
+  if(!(p.features & IORING_FEAT_NODROP)) {
+    close(R->fd);
+    return -1;
+  }
+
+  /* Check the opcodes against the kernel's probe */
+  probe_size = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+  probe = Calloc(1, probe_size);
+  if(syscall(__NR_io_uring_register, R->fd, IORING_REGISTER_PROBE,
+             probe, 256) < 0) {
+    free(probe);
+    close(R->fd);
+    return -1;
+  }
+  for(i = 0; i < (int)(sizeof(ops) / sizeof(ops[0])); i++) {
+    if(ops[i] > probe->last_op ||
+       !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+      free(probe);
+      close(R->fd);
+      return -1;
+    }
+  }
+  free(probe);
+
+  /* Map the submission and completion queues */
+  sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if(p.features & IORING_FEAT_SINGLE_MMAP) {
+    if(cq_size > sq_size)
+      sq_size = cq_size;
+    cq_size = sq_size;
+  }
+  sq_ptr = mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, R->fd, IORING_OFF_SQ_RING);
+  if(sq_ptr == MAP_FAILED) {
+    close(R->fd);
+    return -1;
+  }
+  if(p.features & IORING_FEAT_SINGLE_MMAP) {
+    cq_ptr = sq_ptr;
+  }
+  else {
+    cq_ptr = mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, R->fd, IORING_OFF_CQ_RING);
+    if(cq_ptr == MAP_FAILED) {
+      close(R->fd);
+      return -1;
+    }
+  }
+  R->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                 R->fd, IORING_OFF_SQES);
+  if(R->sqes == MAP_FAILED) {
+    close(R->fd);
+    return -1;
+  }
+
+  R->sq_head = (unsigned *)(sq_ptr + p.sq_off.head);
+  R->sq_tail = (unsigned *)(sq_ptr + p.sq_off.tail);
+  R->sq_mask = *(unsigned *)(sq_ptr + p.sq_off.ring_mask);
+  R->sq_entries = p.sq_entries;
+  R->sq_array = (unsigned *)(sq_ptr + p.sq_off.array);
+  R->cq_head = (unsigned *)(cq_ptr + p.cq_off.head);
+  R->cq_tail = (unsigned *)(cq_ptr + p.cq_off.tail);
+  R->cq_mask = *(unsigned *)(cq_ptr + p.cq_off.ring_mask);
+  R->cqes = (struct io_uring_cqe *)(cq_ptr + p.cq_off.cqes);
+  R->to_submit = 0;
+
+  /* Register the relay buffers */
+  R->bufs = Malloc(FIXED_BUFS * MAXBUF);
+  for(i = 0; i < FIXED_BUFS; i++) {
+    iov[i].iov_base = R->bufs + i * MAXBUF;
+    iov[i].iov_len = MAXBUF;
+    R->free_bufs[i] = i;
+  }
+  R->num_free = FIXED_BUFS;
+  if(syscall(__NR_io_uring_register, R->fd, IORING_REGISTER_BUFFERS,
+             iov, FIXED_BUFS) < 0) {
+    free(R->bufs);
+    close(R->fd);
+    return -1;
+  }
+
+  if(pipe(R->dnsfd) < 0) {
+    free(R->bufs);
+    close(R->fd);
+    return -1;
+  }
+
+  R->listenfd = listenfd;
+  R->multishot = 1;
+  return 0;
+}
+
+/*
+ * get_sqe: Returns a cleared submission queue entry, flushing the queue
+ *          to the kernel first if it is full.
+ */
+static struct io_uring_sqe *get_sqe(ring *R) {
+  unsigned tail = *R->sq_tail;
+  unsigned index;
+  struct io_uring_sqe *sqe;
+
+  while(tail - __atomic_load_n(R->sq_head, __ATOMIC_ACQUIRE) >=
+        R->sq_entries) {
+    ring_enter(R, 0);
+  }
+  index = tail & R->sq_mask;
+  sqe = &R->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  R->sq_array[index] = index;
+  __atomic_store_n(R->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  R->to_submit++;
+  return sqe;
+}
+
+/*
+ * ring_enter: Submits the queued entries and waits for at least wait_nr
+ *             completions. Returns 0 on success, -1 on error.
+ */
+static int ring_enter(ring *R, unsigned wait_nr) {
+  int rc;
+
+  while((rc = syscall(__NR_io_uring_enter, R->fd, R->to_submit, wait_nr,
+                      wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0)) < 0) {
+    if(errno != EINTR && errno != EAGAIN && errno != EBUSY)
+      return -1;
+  }
+  R->to_submit -= rc;
+  return 0;
+}
+
+/*
+ * run_ring: Submits queued operations and handles their completions
+ *           forever.
+ */
+static void run_ring(ring *R) {
+  queue_accept(R);
+  queue_dns(R);
+  while(1) {
+    unsigned head, tail;
+
+    if(ring_enter(R, 1) < 0)
+      unix_error("io_uring_enter error");
+
+    head = *R->cq_head;
+    tail = __atomic_load_n(R->cq_tail, __ATOMIC_ACQUIRE);
+    while(head != tail) {
+      struct io_uring_cqe *cqe = &R->cqes[head & R->cq_mask];
+      uint64_t data = cqe->user_data;
+      int res = cqe->res;
+      unsigned flags = cqe->flags;
+
+      /* Free the slot before handling, which may wait on the kernel */
+      head++;
+      __atomic_store_n(R->cq_head, head, __ATOMIC_RELEASE);
+      handle_cqe(R, data, res, flags);
+    }
+  }
+}
+
+/*
+ * handle_cqe: Advances the connection whose operation completed.
+ */
+static void handle_cqe(ring *R, uint64_t data, int res, unsigned flags) {
+  uconn *c = (uconn *)(uintptr_t)(data & ~(uint64_t)OP_MASK);
+  int op = data & OP_MASK;
+
+  if(op == OP_ACCEPT) {
+    if(res >= 0) {
+      c = Calloc(1, sizeof(uconn));
+      c->R = R;
+      c->clientfd = res;
+      c->serverfd = -1;
+      c->buf_index = -1;
+      queue_recv(c);
+    }
+    else if(res == -EINVAL && R->multishot) {
+      /* Kernel without multishot accept, so accept one at a time */
+      R->multishot = 0;
+    }
+    if(!(flags & IORING_CQE_F_MORE))
+      queue_accept(R);
+    return;
+  }
+  if(op == OP_DNS) {
+    finish_resolve(R, res);
+    return;
+  }
+
+  c->pending--;
+  switch(op) {
+  case OP_RECV:
+    if(res <= 0) {
+      finish_conn(c);
+      return;
+    }
+    c->in_len += res;
+    c->in[c->in_len] = '\0';
+    if(strstr(c->in, "\r\n\r\n") != NULL) {
+      start_request(c);
+    }
+    else if(c->in_len == sizeof(c->in) - 1) {
+      send_status(c->clientfd, 400);
+      finish_conn(c);
+    }
+    else {
+      queue_recv(c);
+    }
+    break;
+
+  case OP_SEND_HIT:
+    if(res < 0) {
+      c->failed = 1;
+      if(!c->hit_linked)
+        finish_conn(c);
+    }
+    else {
+      c->hit_pos += res;
+      if(c->hit_pos < c->hit->size)
+        queue_hit(c);
+    }
+    break;
+
+  case OP_CLOSE:
+    /* A cancelled close means the linked send fell short */
+    if(res == -ECANCELED && !c->failed)
+      return;
+    if(res == -ECANCELED)
+      close(c->clientfd);
+    c->clientfd = -1;
+    finish_conn(c);
+    break;
+
+  case OP_CONNECT:
+    if(res < 0) {
+      close(c->serverfd);
+      c->serverfd = -1;
+      c->next_addr++;
+      queue_connect(c);
+      return;
+    }
+    queue_send(c, OP_SEND_SERVER, c->serverfd, c->out, c->out_len);
+    break;
+
+  case OP_SEND_SERVER:
+    if(res < 0) {
+      finish_conn(c);
+      return;
+    }
+    c->out_pos += res;
+    if(c->out_pos < c->out_len)
+      queue_send(c, OP_SEND_SERVER, c->serverfd, c->out + c->out_pos,
+                 c->out_len - c->out_pos);
+    else
+      start_relay(c);
+    break;
+
+  case OP_READ_SERVER:
+    if(res < 0) {
+      finish_conn(c);
+      return;
+    }
+    relay_chunk(c, res);
+    break;
+
+  case OP_SEND_CLIENT:
+    if(res < 0) {
+      finish_conn(c);
+      return;
+    }
+    c->relay_pos += res;
+    if(c->relay_pos < c->relay_len)
+      queue_send(c, OP_SEND_CLIENT, c->clientfd, c->relay + c->relay_pos,
+                 c->relay_len - c->relay_pos);
+    else
+      queue_read(c);
+    break;
+  }
+}
+
+/*
+ * queue_accept: Queues an accept on the listening socket, multishot when
+ *               the kernel supports it.
+ */
+static void queue_accept(ring *R) {
+  struct io_uring_sqe *sqe = get_sqe(R);
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = R->listenfd;
+  if(R->multishot)
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->user_data = OP_ACCEPT;
+}
+
+/*
+ * queue_dns: Queues a read of finished lookups from the DNS pipe.
+ */
+static void queue_dns(ring *R) {
+  struct io_uring_sqe *sqe = get_sqe(R);
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = R->dnsfd[0];
+  sqe->addr = (uintptr_t)R->dns_done;
+  sqe->len = sizeof(R->dns_done);
+  sqe->user_data = OP_DNS;
+}
+
+/*
+ * queue_recv: Queues a receive of more of the request from the client.
+ */
+static void queue_recv(uconn *c) {
+  struct io_uring_sqe *sqe = get_sqe(c->R);
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = c->clientfd;
+  sqe->addr = (uintptr_t)(c->in + c->in_len);
+  sqe->len = sizeof(c->in) - 1 - c->in_len;
+  sqe->user_data = (uintptr_t)c | OP_RECV;
+  c->pending++;
+}
+
+/*
+ * queue_hit: Queues a sendmsg of the rest of the cached object. If it
+ *            covers all of the rest, links a close of the client socket
+ *            to it.
+ */
+static void queue_hit(uconn *c) {
+  struct io_uring_sqe *sqe = get_sqe(c->R);
+  int n = seg_iov(c->hit->response, c->hit_pos, c->hit->size,
+                  c->hit_iov, SEG_IOVS);
+  int len = 0;
+  int i;
+
+  for(i = 0; i < n; i++) {
+    len += c->hit_iov[i].iov_len;
+  }
+  memset(&c->hit_msg, 0, sizeof(c->hit_msg));
+  c->hit_msg.msg_iov = c->hit_iov;
+  c->hit_msg.msg_iovlen = n;
+  c->hit_linked = (c->hit_pos + len == c->hit->size);
+
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = c->clientfd;
+  sqe->addr = (uintptr_t)&c->hit_msg;
+  sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+  sqe->user_data = (uintptr_t)c | OP_SEND_HIT;
+  c->pending++;
+  if(!c->hit_linked)
+    return;
+
+  sqe->flags = IOSQE_IO_LINK;
+  sqe = get_sqe(c->R);
+  sqe->opcode = IORING_OP_CLOSE;
+  sqe->fd = c->clientfd;
+  sqe->user_data = (uintptr_t)c | OP_CLOSE;
+  c->pending++;
+}
+
+/*
+ * queue_connect: Queues a connect to the next server address, and reports
+ *                an error to the client if none are left.
+ */
+static void queue_connect(uconn *c) {
+  for(; c->next_addr < c->addrs.num; c->next_addr++) {
+    dns_addr *p = &c->addrs.addr[c->next_addr];
+    if((c->serverfd = socket(p->family, SOCK_STREAM, 0)) >= 0) {
+      struct io_uring_sqe *sqe = get_sqe(c->R);
+      sqe->opcode = IORING_OP_CONNECT;
+      sqe->fd = c->serverfd;
+      sqe->addr = (uintptr_t)&p->addr;
+      sqe->off = p->len;
+      sqe->user_data = (uintptr_t)c | OP_CONNECT;
+      c->pending++;
+      return;
+    }
+  }
+
+  send_status(c->clientfd, 404);
+  finish_conn(c);
+}
+
+/*
+ * queue_send: Queues a send of len bytes of buf on fd.
+ */
+static void queue_send(uconn *c, int op, int fd, char *buf, int len) {
+  struct io_uring_sqe *sqe = get_sqe(c->R);
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = fd;
+  sqe->addr = (uintptr_t)buf;
+  sqe->len = len;
+  sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+  sqe->user_data = (uintptr_t)c | op;
+  c->pending++;
+}
+
+/*
+ * queue_read: Queues a read of the next chunk of the response, into the
+ *             connection's registered buffer if it has one.
+ */
+static void queue_read(uconn *c) {
+  struct io_uring_sqe *sqe = get_sqe(c->R);
+  if(c->buf_index >= 0) {
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->buf_index = c->buf_index;
+  }
+  else {
+    sqe->opcode = IORING_OP_RECV;
+  }
+  sqe->fd = c->serverfd;
+  sqe->addr = (uintptr_t)c->relay;
+  sqe->len = MAXBUF;
+  sqe->user_data = (uintptr_t)c | OP_READ_SERVER;
+  c->pending++;
+}
+
+/*
+ * start_request: Parses the buffered request, then either serves it from
+ *                the cache or starts connecting to the server.
+ */
+static void start_request(uconn *c) {
+  char host[MAXLINE], req_port[MAXLINE];
+  int status;
+
+  if((status = parse_request(c->in, c->request, host, req_port,
+                             &c->out)) != 0) {
+    send_status(c->clientfd, status);
+    finish_conn(c);
+    return;
+  }
+  c->out_len = strlen(c->out);
+
+  /* Check if request is in the cache, which pins the object until sent */
+  if((c->hit = cache_lookup(proxy_cache, c->request)) != NULL &&
+     (object_fresh(c->hit) || refresh_stale(c->hit))) {
+    queue_hit(c);
+    return;
+  }
+
+  /*
+   * Stale objects past the stale window are fetched anew, replacing them
+   * in the cache, while those within it are refreshed in the background
+   */
+  if(c->hit != NULL) {
+    release_object(c->hit);
+    c->hit = NULL;
+  }
+
+  /* Resolve the server, on a resolver thread if the name is not cached */
+  if((status = dns_lookup_async(host, req_port, &c->addrs, c->R->dnsfd[1],
+                                c)) < 0) {
+    send_status(c->clientfd, 404);
+    finish_conn(c);
+    return;
+  }
+  if(status > 0) {
+    c->pending++;
+    return;
+  }
+  c->next_addr = 0;
+  queue_connect(c);
+}
+
+/*
+ * finish_resolve: Carries on with every connection whose lookup was read
+ *                 from the DNS pipe, connecting to the server, and queues
+ *                 the next read.
+ */
+static void finish_resolve(ring *R, int res) {
+  int i;
+
+  /* The resolvers write whole pointers atomically, so none is split */
+  for(i = 0; i < res / (int)sizeof(dns_query *); i++) {
+    dns_query *q = R->dns_done[i];
+    uconn *c = q->arg;
+
+    c->pending--;
+    if(q->status < 0) {
+      send_status(c->clientfd, 404);
+      finish_conn(c);
+    }
+    else {
+      c->addrs = q->addrs;
+      c->next_addr = 0;
+      queue_connect(c);
+    }
+    dns_query_free(q);
+  }
+  if(res < 0 && res != -EINTR && res != -EAGAIN) {
+    errno = -res;
+    unix_error("dns pipe read error");
+  }
+  queue_dns(R);
+}
+
+/*
+ * start_relay: Takes a registered buffer for the response, or a plain
+ *              one if they are all in use, and queues the first read.
+ */
+static void start_relay(uconn *c) {
+  ring *R = c->R;
+
+  if(R->num_free > 0) {
+    c->buf_index = R->free_bufs[--R->num_free];
+    c->relay = R->bufs + c->buf_index * MAXBUF;
+  }
+  else {
+    c->relay = Malloc(MAXBUF);
+  }
+  c->cacheable = 1;
+  frame_init(&c->frame);
+  queue_read(c);
+}
+
+/*
+ * relay_chunk: Adds a chunk read from the server to the cache object if it
+ *              still fits and queues its send to the client. At the end of
+ *              the response, fills the cache if the response arrived
+ *              whole, and finishes the connection.
+ */
+static void relay_chunk(uconn *c, int n) {
+  if(n == 0) {
+    object *new_obj;
+    /* The server may have closed the connection before the end */
+    if(c->frame.state != FRAME_DONE && c->frame.state != FRAME_UNTIL_CLOSE)
+      c->cacheable = 0;
+    if(c->cacheable)
+      segbuf_trim(&c->response);
+    if(c->cacheable &&
+       (new_obj = response_object(c->request, &c->response)) != NULL) {
+      segbuf_init(&c->response);
+      cache_store(proxy_cache, new_obj);
+    }
+    finish_conn(c);
+    return;
+  }
+
+  if(c->cacheable) {
+    if((c->response.size == 0 &&
+        response_length(c->relay, n) > max_object_size) ||
+       (c->response.size + n) > max_object_size) {
+      c->cacheable = 0;
+      segbuf_free(&c->response);
+    }
+    else {
+      segbuf_append(&c->response, c->relay, n);
+      frame_scan(&c->frame, c->relay, n);
+    }
+  }
+  c->relay_len = n;
+  c->relay_pos = 0;
+  queue_send(c, OP_SEND_CLIENT, c->clientfd, c->relay, n);
+}
+
+/*
+ * finish_conn: Closes the connection's sockets and frees it,
+ *              once no operation on it is in flight.
+ */
+static void finish_conn(uconn *c) {
+  if(c->pending > 0)
+    return;
+
+  if(c->clientfd >= 0)
+    close(c->clientfd);
+  if(c->serverfd >= 0)
+    close(c->serverfd);
+  if(c->hit != NULL)
+    release_object(c->hit);
+  if(c->buf_index >= 0)
+    c->R->free_bufs[c->R->num_free++] = c->buf_index;
+  else
+    free(c->relay);
+  free(c->out);
+  segbuf_free(&c->response);
+  free(c);
+}
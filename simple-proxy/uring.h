@@ -0,0 +1,8 @@
+#ifndef __URING_H__
+#define __URING_H__
+
+/* Runs the io_uring engine with the given number of rings, or returns -1
+   if the kernel does not support it */
+int uring_run(int listenfd, int loops);
+
+#endif /* __URING_H__ */